@@ -8,6 +8,8 @@ import subprocess
 import functools
 import os
 import base64
+import mmap
+import struct
 import re
 import sys
 import warnings
@@ -610,7 +612,29 @@ def dilate_gerber(layer, bounds, dilation, curve_tolerance):
 def svg_to_gerber(infile, outline_mode=False, format='gerber', **kwargs):
     infile = Path(infile)
 
-    args = [ '--format', ('gerber-outline' if outline_mode else format),
+    with tempfile.NamedTemporaryFile(suffix='.gbr') as temp_gbr:
+        # For gerber output, have svg-flatten write a binary polygon stream that we can load without parsing gerber
+        # text. The stream format does not map aperture macros to gerbonara, so fall back to gerber text for those.
+        if format == 'gerber' and not kwargs.get('use_apertures_for_patterns'):
+            try:
+                run_svg_flatten(infile, temp_gbr.name, 'binary-outline' if outline_mode else 'binary', **kwargs)
+                return load_polygon_stream(temp_gbr.name)
+
+            except (subprocess.CalledProcessError, click.ClickException) as e:
+                # svg-flatten before 3.4.0 rejects the binary format. If something else went wrong, we will run into
+                # the same error again below.
+                logging.warning(f'svg-flatten could not write a binary polygon stream ({e}), falling back to gerber '
+                                'output. Binary output needs svg-flatten 3.4.0 or newer.')
+
+        run_svg_flatten(infile, temp_gbr.name, 'gerber-outline' if outline_mode else format, **kwargs)
+
+        if format != 'gerber':
+            return Path(temp_gbr.name).read_text()
+        else:
+            return gn.rs274x.GerberFile.open(temp_gbr.name)
+
+def run_svg_flatten(infile, outfile, out_format, **kwargs):
+    args = [ '--format', out_format,
             '--precision', '6', # intermediate file, use higher than necessary precision
             ]
 
@@ -620,52 +644,119 @@ def svg_to_gerber(infile, outline_mode=False, format='gerber', **kwargs):
             if not isinstance(v, bool):
                 args.append(str(v))
 
-    with tempfile.NamedTemporaryFile(suffix='.gbr') as temp_gbr:
-        args += [str(infile), str(temp_gbr.name)]
+    args += [str(infile), str(outfile)]
 
-        logging.debug(f'svg-flatten args: {" ".join(args)}')
+    logging.debug(f'svg-flatten args: {" ".join(args)}')
 
-        if 'SVG_FLATTEN' in os.environ:
-            logging.debug('using svg-flatten at $SVG_FLATTEN')
-            subprocess.run([os.environ['SVG_FLATTEN'], *args], check=True)
+    if 'SVG_FLATTEN' in os.environ:
+        logging.debug('using svg-flatten at $SVG_FLATTEN')
+        subprocess.run([os.environ['SVG_FLATTEN'], *args], check=True)
+        return
 
-        else:
-            # By default, try four options:
-            for candidate in [
-                    # somewhere in $PATH
-                    'svg-flatten',
-                    None, # direct WASI import
-                    'wasi-svg-flatten',
+    # By default, try four options:
+    for candidate in [
+            # somewhere in $PATH
+            'svg-flatten',
+            None, # direct WASI import
+            'wasi-svg-flatten',
 
-                    # in user-local pip installation
-                    Path.home() / '.local' / 'bin' / 'svg-flatten',
-                    Path.home() / '.local' / 'bin' / 'wasi-svg-flatten',
+            # in user-local pip installation
+            Path.home() / '.local' / 'bin' / 'svg-flatten',
+            Path.home() / '.local' / 'bin' / 'wasi-svg-flatten',
 
-                    # next to our current python interpreter (e.g. in virtualenv)
-                    str(Path(sys.executable).parent / 'svg-flatten'),
-                    str(Path(sys.executable).parent / 'wasi-svg-flatten')]:
+            # next to our current python interpreter (e.g. in virtualenv)
+            str(Path(sys.executable).parent / 'svg-flatten'),
+            str(Path(sys.executable).parent / 'wasi-svg-flatten')]:
 
-                try:
-                    if candidate is None:
-                        import svg_flatten_wasi
-                        svg_flatten_wasi.run_svg_flatten.callback(args[-2], args[-1], args[:-2], no_usvg=False)
-                        logging.debug('using svg_flatten_wasi python package')
+        try:
+            if candidate is None:
+                import svg_flatten_wasi
+                svg_flatten_wasi.run_svg_flatten.callback(args[-2], args[-1], args[:-2], no_usvg=False)
+                logging.debug('using svg_flatten_wasi python package')
 
-                    else:
-                        subprocess.run([candidate, *args], check=True)
-                        logging.debug('using svg-flatten at', candidate)
+            else:
+                subprocess.run([candidate, *args], check=True)
+                logging.debug('using svg-flatten at', candidate)
+
+            return
+        except (FileNotFoundError, ModuleNotFoundError):
+            continue
+
+    raise SystemError('svg-flatten executable not found')
+
+POLYGON_STREAM_MAGIC = b'GBRLZPLY'
+REC_LAYER, REC_POLARITY, REC_APERTURE, REC_POLYGON, REC_FLASH, REC_MACRO, REC_END = range(1, 8)
+
+def load_polygon_stream(path):
+    """ Load the binary polygon stream written by svg-flatten --format binary into a gerbonara GerberFile.
 
+    See BinaryPolygonOutput in svg-flatten's gerbolyze.hpp for the format. """
+    path = Path(path)
+    grb = gn.rs274x.GerberFile(original_path=path)
+    MM = gn.utils.MM
+
+    with open(path, 'rb') as f:
+        data = f.read(len(POLYGON_STREAM_MAGIC) + 8)
+        if len(data) < len(POLYGON_STREAM_MAGIC) + 8 or data[:len(POLYGON_STREAM_MAGIC)] != POLYGON_STREAM_MAGIC:
+            raise ValueError(f'{path} is not an svg-flatten polygon stream')
+
+        version, digits = struct.unpack_from('<Ii', data, len(POLYGON_STREAM_MAGIC))
+        if version != 1:
+            raise ValueError(f'Unsupported svg-flatten polygon stream version {version}')
+        unit = 10.0**-digits
+
+        with mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ) as buf:
+            pos = len(POLYGON_STREAM_MAGIC) + 8 + 16 # skip width, height
+            dark = True
+            aperture = None
+            apertures = {}
+
+            while pos + 8 <= len(buf):
+                rec_type, length = struct.unpack_from('<II', buf, pos)
+                pos += 8
+
+                if rec_type == REC_END:
                     break
-                except (FileNotFoundError, ModuleNotFoundError):
-                    continue
 
-            else:
-                raise SystemError('svg-flatten executable not found')
- 
-        if format != 'gerber':
-            return Path(temp_gbr.name).read_text()
-        else:
-            return gn.rs274x.GerberFile.open(temp_gbr.name)
+                elif rec_type == REC_POLARITY:
+                    dark, = struct.unpack_from('<I', buf, pos)
+                    dark = bool(dark)
+
+                elif rec_type == REC_APERTURE:
+                    if length == 0:
+                        aperture = None
+                    else:
+                        size, = struct.unpack_from('<i', buf, pos)
+                        if size not in apertures:
+                            apertures[size] = gn.apertures.CircleAperture(size * unit, unit=MM)
+                        aperture = apertures[size]
+
+                elif rec_type in (REC_POLYGON, REC_FLASH):
+                    # Copy the coordinates out of the mmap, since numpy views must not outlive it.
+                    points = np.frombuffer(buf, dtype='<i4', count=length//4, offset=pos).reshape(-1, 2) * unit
+                    points = [tuple(pt) for pt in points.tolist()]
+
+                    if rec_type == REC_FLASH:
+                        (x, y), = points
+                        grb.objects.append(gn.graphic_objects.Flash(x, y, aperture, unit=MM, polarity_dark=dark))
+
+                    elif aperture is None:
+                        grb.objects.append(gn.graphic_objects.Region(points, unit=MM, polarity_dark=dark))
+
+                    else:
+                        if len(points) == 1:
+                            points = points * 2
+                        for (x1, y1), (x2, y2) in zip(points, points[1:]):
+                            grb.objects.append(gn.graphic_objects.Line(x1, y1, x2, y2, aperture,
+                                                                        unit=MM, polarity_dark=dark))
+
+                elif rec_type == REC_MACRO:
+                    raise ValueError('Aperture macros in svg-flatten polygon streams are not supported.')
+
+                # REC_LAYER and unknown records are skipped
+                pos += (length + 3) & ~3
+
+    return grb
 
 if __name__ == '__main__':
     cli()
@@ -114,6 +114,7 @@ namespace gerbolyze {
                 x0 = n_x0;
                 y0 = n_y0;
                 decomposed = false;
+                inverse_cached = false;
 
                 return *this;
             };
@@ -263,7 +264,7 @@ namespace gerbolyze {
                         });
             }
 
-            /* Transform given clipper paths */
+            /* Transform given clipper paths. Paths are cleared if this transform cannot be inverted. */
             void phys2doc_clipper(ClipperLib::Paths &paths) {
                 for (auto &p : paths) {
                     phys2doc_clipper(p);
@@ -271,20 +272,17 @@ namespace gerbolyze {
             }
 
             void phys2doc_clipper(ClipperLib::Path &path) {
-                xform2d copy(*this);
-                bool inverted = false;
-                copy.invert(&inverted);
-                if (!inverted) {
+                if (!update_inverse()) {
                     path.clear();
                     return;
                 }
 
                 std::transform(path.begin(), path.end(), path.begin(),
-                        [&copy](ClipperLib::IntPoint p) -> ClipperLib::IntPoint {
-                            d2p out(copy.doc2phys(d2p{p.X / clipper_scale, p.Y / clipper_scale}));
+                        [this](ClipperLib::IntPoint p) -> ClipperLib::IntPoint {
+                            double px = p.X / clipper_scale, py = p.Y / clipper_scale;
                             return {
-                                (ClipperLib::cInt)round(out[0] * clipper_scale),
-                                (ClipperLib::cInt)round(out[1] * clipper_scale)
+                                (ClipperLib::cInt)round((ixx * px + ixy * py + ix0) * clipper_scale),
+                                (ClipperLib::cInt)round((iyx * px + iyy * py + iy0) * clipper_scale)
                             };
                         });
             }
@@ -309,10 +307,27 @@ namespace gerbolyze {
             }
 
         private:
+            /* Compute the inverse matrix if we do not have it cached yet. Returns false if this transform cannot be
+             * inverted. Like the decomposition, the cache is kept when copying a transform. */
+            bool update_inverse() {
+                if (!inverse_cached) {
+                    xform2d inv(*this);
+                    inv.invert(&inverse_ok);
+                    ixx = inv.xx, ixy = inv.xy, ix0 = inv.x0;
+                    iyx = inv.yx, iyy = inv.yy, iy0 = inv.y0;
+                    inverse_cached = true;
+                }
+                return inverse_ok;
+            }
+
             double xx, xy, x0,
                    yx, yy, y0;
             double theta, m, s_x, s_y;
             double f_min, f_max;
             bool decomposed = false;
+            double ixx, ixy, ix0,
+                   iyx, iyy, iy0;
+            bool inverse_cached = false;
+            bool inverse_ok = false;
     };
 }
@@ -21,8 +21,14 @@
 #include <map>
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <array>
 #include <cstdint>
+#include <memory>
+#include <functional>
+#include <vector>
+#include <span>
+#include <initializer_list>
 
 #include <pugixml.hpp>
 
@@ -31,9 +37,7 @@
 
 namespace gerbolyze {
 
-    constexpr char lib_version[] = "3.3.0";
-
-    typedef std::function<std::vector<d2p> *(double, double, double)> sampling_fun;
+    constexpr char lib_version[] = "3.4.0";
 
     enum GerberPolarityToken {
         GRB_POL_CLEAR,
@@ -65,12 +69,45 @@ namespace gerbolyze {
         d2p m_offset;
     };
 
+    /* A run of polygons that share polarity and aperture. Sinking a BatchToken is equivalent to sinking its polarity,
+     * its aperture and then each of its polygons in order, but lets sinks handle the whole run at once. Sinks may move
+     * out of the polygons. */
+    class BatchToken {
+    public:
+        BatchToken(std::span<Polygon> polys, GerberPolarityToken polarity, ApertureToken aperture=ApertureToken())
+            : m_polys(polys), m_polarity(polarity), m_aperture(aperture) {}
+        std::span<Polygon> m_polys;
+        GerberPolarityToken m_polarity;
+        ApertureToken m_aperture;
+    };
+
+    /* A region with holes. The first polygon is the region's outline, the others are holes inside of it. Holes do not
+     * overlap each other, and any of the polygons may run either way round. This is only sent to sinks that return true
+     * from can_do_holes(), all other sinks get polygons with their holes cut out. Sinks may move out of the polygons. */
+    class PolygonWithHolesToken {
+    public:
+        PolygonWithHolesToken(std::span<Polygon> contours) : m_contours(contours) {}
+        std::span<Polygon> m_contours;
+    };
+
     class PolygonSink {
         public:
             virtual ~PolygonSink() {}
             virtual void header(d2p origin, d2p size) {(void) origin; (void) size;}
             virtual bool can_do_apertures() { return false; }
+            virtual bool can_do_holes() { return false; }
             virtual PolygonSink &operator<<(const Polygon &poly) = 0;
+            /* Sinks that store or modify polygons can override this to take ownership instead of copying. */
+            virtual PolygonSink &operator<<(Polygon &&poly) {
+                return *this << static_cast<const Polygon &>(poly);
+            };
+            virtual PolygonSink &operator<<(const BatchToken &tok) {
+                *this << tok.m_polarity << tok.m_aperture;
+                for (auto &poly : tok.m_polys) {
+                    *this << std::move(poly);
+                }
+                return *this;
+            };
             virtual PolygonSink &operator<<(const ClipperLib::Paths paths) {
                 for (const auto &poly : paths) {
                     *this << poly;
@@ -78,13 +115,14 @@ namespace gerbolyze {
                 return *this;
             };
             virtual PolygonSink &operator<<(const ClipperLib::Path poly) {
-                vector<array<double, 2>> out;
+                Polygon out;
+                out.reserve(poly.size());
                 for (const auto &p : poly) {
                     out.push_back(std::array<double, 2>{
                             ((double)p.X) / clipper_scale, ((double)p.Y) / clipper_scale
                     });
                 }
-                return *this << out;
+                return *this << std::move(out);
             };
             virtual PolygonSink &operator<<(const LayerNameToken &) { return *this; };
             virtual PolygonSink &operator<<(GerberPolarityToken pol) = 0;
@@ -94,13 +132,29 @@ namespace gerbolyze {
                 cerr << "Error: pattern to aperture mapping is not supporte for this output." << endl;
                 return *this;
             };
+            virtual PolygonSink &operator<<(const PolygonWithHolesToken &) {
+                cerr << "Error: polygons with holes are not supported for this output." << endl;
+                return *this;
+            };
             virtual void footer() {}
     };
 
+    enum FlattenEngine {
+        /* Subtract every clear polygon from the dark polygons as soon as it arrives, using CavalierContours */
+        FLATTEN_PER_POLYGON,
+        /* Buffer runs of dark and clear polygons, and apply each clear run in a single Clipper boolean operation */
+        FLATTEN_BATCH,
+        /* Like FLATTEN_BATCH, but clip everything into square tiles that are flattened independently and in parallel.
+         * This bounds the size of each boolean operation. Like with FLATTEN_BATCH, all tiles are kept until the end of the
+         * layer. */
+        FLATTEN_PARALLEL_BATCH,
+    };
+
     class Flattener_D;
     class Flattener : public PolygonSink {
         public:
-            Flattener(PolygonSink &sink);
+            /* tile_size is in the same units as incoming polygons, and only used by FLATTEN_PARALLEL_BATCH. */
+            Flattener(PolygonSink &sink, FlattenEngine engine=FLATTEN_PER_POLYGON, double tile_size=10.0);
             virtual ~Flattener();
             virtual void header(d2p origin, d2p size);
             virtual Flattener &operator<<(const Polygon &poly);
@@ -114,13 +168,39 @@ namespace gerbolyze {
             void render_out_clear_polys();
             void flush_polys_to_sink();
             PolygonSink &m_sink;
+            FlattenEngine m_engine;
+            double m_tile_size;
             GerberPolarityToken m_current_polarity = GRB_POL_DARK;
             Flattener_D *d;
     };
 
+    /* Collects a run of consecutive regions of the same polarity for the region merger and the dilater, cut into
+     * batches of limited polygon count and spatial extent so that the cost of each union stays bounded. Polygons are
+     * converted to Clipper coordinates, and all get the same orientation, since overlapping polygons of opposite
+     * orientations would cancel out under the nonzero rule. */
+    class RegionBatcher {
+        public:
+            /* max_extent is in the same units as incoming polygons */
+            RegionBatcher(double max_extent, size_t max_polys) : m_max_extent(max_extent), m_max_polys(max_polys) {}
+            void add(const Polygon &poly);
+            bool empty() const { return m_batches.empty(); }
+            /* Runs are processed once they reach this many polygons to bound memory use */
+            bool full() const { return m_num_polys >= max_run_polys; }
+            /* Returns the batches collected so far in input order, and starts a new run */
+            std::vector<ClipperLib::Paths> take();
+
+        private:
+            static constexpr size_t max_run_polys = 16384;
+            double m_max_extent;
+            size_t m_max_polys;
+            std::vector<ClipperLib::Paths> m_batches;
+            ClipperLib::IntRect m_batch_bounds;
+            size_t m_num_polys = 0;
+    };
+
     class Dilater : public PolygonSink {
         public:
-            Dilater(PolygonSink &sink, double dilation) : m_sink(sink), m_dilation(dilation) {}
+            Dilater(PolygonSink &sink, double dilation) : m_sink(sink), m_dilation(dilation), m_run(batch_extent, batch_polys) {}
             virtual void header(d2p origin, d2p size);
             virtual Dilater &operator<<(const Polygon &poly);
             virtual Dilater &operator<<(const LayerNameToken &layer_name);
@@ -130,9 +210,41 @@ namespace gerbolyze {
             virtual void footer();
 
         private:
+            /* Limits of the batches that runs of regions are dilated in, in mm */
+            static constexpr double batch_extent = 10.0;
+            static constexpr size_t batch_polys = 1024;
+
+            void flush();
+            void emit(ClipperLib::PolyTree &ptree);
             PolygonSink &m_sink;
             double m_dilation;
             GerberPolarityToken m_current_polarity = GRB_POL_DARK;
+            bool m_aperture_set = false;
+            RegionBatcher m_run;
+    };
+
+    class RegionMerger : public PolygonSink {
+        public:
+            /* max_extent is in the same units as incoming polygons */
+            RegionMerger(PolygonSink &sink, double max_extent=25.0, size_t max_polys=1024)
+                : m_sink(sink), m_run(max_extent, max_polys) {}
+            virtual void header(d2p origin, d2p size);
+            virtual bool can_do_apertures();
+            virtual RegionMerger &operator<<(const Polygon &poly);
+            virtual RegionMerger &operator<<(const LayerNameToken &layer_name);
+            virtual RegionMerger &operator<<(GerberPolarityToken pol);
+            virtual RegionMerger &operator<<(const ApertureToken &tok);
+            virtual RegionMerger &operator<<(const FlashToken &tok);
+            virtual RegionMerger &operator<<(const PatternToken &tok);
+            virtual void footer();
+
+        private:
+            void flush();
+            PolygonSink &m_sink;
+            GerberPolarityToken m_current_polarity = GRB_POL_DARK;
+            bool m_aperture_set = false;
+            RegionBatcher m_run;
+            size_t m_polys_in = 0, m_polys_out = 0;
     };
 
     class PolygonScaler : public PolygonSink {
@@ -140,7 +252,10 @@ namespace gerbolyze {
             PolygonScaler(PolygonSink &sink, double scale=1.0) : m_sink(sink), m_scale(scale) {}
             virtual void header(d2p origin, d2p size);
             virtual bool can_do_apertures();
+            virtual bool can_do_holes();
             virtual PolygonScaler &operator<<(const Polygon &poly);
+            virtual PolygonScaler &operator<<(Polygon &&poly);
+            virtual PolygonScaler &operator<<(const PolygonWithHolesToken &tok);
             virtual PolygonScaler &operator<<(const LayerNameToken &layer_name);
             virtual PolygonScaler &operator<<(GerberPolarityToken pol);
             virtual PolygonScaler &operator<<(const ApertureToken &tok);
@@ -153,19 +268,40 @@ namespace gerbolyze {
             double m_scale;
     };
 
+    class OrderedBlockWriter;
     class StreamPolygonSink : public PolygonSink {
     public:
-        StreamPolygonSink(std::ostream &out, bool only_polys=false) : m_only_polys(only_polys), m_out(out) {}
-        virtual ~StreamPolygonSink() {}
+        StreamPolygonSink(std::ostream &out, bool only_polys=false);
+        virtual ~StreamPolygonSink();
         virtual void header(d2p origin, d2p size) { if (!m_only_polys) header_impl(origin, size); }
-        virtual void footer() { if (!m_only_polys) { footer_impl(); } m_out.flush(); }
+        virtual void footer();
+        /* Format output on this many background threads. 0 formats everything on the rendering thread. Output is the
+         * same either way. Ignored by sinks that do not format their output through encode(). */
+        void set_encoder_threads(size_t threads);
+        virtual bool can_encode_parallel() { return false; }
 
     protected:
+        typedef std::function<void (std::string &)> encoder_fun;
+
         virtual void header_impl(d2p origin, d2p size) = 0;
         virtual void footer_impl() = 0;
 
+        /* With encoder threads, subclasses hand their output to encode() as a formatting function instead of writing to
+         * m_out directly. These functions are run in batches on the encoder threads, and their output is written in
+         * order. sync() waits until all output has been written to m_out. */
+        bool parallel_encoding() const { return (bool)m_writer; }
+        void encode(encoder_fun fun);
+        void sync();
+
         bool m_only_polys = false;
         std::ostream &m_out;
+
+    private:
+        void submit_batch();
+
+        static constexpr size_t encoder_batch_size = 256;
+        std::unique_ptr<OrderedBlockWriter> m_writer;
+        std::vector<encoder_fun> m_batch;
     };
     
     extern const std::vector<std::string> kicad_default_layers;
@@ -221,6 +357,7 @@ namespace gerbolyze {
         bool pattern_complete_tiles_only = false;
         bool use_apertures_for_patterns = false;
         bool do_gerber_interpolation = true;
+        unsigned int vectorizer_seed = 0;
     };
 
     class RenderContext {
@@ -228,7 +365,8 @@ namespace gerbolyze {
             RenderContext(const RenderSettings &settings,
                     PolygonSink &sink,
                     const ElementSelector &sel,
-                    ClipperLib::Paths &clip);
+                    ClipperLib::Paths &clip,
+                    const xform2d &mat=xform2d());
             RenderContext(RenderContext &parent,
                     xform2d transform);
             RenderContext(RenderContext &parent,
@@ -326,18 +464,41 @@ namespace gerbolyze {
         lambda_sink_fun m_lambda;
     };
 
+    /* Collects polygons and their polarity into a list. Takes ownership of polygons passed as rvalues. */
+    class ListPolygonSink : public PolygonSink {
+    public:
+        ListPolygonSink(std::vector<std::pair<Polygon, GerberPolarityToken>> &out) : m_out(out) {}
+
+        virtual ListPolygonSink &operator<<(const Polygon &poly);
+        virtual ListPolygonSink &operator<<(Polygon &&poly);
+        virtual ListPolygonSink &operator<<(GerberPolarityToken pol);
+    private:
+        GerberPolarityToken m_currentPolarity = GRB_POL_DARK;
+        std::vector<std::pair<Polygon, GerberPolarityToken>> &m_out;
+    };
+
     class SimpleGerberOutput : public StreamPolygonSink {
     public:
         SimpleGerberOutput(std::ostream &out, bool only_polys=false, int digits_int=4, int digits_frac=6, double scale=1.0, d2p offset={0,0}, bool flip_polarity=false);
-        virtual ~SimpleGerberOutput() {}
+        virtual ~SimpleGerberOutput();
+        virtual void footer();
         virtual SimpleGerberOutput &operator<<(const Polygon &poly);
+        virtual SimpleGerberOutput &operator<<(Polygon &&poly);
+        virtual SimpleGerberOutput &operator<<(const BatchToken &tok);
         virtual SimpleGerberOutput &operator<<(GerberPolarityToken pol);
         virtual SimpleGerberOutput &operator<<(const ApertureToken &ap);
         virtual SimpleGerberOutput &operator<<(const FlashToken &tok);
         virtual SimpleGerberOutput &operator<<(const PatternToken &tok);
+        virtual SimpleGerberOutput &operator<<(const PolygonWithHolesToken &tok);
         virtual bool can_do_apertures() { return true; }
+        virtual bool can_encode_parallel() { return true; }
+        virtual bool can_do_holes() { return m_hole_regions; }
         virtual void header_impl(d2p origin, d2p size);
         virtual void footer_impl();
+        /* Cut holes out of dark regions using clear polarity regions instead of having them removed before. This is
+         * only correct if nothing that was drawn before a region overlaps its holes, since the clear regions erase it.
+         * Clear regions with holes are always deholed. */
+        void set_hole_regions(bool enable) { m_hole_regions = enable; }
 
     private:
         int m_digits_int;
@@ -348,31 +509,216 @@ namespace gerbolyze {
         d2p m_offset;
         double m_scale;
         bool m_flip_pol;
-        double m_current_aperture;
         bool m_aperture_set;
-        bool m_macro_aperture;
+        bool m_hole_regions = false;
+        GerberPolarityToken m_current_polarity = GRB_POL_DARK;
         unsigned int m_aperture_num;
+        unsigned int m_current_dcode;
+        /* D-codes of circular apertures by shape and quantized size */
+        std::map<std::pair<char, long long int>, unsigned int> m_apertures;
+
+        /* Everything needed to format coordinates, so polygons can be formatted on encoder threads */
+        struct CoordFormat {
+            int width;
+            double scale;
+            d2p offset;
+            double height;
+            long long int gerber_scale;
+        };
+        static void format_polygon(std::string &buf, const Polygon &poly, bool region, const CoordFormat &fmt);
+
+        static constexpr size_t buf_size = 1<<20;
+        std::string m_buf;
+        void flush_buf();
+        void put(std::string_view str);
+        void put(long long int val);
+        void put(double val);
+        void put_line(std::string_view str);
+        void end_line();
+        void put_xy(long long int x, long long int y, std::string_view dcode);
+    };
+
+    /* Compact binary polygon stream for handing geometry to other programs without a round trip through Gerber text.
+     * All fields are little-endian, and all records are 4-byte aligned so the file can be mmapped and read in place.
+     *
+     * File header (omitted with --no-header):
+     *   char[8] magic "GBRLZPLY", u32 version, i32 decimal digits of coordinates, f64 width, f64 height (mm)
+     *
+     * Records: u32 type, u32 payload length in bytes, payload padded with zeros to a multiple of 4 bytes.
+     *   LAYER: UTF-8 layer name. Empty when leaving a layer.
+     *   POLARITY: u32, 1 for dark and 0 for clear.
+     *   APERTURE: i32 circle diameter. Empty payload to go back to regions.
+     *   POLYGON: n * (i32 x, i32 y). Filled region when no aperture is set, stroked path otherwise.
+     *   FLASH: i32 x, i32 y of the current aperture.
+     *   MACRO: Macro aperture that replaces the current aperture. Sequence of (u32 polarity, u32 n, n * (i32 x, i32 y))
+     *          outlines relative to the flash position.
+     *   END: Empty. Last record of the file.
+     *
+     * Coordinates are in 10^-digits mm in the same coordinate system as our Gerber output. */
+    class BinaryPolygonOutput : public StreamPolygonSink {
+    public:
+        enum RecordType : uint32_t {
+            REC_LAYER = 1,
+            REC_POLARITY = 2,
+            REC_APERTURE = 3,
+            REC_POLYGON = 4,
+            REC_FLASH = 5,
+            REC_MACRO = 6,
+            REC_END = 7,
+        };
+        static constexpr uint32_t format_version = 1;
+
+        BinaryPolygonOutput(std::ostream &out, bool only_polys=false, int digits_frac=6, double scale=1.0, bool flip_polarity=false);
+        virtual ~BinaryPolygonOutput();
+        virtual void footer();
+        virtual BinaryPolygonOutput &operator<<(const Polygon &poly);
+        virtual BinaryPolygonOutput &operator<<(const LayerNameToken &layer_name);
+        virtual BinaryPolygonOutput &operator<<(GerberPolarityToken pol);
+        virtual BinaryPolygonOutput &operator<<(const ApertureToken &ap);
+        virtual BinaryPolygonOutput &operator<<(const FlashToken &tok);
+        virtual BinaryPolygonOutput &operator<<(const PatternToken &tok);
+        virtual bool can_do_apertures() { return true; }
+        virtual void header_impl(d2p origin, d2p size);
+        virtual void footer_impl();
+
+    private:
+        void begin_record(RecordType type, size_t len);
+        void end_record();
+        void put_u32(uint32_t val);
+        void put_i32(double val);
+        void put_xy(d2p pt);
+        void flush_buf();
+
+        int m_digits_frac;
+        long long int m_coord_scale;
+        double m_scale;
+        double m_height = 0.0;
+        d2p m_offset = {0, 0};
+        bool m_flip_pol;
+        bool m_aperture_set = false;
+        bool m_range_warned = false;
+
+        static constexpr size_t buf_size = 1<<20;
+        std::string m_buf;
+    };
+
+    /* GDSII stream output. GDSII has no notion of polarity, so this expects flattened input like KicadSexpOutput.
+     * Regions become BOUNDARY elements, strokes become round-ended PATH elements, and flashes are approximated by
+     * circular BOUNDARY elements. The database unit is 10^-digits_frac mm. */
+    class SimpleGDSIIOutput : public StreamPolygonSink {
+    public:
+        SimpleGDSIIOutput(std::ostream &out, bool only_polys=false, int digits_frac=6, double scale=1.0, std::string libname="gerbolyze", std::string strname="TOP", int layer=0, int datatype=0);
+        virtual ~SimpleGDSIIOutput();
+        virtual void header(d2p origin, d2p size);
+        virtual void footer();
+        virtual SimpleGDSIIOutput &operator<<(const Polygon &poly);
+        virtual SimpleGDSIIOutput &operator<<(GerberPolarityToken pol);
+        virtual SimpleGDSIIOutput &operator<<(const ApertureToken &ap);
+        virtual SimpleGDSIIOutput &operator<<(const FlashToken &tok);
+        virtual bool can_do_apertures() { return true; }
+        virtual void header_impl(d2p origin, d2p size);
+        virtual void footer_impl();
+
+        /* 8-byte GDSII real: sign bit, 7-bit base-16 exponent in excess-64, 56-bit mantissa */
+        static uint64_t gds_real8(double val);
+        /* Structure names may only contain A-Z, a-z, 0-9, _, ? and $, and may be at most 32 characters long */
+        static std::string sanitize_strname(std::string_view name);
+
+    private:
+        enum RecordType : uint16_t {
+            GDS_HEADER      = 0x0002,
+            GDS_BGNLIB      = 0x0102,
+            GDS_LIBNAME     = 0x0206,
+            GDS_UNITS       = 0x0305,
+            GDS_ENDLIB      = 0x0400,
+            GDS_BGNSTR      = 0x0502,
+            GDS_STRNAME     = 0x0606,
+            GDS_ENDSTR      = 0x0700,
+            GDS_BOUNDARY    = 0x0800,
+            GDS_PATH        = 0x0900,
+            GDS_LAYER       = 0x0D02,
+            GDS_DATATYPE    = 0x0E02,
+            GDS_WIDTH       = 0x0F03,
+            GDS_XY          = 0x1003,
+            GDS_ENDEL       = 0x1100,
+            GDS_PATHTYPE    = 0x2102,
+        };
+        /* Record length is a 16-bit byte count including the 4-byte record header */
+        static constexpr size_t max_xy_points = (0xffff - 4) / 8;
+
+        void put_u16(uint16_t val);
+        void put_i32(int32_t val);
+        void put_record(RecordType type);
+        void put_record(RecordType type, std::initializer_list<int16_t> vals);
+        void put_record(RecordType type, std::string_view str);
+        void put_timestamps(RecordType type);
+        void put_element(RecordType type, const std::vector<std::array<int32_t, 2>> &pts);
+        void put_boundary(const Polygon &poly);
+        std::array<int32_t, 2> quantize(d2p pt);
+        void flush_buf();
+
+        int m_digits_frac;
+        long long int m_db_scale;
+        double m_scale;
+        double m_height = 0.0;
+        d2p m_offset = {0, 0};
+        std::string m_libname;
+        std::string m_strname;
+        int m_layer;
+        int m_datatype;
+        double m_aperture_size = 0.0;
+        bool m_aperture_set = false;
+        bool m_dark = true;
+        bool m_clear_warned = false;
+        bool m_range_warned = false;
+
+        static constexpr size_t buf_size = 1<<20;
+        std::string m_buf;
     };
 
     class SimpleSVGOutput : public StreamPolygonSink {
     public:
         SimpleSVGOutput(std::ostream &out, bool only_polys=false, int digits_frac=6, std::string dark_color="#000000", std::string clear_color="#ffffff");
-        virtual ~SimpleSVGOutput() {}
+        virtual ~SimpleSVGOutput();
+        virtual void footer();
         virtual SimpleSVGOutput &operator<<(const Polygon &poly);
+        virtual SimpleSVGOutput &operator<<(Polygon &&poly);
         virtual SimpleSVGOutput &operator<<(GerberPolarityToken pol);
         virtual SimpleSVGOutput &operator<<(const ApertureToken &ap);
         virtual SimpleSVGOutput &operator<<(const FlashToken &tok);
+        virtual SimpleSVGOutput &operator<<(const PatternToken &tok);
+        virtual SimpleSVGOutput &operator<<(const PolygonWithHolesToken &tok);
         virtual bool can_do_apertures() { return true; }
+        virtual bool can_do_holes() { return true; }
+        virtual bool can_encode_parallel() { return true; }
         virtual void header_impl(d2p origin, d2p size);
         virtual void footer_impl();
 
     private:
+        void flush_batch();
+        void start_batch(size_t vertices);
+        void emit(std::string text);
+
         int m_digits_frac;
         std::string m_dark_color;
         std::string m_clear_color;
         std::string m_current_color;
         double m_stroke_width;
-        d2p m_offset;
+        d2p m_offset = {0, 0};
+
+        /* Polygons waiting to be written as one path element */
+        static constexpr size_t max_batch_vertices = 10000;
+        std::vector<Polygon> m_batch;
+        /* Parallel to m_batch, marks polygons that are holes in the polygon before them */
+        std::vector<bool> m_batch_holes;
+        size_t m_batch_vertices = 0;
+        std::string m_batch_color;
+        double m_batch_stroke_width = 0.0;
+
+        /* Ids of circle apertures by radius quantized to our output resolution */
+        std::map<long long int, size_t> m_circle_apertures;
+        int m_num_patterns = 0;
+        int m_current_pattern = -1;
     };
 
     class KicadSexpOutput : public StreamPolygonSink {
@@ -383,6 +729,7 @@ namespace gerbolyze {
         virtual KicadSexpOutput &operator<<(const LayerNameToken &layer_name);
         virtual KicadSexpOutput &operator<<(const FlashToken &tok);
         virtual KicadSexpOutput &operator<<(GerberPolarityToken pol);
+        virtual bool can_encode_parallel() { return true; }
         virtual void header_impl(d2p origin, d2p size);
         virtual void footer_impl();
 
@@ -34,3 +34,18 @@ LambdaPolygonSink& LambdaPolygonSink::operator<<(GerberPolarityToken pol) {
     m_currentPolarity = pol;
     return *this;
 }
+
+ListPolygonSink& ListPolygonSink::operator<<(const Polygon &poly) {
+    m_out.emplace_back(poly, m_currentPolarity);
+    return *this;
+}
+
+ListPolygonSink& ListPolygonSink::operator<<(Polygon &&poly) {
+    m_out.emplace_back(std::move(poly), m_currentPolarity);
+    return *this;
+}
+
+ListPolygonSink& ListPolygonSink::operator<<(GerberPolarityToken pol) {
+    m_currentPolarity = pol;
+    return *this;
+}
@@ -10,11 +10,15 @@
 #include <vector>
 #include <algorithm>
 #include <string>
+#ifndef WASI
+#include <thread>
+#endif
 #include <argagg.hpp>
 #include <gerbolyze.hpp>
 #include "vec_core.h"
 #include <base64.h>
 #include "util.h"
+#include "out_compress.h"
 
 using argagg::parser_results;
 using argagg::parser;
@@ -58,7 +62,7 @@ int main(int argc, char **argv) {
                 "Print version and exit",
                 0},
             {"ofmt", {"-o", "--format"},
-                "Output format. Supported: gerber, gerber-outline (for board outline layer), svg, s-exp (KiCAD S-Expression)",
+                "Output format. Supported: gerber, gerber-outline (for board outline layer), svg, s-exp (KiCAD S-Expression), gdsii, binary, binary-outline (binary polygon stream)",
                 1},
             {"precision", {"-p", "--precision"},
                 "Number of decimal places use for exported coordinates (gerber: 1-9, SVG: 0-*)",
@@ -72,6 +76,9 @@ int main(int argc, char **argv) {
             {"flip_gerber_polarity", {"-f", "--flip-gerber-polarity"},
                 "Flip polarity of all output gerber primitives for --format gerber.",
                 0},
+            {"gerber_hole_regions", {"--gerber-hole-regions"},
+                "Cut holes out of dark gerber regions using clear polarity regions instead of splitting regions with holes. Clear regions also erase anything drawn below a hole before. Clear regions with holes are still split.",
+                0},
             {"flip_svg_color_interpretation", {"-i", "--svg-white-is-gerber-dark"},
                 "Flip polarity of SVG color interpretation. This affects only SVG primitives like paths and NOT embedded bitmaps. With -i: white -> \"dark\" gerber primitive, i.e. silk or copper present, or mask absent.",
                 0},
@@ -108,9 +115,24 @@ int main(int argc, char **argv) {
             {"flatten", {"--flatten"},
                 "Flatten output so it only consists of non-overlapping white polygons. This perform composition at the vector level. Potentially slow.",
                 0},
+            {"flatten_engine", {"--flatten-engine"},
+                "Flattening algorithm: \"polygon\" (default) subtracts each clear polygon as it comes in, \"batch\" subtracts each run of clear polygons in one boolean operation. \"batch\" is usually faster for artwork with many clear cutouts. \"parallel-batch\" works like \"batch\", but splits the output into tiles that are flattened independently and in parallel. Like \"batch\", it keeps the whole layer in memory.",
+                1},
+            {"flatten_tile_size", {"--flatten-tile-size"},
+                "Tile size in mm for --flatten-engine parallel-batch. Default: 10mm.",
+                1},
             {"no_flatten", {"--no-flatten"},
-                "Disable automatic flattening for KiCAD S-Exp export",
+                "Disable automatic flattening for KiCAD S-Exp and GDSII export",
+                0},
+            {"merge_regions", {"--merge-regions"},
+                "Union overlapping regions of the same polarity before output. Reduces output size for artwork with many overlapping shapes.",
                 0},
+            {"encoder_threads", {"--encoder-threads"},
+                "Number of threads used to format Gerber, SVG and KiCad S-Exp output. 0 formats output on the main thread. Default: up to 4, depending on the number of CPU cores.",
+                1},
+            {"output_compression", {"--output-compression"},
+                "Compress output while writing it. One of none (default), gzip, zip.",
+                1},
             {"dilate", {"--dilate"},
                 "Dilate output gerber primitives by this amount in mm. Used for masking out other layers.",
                 1},
@@ -118,7 +140,10 @@ int main(int argc, char **argv) {
                 "Comma-separated list of group IDs to export.",
                 1},
             {"vectorizer", {"-b", "--vectorizer"},
-                "Vectorizer to use for bitmap images. One of poisson-disc (default), hex-grid, square-grid, binary-contours, dev-null.",
+                "Vectorizer to use for bitmap images. One of poisson-disc (default), hex-grid, square-grid, adaptive-poisson-disc, adaptive-hex-grid, blue-noise, binary-contours, auto, dev-null.",
+                1},
+            {"vectorizer_seed", {"--vectorizer-seed"},
+                "Random seed for the poisson-disc vectorizer. The same seed always yields the same output. Default: 0.",
                 1},
             {"vectorizer_map", {"--vectorizer-map"},
                 "Map from image element id to vectorizer. Overrides --vectorizer. Format: id1=vectorizer,id2=vectorizer,...",
@@ -138,6 +163,12 @@ int main(int argc, char **argv) {
             {"sexp_layer", {"--sexp-layer"},
                 "Layer for KiCAD S-Exp output. Defaults to auto-detect layers from SVG layer/top-level group names",
                 1},
+            {"gdsii_cell_name", {"--gdsii-cell-name"},
+                "Name of the cell (structure) for GDSII output. Defaults to the input file name. Characters other than A-Z, a-z, 0-9, _, ? and $ are replaced with _, and the name is cut off after 32 characters.",
+                1},
+            {"gdsii_layer", {"--gdsii-layer"},
+                "Layer number for GDSII output. Default: 0",
+                1},
             {"preserve_aspect_ratio", {"-a", "--preserve-aspect-ratio"},
                 "Bitmap mode only: Preserve aspect ratio of image. Allowed values are meet, slice. Can also parse full SVG preserveAspectRatio syntax.",
                 1},
@@ -231,6 +262,37 @@ int main(int argc, char **argv) {
         out_f = &out_f_file;
     }
 
+    string compression = args["output_compression"] ? args["output_compression"].as<string>() : "none";
+#ifndef WASI
+    unique_ptr<CompressingStreambuf> compress_buf;
+    ostream compressed_out(nullptr);
+    if (compression == "gzip" || compression == "zip") {
+        string entry_name = "output";
+        if (!out_f_name.empty() && out_f_name != "-") {
+            /* foo.gbr.zip contains foo.gbr */
+            filesystem::path entry_path = filesystem::path(out_f_name).filename();
+            if (entry_path.extension() == ".zip") {
+                entry_path.replace_extension();
+            }
+            entry_name = entry_path.string();
+        }
+
+        compress_buf = make_unique<CompressingStreambuf>(*out_f,
+                compression == "zip" ? CompressingStreambuf::ZIP : CompressingStreambuf::GZIP, entry_name);
+        compressed_out.rdbuf(compress_buf.get());
+        out_f = &compressed_out;
+
+    } else if (compression != "none") {
+        cerr << "Error: Unknown output compression \"" << compression << "\"" << endl;
+        return EXIT_FAILURE;
+    }
+#else
+    if (compression != "none") {
+        cerr << "Error: --output-compression is not supported in WASI builds." << endl;
+        return EXIT_FAILURE;
+    }
+#endif /* WASI */
+
     bool only_polys = args["no_header"];
 
     int precision = 6;
@@ -249,6 +311,7 @@ int main(int argc, char **argv) {
     PolygonSink *sink = nullptr;
     PolygonSink *flattener = nullptr;
     PolygonSink *dilater = nullptr;
+    PolygonSink *merger = nullptr;
     //cerr << "Render sink stack:" << endl;
     if (fmt == "svg") {
         string dark_color = args["svg_dark_color"] ? args["svg_dark_color"].as<string>() : "#000000";
@@ -264,9 +327,29 @@ int main(int argc, char **argv) {
             cerr << "Info: Scaling gerber output @gerber_scale=" << gerber_scale << endl;
         }
 
-        sink = new SimpleGerberOutput(*out_f, only_polys, 4, precision, gerber_scale, {0,0}, args["flip_gerber_polarity"]);
+        auto *gerber_sink = new SimpleGerberOutput(*out_f, only_polys, 4, precision, gerber_scale, {0,0}, args["flip_gerber_polarity"]);
+        gerber_sink->set_hole_regions(args["gerber_hole_regions"]);
+        sink = gerber_sink;
         //cerr << "  * Gerber sink " << endl;
 
+    } else if (fmt == "binary" || fmt == "binary-outline") {
+        outline_mode = fmt == "binary-outline";
+
+        double gerber_scale = args["scale"].as<double>(1.0);
+        sink = new BinaryPolygonOutput(*out_f, only_polys, precision, gerber_scale, args["flip_gerber_polarity"]);
+        //cerr << "  * Binary polygon sink " << endl;
+
+    } else if (fmt == "gdsii" || fmt == "gds") {
+        /* The sink replaces characters not allowed in GDSII structure names, and falls back to TOP for an empty name */
+        string strname = args["gdsii_cell_name"] ? args["gdsii_cell_name"].as<string>() : in_f_stem;
+        int gds_layer = args["gdsii_layer"].as<int>(0);
+
+        double gerber_scale = args["scale"].as<double>(1.0);
+        sink = new SimpleGDSIIOutput(*out_f, only_polys, precision, gerber_scale, "gerbolyze", strname, gds_layer);
+        /* GDSII has no clear polarity */
+        force_flatten = true;
+        //cerr << "  * GDSII sink " << endl;
+
     } else if (fmt == "s-exp" || fmt == "sexp" || fmt == "kicad") {
         string mod_name(args["sexp_mod_name"] ? args["sexp_mod_name"].as<string>() : "");
         if (mod_name.empty()) {
@@ -294,6 +377,17 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
+    /* All output sinks above are stream sinks. Sinks that do not format their output in parallel ignore this. */
+    size_t encoder_threads = 0;
+#ifndef WASI
+    if (args["encoder_threads"]) {
+        encoder_threads = args["encoder_threads"].as<size_t>();
+    } else if (thread::hardware_concurrency() > 1) {
+        encoder_threads = min(4u, thread::hardware_concurrency());
+    }
+#endif
+    static_cast<StreamPolygonSink *>(sink)->set_encoder_threads(encoder_threads);
+
     PolygonSink *top_sink = sink;
 
     if (args["dilate"]) {
@@ -303,11 +397,36 @@ int main(int argc, char **argv) {
     }
 
     if (args["flatten"] || (force_flatten && !args["no_flatten"])) {
-        flattener = new Flattener(*top_sink);
+        string engine_name = args["flatten_engine"].as<string>("polygon");
+        FlattenEngine engine;
+        if (engine_name == "polygon") {
+            engine = FLATTEN_PER_POLYGON;
+        } else if (engine_name == "batch") {
+            engine = FLATTEN_BATCH;
+        } else if (engine_name == "parallel-batch") {
+            engine = FLATTEN_PARALLEL_BATCH;
+        } else {
+            cerr << "Error: Unknown flattening engine \"" << engine_name << "\"" << endl;
+            return EXIT_FAILURE;
+        }
+
+        double tile_size = args["flatten_tile_size"].as<double>(10.0);
+        if (tile_size <= 0) {
+            cerr << "Error: --flatten-tile-size must be positive" << endl;
+            return EXIT_FAILURE;
+        }
+
+        flattener = new Flattener(*top_sink, engine, tile_size);
         top_sink = flattener;
         //cerr << "  * Flattener " << endl;
     }
 
+    if (args["merge_regions"]) {
+        merger = new RegionMerger(*top_sink);
+        top_sink = merger;
+        //cerr << "  * Region merger " << endl;
+    }
+
     /* Because the C++ stdlib is bullshit */
     auto id_match = [](string in, vector<string> &out) {
         stringstream  ss(in);
@@ -472,6 +591,7 @@ int main(int argc, char **argv) {
     bool pattern_complete_tiles_only = args["pattern_complete_tiles_only"];
     bool use_apertures_for_patterns = args["use_apertures_for_patterns"];
     bool do_gerber_interpolation = !args["no_stroke_interpolation"];
+    unsigned int vectorizer_seed = args["vectorizer_seed"].as<unsigned int>(0);
 
     RenderSettings rset {
         min_feature_size,
@@ -486,6 +606,7 @@ int main(int argc, char **argv) {
         pattern_complete_tiles_only,
         use_apertures_for_patterns,
         do_gerber_interpolation,
+        vectorizer_seed,
     };
 
     SVGDocument doc;
@@ -516,6 +637,9 @@ int main(int argc, char **argv) {
     remove(frob.c_str());
     remove(barf.c_str());
 
+    if (merger) {
+        delete merger;
+    }
     if (flattener) {
         delete flattener;
     }
@@ -525,6 +649,13 @@ int main(int argc, char **argv) {
     if (sink) {
         delete sink;
     }
+
+#ifndef WASI
+    if (compress_buf && !compress_buf->close()) {
+        cerr << "Error writing compressed output" << endl;
+        return EXIT_FAILURE;
+    }
+#endif /* WASI */
     return EXIT_SUCCESS;
 }
 
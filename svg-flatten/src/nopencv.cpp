@@ -555,9 +555,12 @@ bool gerbolyze::nopencv::Image<T>::stb_to_internal(uint8_t *data) {
         return false;
 
     m_data = new T[size()] { 0 };
+    m_histogram.fill(0);
     for (int y=0; y<m_rows; y++) {
         for (int x=0; x<m_cols; x++) {
-            m_data[y*m_cols + x] = data[y*m_cols + x];
+            uint8_t val = data[y*m_cols + x];
+            m_data[y*m_cols + x] = val;
+            m_histogram[val]++;
         }
     }
 
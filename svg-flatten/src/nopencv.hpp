@@ -21,6 +21,7 @@
 #include <array>
 #include <string>
 #include <sstream>
+#include <iostream>
 #include <cmath>
 #include <cstdint>
 #include <algorithm>
@@ -46,8 +47,8 @@ namespace gerbolyze {
             Image(int w, int h, const T *data=nullptr);
             Image(const Image<T> &other) : Image<T>(other.cols(), other.rows(), other.ptr()) {}
             template<typename U> Image(const Image<U> &other) : Image<T>(other.cols(), other.rows()) {
-                for (size_t y=0; y<m_rows; y++) {
-                    for (size_t x=0; x<m_cols; x++) {
+                for (int y=0; y<m_rows; y++) {
+                    for (int x=0; x<m_cols; x++) {
                         at(x, y) = other.at(x, y);
                     }
                 }
@@ -103,12 +104,15 @@ namespace gerbolyze {
             int cols() const { return m_cols; }
             int size() const { return m_cols*m_rows; }
             const T *ptr() const { return m_data; }
+            /* Brightness histogram of the image as decoded. Not updated by any later operations on the image. */
+            const std::array<size_t, 256> &histogram() const { return m_histogram; }
 
         private:
             bool stb_to_internal(uint8_t *data);
 
             T *m_data = nullptr;
             int m_rows=0, m_cols=0;
+            std::array<size_t, 256> m_histogram {};
         };
 
         typedef Image<uint8_t> Image8;
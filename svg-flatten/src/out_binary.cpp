@@ -0,0 +1,198 @@
+/*
+ * This file is part of gerbolyze, a vector image preprocessing toolchain 
+ * Copyright (C) 2021 Jan Sebastian Götte <gerbolyze@jaseg.de>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cmath>
+#include <cstring>
+#include <climits>
+#include <algorithm>
+#include <string>
+#include <iostream>
+#include <gerbolyze.hpp>
+#include <svg_import_defs.h>
+
+using namespace gerbolyze;
+using namespace std;
+
+BinaryPolygonOutput::BinaryPolygonOutput(ostream &out, bool only_polys, int digits_frac, double scale, bool flip_polarity)
+    : StreamPolygonSink(out, only_polys),
+    m_digits_frac(digits_frac),
+    m_scale(scale),
+    m_flip_pol(flip_polarity)
+{
+    assert(0 <= digits_frac && digits_frac <= 9);
+    m_coord_scale = round(pow(10, m_digits_frac));
+    m_buf.reserve(buf_size + 4096);
+}
+
+BinaryPolygonOutput::~BinaryPolygonOutput() {
+    flush_buf();
+}
+
+void BinaryPolygonOutput::flush_buf() {
+    m_out.write(m_buf.data(), m_buf.size());
+    m_buf.clear();
+}
+
+void BinaryPolygonOutput::put_u32(uint32_t val) {
+    for (int i=0; i<4; i++) {
+        m_buf.push_back((char)((val >> (8*i)) & 0xff));
+    }
+}
+
+void BinaryPolygonOutput::begin_record(RecordType type, size_t len) {
+    put_u32(type);
+    put_u32(len);
+}
+
+void BinaryPolygonOutput::end_record() {
+    /* Pad to 4 bytes so readers can access coordinates in place */
+    while (m_buf.size() % 4) {
+        m_buf.push_back('\0');
+    }
+
+    if (m_buf.size() >= buf_size) {
+        flush_buf();
+    }
+}
+
+/* Coordinates that do not fit are clamped to the i32 range */
+void BinaryPolygonOutput::put_i32(double val) {
+    val = round(val);
+    if (fabs(val) > INT32_MAX) {
+        if (!m_range_warned) {
+            cerr << "Warning: Coordinates out of range for binary output at " << m_digits_frac << " digits of precision."
+                << " Use a lower --precision." << endl;
+            m_range_warned = true;
+        }
+        val = clamp(val, (double)-INT32_MAX, (double)INT32_MAX);
+    }
+
+    put_u32((uint32_t)(int32_t)val);
+}
+
+/* Same coordinate transform as SimpleGerberOutput */
+void BinaryPolygonOutput::put_xy(d2p pt) {
+    put_i32((pt[0] * m_scale + m_offset[0]) * m_coord_scale);
+    put_i32((m_height - pt[1] * m_scale + m_offset[1]) * m_coord_scale);
+}
+
+void BinaryPolygonOutput::header_impl(d2p origin, d2p size) {
+    m_offset[1] += 2*origin[1] * m_scale; /* See SimpleGerberOutput::header_impl */
+    m_height = size[1] * m_scale;
+
+    double dims[2] = {size[0] * m_scale, size[1] * m_scale};
+    m_buf.append("GBRLZPLY", 8);
+    put_u32(format_version);
+    put_u32(m_digits_frac);
+    for (double val : dims) {
+        uint64_t bits;
+        memcpy(&bits, &val, sizeof(bits));
+        put_u32(bits & 0xffffffff);
+        put_u32(bits >> 32);
+    }
+}
+
+void BinaryPolygonOutput::footer() {
+    if (!m_only_polys) {
+        footer_impl();
+    }
+    flush_buf();
+    m_out.flush();
+}
+
+void BinaryPolygonOutput::footer_impl() {
+    begin_record(REC_END, 0);
+    end_record();
+}
+
+BinaryPolygonOutput &BinaryPolygonOutput::operator<<(const LayerNameToken &layer_name) {
+    begin_record(REC_LAYER, layer_name.m_name.size());
+    m_buf.append(layer_name.m_name);
+    end_record();
+    return *this;
+}
+
+BinaryPolygonOutput &BinaryPolygonOutput::operator<<(GerberPolarityToken pol) {
+    assert(pol == GRB_POL_DARK || pol == GRB_POL_CLEAR);
+
+    begin_record(REC_POLARITY, 4);
+    put_u32((pol == GRB_POL_DARK) != m_flip_pol);
+    end_record();
+    return *this;
+}
+
+BinaryPolygonOutput &BinaryPolygonOutput::operator<<(const ApertureToken &ap) {
+    m_aperture_set = ap.m_has_aperture;
+
+    if (!m_aperture_set) {
+        begin_record(REC_APERTURE, 0);
+
+    } else {
+        double size = (ap.m_size > 0.0) ? ap.m_size : 0.05;
+        begin_record(REC_APERTURE, 4);
+        put_i32(size * m_coord_scale);
+    }
+
+    end_record();
+    return *this;
+}
+
+BinaryPolygonOutput &BinaryPolygonOutput::operator<<(const Polygon &poly) {
+    if (poly.size() < 3 && !m_aperture_set) {
+        cerr << "Warning: " << poly.size() << "-element polygon passed to BinaryPolygonOutput in region mode" << endl;
+        return *this;
+    }
+
+    begin_record(REC_POLYGON, poly.size() * 8);
+    for (auto &pt : poly) {
+        put_xy(pt);
+    }
+    end_record();
+    return *this;
+}
+
+BinaryPolygonOutput &BinaryPolygonOutput::operator<<(const FlashToken &tok) {
+    assert(m_aperture_set);
+
+    begin_record(REC_FLASH, 8);
+    put_xy(tok.m_offset);
+    end_record();
+    return *this;
+}
+
+BinaryPolygonOutput &BinaryPolygonOutput::operator<<(const PatternToken &tok) {
+    m_aperture_set = true;
+
+    size_t len = 0;
+    for (auto &pair : tok.m_polys) {
+        len += 8 + pair.first.size() * 8;
+    }
+
+    begin_record(REC_MACRO, len);
+    for (auto &pair : tok.m_polys) {
+        put_u32(pair.second == GRB_POL_DARK);
+        put_u32(pair.first.size());
+        /* Like in the Gerber aperture macro, these coordinates are relative to the flash and are not flipped. */
+        for (auto &pt : pair.first) {
+            put_i32(pt[0] * m_coord_scale);
+            put_i32(pt[1] * m_coord_scale);
+        }
+    }
+    end_record();
+    return *this;
+}
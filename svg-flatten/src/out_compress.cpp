@@ -0,0 +1,226 @@
+/*
+ * This file is part of gerbolyze, a vector image preprocessing toolchain 
+ * Copyright (C) 2021 Jan Sebastian Götte <gerbolyze@jaseg.de>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef WASI
+
+#include <ctime>
+#include <cstring>
+#include <iostream>
+#include "out_compress.h"
+
+using namespace gerbolyze;
+using namespace std;
+
+/* Zip is little-endian throughout */
+static void put_le(string &out, uint64_t val, int bytes) {
+    for (int i=0; i<bytes; i++) {
+        out.push_back((char)((val >> (8*i)) & 0xff));
+    }
+}
+
+CompressingStreambuf::CompressingStreambuf(ostream &out, Format format, string entry_name)
+    : m_out(out),
+    m_format(format),
+    m_entry_name(entry_name)
+{
+    memset(&m_zs, 0, sizeof(m_zs));
+    /* Negative window bits produce a raw deflate stream as used inside zip files, +16 produces a gzip file. */
+    int window_bits = (format == ZIP) ? -MAX_WBITS : (MAX_WBITS + 16);
+    if (deflateInit2(&m_zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        cerr << "Error: Cannot initialize zlib: " << (m_zs.msg ? m_zs.msg : "unknown error") << endl;
+        m_error = true;
+    }
+
+    if (m_format == ZIP) {
+        write_zip_header();
+    }
+
+    /* Blocks are compressed one after another, since the deflate stream is sequential. Still, this moves compression
+     * off the rendering thread. */
+    m_writer = make_unique<OrderedBlockWriter>(m_out, 1);
+
+    m_block.resize(block_size);
+    setp(m_block.data(), m_block.data() + m_block.size());
+}
+
+CompressingStreambuf::~CompressingStreambuf() {
+    close();
+    deflateEnd(&m_zs);
+}
+
+CompressingStreambuf::int_type CompressingStreambuf::overflow(int_type c) {
+    if (m_closed) {
+        return traits_type::eof();
+    }
+
+    submit_block(false);
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+    }
+    return traits_type::not_eof(c);
+}
+
+/* Flushing the output stream only hands the current block to the compressor. We do not force a deflate flush since
+ * that would hurt the compression ratio for no benefit. */
+int CompressingStreambuf::sync() {
+    if (!m_closed) {
+        submit_block(false);
+    }
+    return m_error ? -1 : 0;
+}
+
+void CompressingStreambuf::submit_block(bool final) {
+    size_t len = pptr() - pbase();
+    if (len == 0 && !final) {
+        return;
+    }
+
+    string data(pbase(), len);
+    m_writer->submit([this, data = std::move(data), final](string &out) {
+        deflate_block(data, final, out);
+    });
+    setp(m_block.data(), m_block.data() + m_block.size());
+}
+
+void CompressingStreambuf::deflate_block(const string &data, bool final, string &out) {
+    if (m_error) {
+        return;
+    }
+
+    m_crc = crc32(m_crc, (const Bytef *)data.data(), data.size());
+    m_size_in += data.size();
+
+    m_zs.next_in = (Bytef *)data.data();
+    m_zs.avail_in = data.size();
+    int rc;
+    do {
+        size_t pos = out.size();
+        size_t chunk = max<size_t>(deflateBound(&m_zs, m_zs.avail_in), 4096);
+        out.resize(pos + chunk);
+        m_zs.next_out = (Bytef *)out.data() + pos;
+        m_zs.avail_out = chunk;
+
+        rc = deflate(&m_zs, final ? Z_FINISH : Z_NO_FLUSH);
+        out.resize(out.size() - m_zs.avail_out);
+
+        if (rc == Z_STREAM_ERROR) {
+            cerr << "Error: Cannot compress output: " << (m_zs.msg ? m_zs.msg : "unknown error") << endl;
+            m_error = true;
+            return;
+        }
+    } while (m_zs.avail_in > 0 || (final && rc != Z_STREAM_END));
+
+    m_size_out += out.size();
+}
+
+bool CompressingStreambuf::close() {
+    if (m_closed) {
+        return !m_error;
+    }
+
+    submit_block(true);
+    m_writer->finish();
+    m_closed = true;
+    setp(nullptr, nullptr);
+
+    if (m_format == ZIP && !m_error) {
+        write_zip_trailer();
+    }
+
+    m_out.flush();
+    return !m_error && m_out.good();
+}
+
+void CompressingStreambuf::write_zip_header() {
+    time_t now = time(nullptr);
+    struct tm *t = localtime(&now);
+    m_dos_time = (t->tm_hour << 11) | (t->tm_min << 5) | (t->tm_sec / 2);
+    m_dos_date = ((max(t->tm_year, 80) - 80) << 9) | ((t->tm_mon + 1) << 5) | t->tm_mday;
+
+    /* Sizes and CRC are not known yet. Bit 3 of the flags tells readers to look for them in the data descriptor that
+     * follows the compressed data. Bit 11 marks the file name as UTF-8. */
+    string hdr;
+    put_le(hdr, 0x04034b50, 4); /* local file header signature */
+    put_le(hdr, 20, 2); /* version needed to extract: 2.0 (deflate) */
+    put_le(hdr, 0x0808, 2); /* flags */
+    put_le(hdr, 8, 2); /* compression method: deflate */
+    put_le(hdr, m_dos_time, 2);
+    put_le(hdr, m_dos_date, 2);
+    put_le(hdr, 0, 4); /* crc32 */
+    put_le(hdr, 0, 4); /* compressed size */
+    put_le(hdr, 0, 4); /* uncompressed size */
+    put_le(hdr, m_entry_name.size(), 2);
+    put_le(hdr, 0, 2); /* extra field length */
+    hdr += m_entry_name;
+    m_out.write(hdr.data(), hdr.size());
+}
+
+void CompressingStreambuf::write_zip_trailer() {
+    if (m_size_in > 0xffffffffULL || m_size_out > 0xffffffffULL) {
+        cerr << "Error: Output is too large for a zip file. Use gzip compression instead." << endl;
+        m_error = true;
+        return;
+    }
+
+    string out;
+    put_le(out, 0x08074b50, 4); /* data descriptor signature */
+    put_le(out, m_crc, 4);
+    put_le(out, m_size_out, 4);
+    put_le(out, m_size_in, 4);
+
+    uint64_t cd_offset = 30 + m_entry_name.size() + m_size_out + out.size();
+    size_t cd_start = out.size();
+    put_le(out, 0x02014b50, 4); /* central directory file header signature */
+    put_le(out, 20, 2); /* version made by */
+    put_le(out, 20, 2); /* version needed to extract */
+    put_le(out, 0x0808, 2); /* flags */
+    put_le(out, 8, 2); /* compression method: deflate */
+    put_le(out, m_dos_time, 2);
+    put_le(out, m_dos_date, 2);
+    put_le(out, m_crc, 4);
+    put_le(out, m_size_out, 4);
+    put_le(out, m_size_in, 4);
+    put_le(out, m_entry_name.size(), 2);
+    put_le(out, 0, 2); /* extra field length */
+    put_le(out, 0, 2); /* comment length */
+    put_le(out, 0, 2); /* disk number */
+    put_le(out, 0, 2); /* internal attributes */
+    put_le(out, 0, 4); /* external attributes */
+    put_le(out, 0, 4); /* offset of local header */
+    out += m_entry_name;
+    size_t cd_size = out.size() - cd_start;
+
+    if (cd_offset > 0xffffffffULL) {
+        cerr << "Error: Output is too large for a zip file. Use gzip compression instead." << endl;
+        m_error = true;
+        return;
+    }
+
+    put_le(out, 0x06054b50, 4); /* end of central directory signature */
+    put_le(out, 0, 2); /* number of this disk */
+    put_le(out, 0, 2); /* disk where central directory starts */
+    put_le(out, 1, 2); /* number of central directory records on this disk */
+    put_le(out, 1, 2); /* total number of central directory records */
+    put_le(out, cd_size, 4);
+    put_le(out, cd_offset, 4);
+    put_le(out, 0, 2); /* comment length */
+    m_out.write(out.data(), out.size());
+}
+
+#endif /* WASI */
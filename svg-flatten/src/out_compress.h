@@ -0,0 +1,78 @@
+/*
+ * This file is part of gerbolyze, a vector image preprocessing toolchain 
+ * Copyright (C) 2021 Jan Sebastian Götte <gerbolyze@jaseg.de>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <memory>
+#include <ostream>
+#include <streambuf>
+
+#ifndef WASI
+#include <zlib.h>
+#include "util.h"
+
+namespace gerbolyze {
+
+/* Stream buffer that deflates everything written to it into the given output stream, either as a gzip file or as a zip
+ * archive containing a single file. Data is collected in large blocks that are compressed and written on a background
+ * thread, so rendering can continue while compression is running. close() must be called after the last write. */
+class CompressingStreambuf : public std::streambuf {
+public:
+    enum Format {
+        GZIP,
+        ZIP,
+    };
+
+    CompressingStreambuf(std::ostream &out, Format format, std::string entry_name="");
+    virtual ~CompressingStreambuf();
+    /* Compress remaining data and write archive trailer. Returns false on error. */
+    bool close();
+
+protected:
+    virtual int_type overflow(int_type c);
+    virtual int sync();
+
+private:
+    static constexpr size_t block_size = 1<<20;
+
+    void submit_block(bool final);
+    void deflate_block(const std::string &data, bool final, std::string &out);
+    void write_zip_header();
+    void write_zip_trailer();
+
+    std::ostream &m_out;
+    Format m_format;
+    std::string m_entry_name;
+    std::string m_block;
+    std::unique_ptr<OrderedBlockWriter> m_writer;
+    z_stream m_zs;
+    bool m_closed = false;
+    std::atomic<bool> m_error = false;
+    /* Updated by deflate_block. Only read after all blocks have been written. */
+    uint32_t m_crc = 0;
+    uint64_t m_size_in = 0;
+    uint64_t m_size_out = 0;
+    uint16_t m_dos_time = 0;
+    uint16_t m_dos_date = 0;
+};
+
+}
+#endif /* WASI */
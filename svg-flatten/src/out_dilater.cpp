@@ -26,65 +26,127 @@
 #include <svg_import_defs.h>
 #include <svg_geom.h>
 #include "polylinecombine.hpp"
+#include "util.h"
 
 using namespace gerbolyze;
 using namespace std;
 
+/* Dilating every region on its own is slow, and touching regions come out as overlapping copies of each other. Instead,
+ * we collect runs of regions like RegionMerger does, and union and offset each batch in one go on a pool of worker
+ * threads. For clear runs, this erodes the union of the batch, which unlike eroding each region on its own does not
+ * leave slivers between adjacent clear regions. Strokes and degenerate polygons are dilated one by one as they come in. */
+
+static void offset_paths(const ClipperLib::Paths &paths, double delta, ClipperLib::PolyTree &out) {
+    ClipperLib::ClipperOffset offx;
+    offx.ArcTolerance = 0.05 * clipper_scale; /* 10µm; TODO: Make this configurable */
+    offx.AddPaths(paths, ClipperLib::jtRound, ClipperLib::etClosedPolygon);
+    offx.Execute(out, delta);
+}
+
 void Dilater::header(d2p origin, d2p size) {
     m_sink.header(origin, size);
 }
 
 void Dilater::footer() {
+    flush();
     m_sink.footer();
 }
 
 Dilater &Dilater::operator<<(const LayerNameToken &layer_name) {
+    flush();
     m_sink << layer_name;
 
     return *this;
 }
 
 Dilater &Dilater::operator<<(GerberPolarityToken pol) {
-    m_current_polarity = pol;
+    if (pol != m_current_polarity) {
+        flush();
+        m_current_polarity = pol;
+    }
     m_sink << pol;
 
     return *this;
 }
 
 Dilater &Dilater::operator<<(const Polygon &poly) {
-    ClipperLib::Path poly_c;
-    for (auto &p : poly) {
-        poly_c.push_back({(ClipperLib::cInt)round(p[0] * clipper_scale), (ClipperLib::cInt)round(p[1] * clipper_scale)});
+    if (m_aperture_set || poly.size() < 3) {
+        ClipperLib::Path poly_c;
+        poly_c.reserve(poly.size());
+        for (auto &p : poly) {
+            poly_c.push_back({(ClipperLib::cInt)round(p[0] * clipper_scale), (ClipperLib::cInt)round(p[1] * clipper_scale)});
+        }
+
+        double dilation = m_dilation;
+        if (m_current_polarity == GRB_POL_CLEAR) {
+            dilation = -dilation;
+        }
+
+        ClipperLib::PolyTree c_nice_polys;
+        offset_paths({poly_c}, dilation * clipper_scale, c_nice_polys);
+        emit(c_nice_polys);
+        return *this;
     }
 
-    ClipperLib::ClipperOffset offx;
-    offx.ArcTolerance = 0.05 * clipper_scale; /* 10µm; TODO: Make this configurable */
-    offx.AddPath(poly_c, ClipperLib::jtRound, ClipperLib::etClosedPolygon);
+    m_run.add(poly);
+    if (m_run.full()) {
+        flush();
+    }
+
+    return *this;
+}
+
+void Dilater::flush() {
+    if (m_run.empty())
+        return;
+
+    vector<ClipperLib::Paths> batches = m_run.take();
     double dilation = m_dilation;
     if (m_current_polarity == GRB_POL_CLEAR) {
         dilation = -dilation;
     }
 
-    ClipperLib::PolyTree solution; 
-    offx.Execute(solution, dilation * clipper_scale);
+    /* Constructed in place and never copied, since PolyTree owns its nodes through raw pointers */
+    vector<ClipperLib::PolyTree> results(batches.size());
+    parallel_for(batches.size(), [&batches, &results, dilation](size_t i) {
+        ClipperLib::Clipper c;
+        c.AddPaths(batches[i], ClipperLib::ptSubject, /* closed */ true);
+        ClipperLib::Paths merged;
+        c.Execute(ClipperLib::ctUnion, merged, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
+        offset_paths(merged, dilation * clipper_scale, results[i]);
+    });
+
+    /* Emit in input order so output does not depend on thread scheduling */
+    for (auto &result : results) {
+        emit(result);
+    }
+}
 
-    ClipperLib::Paths c_nice_polys;
-    dehole_polytree(solution, c_nice_polys);
+/* While an aperture is set, our output is drawn as strokes, so it is always deholed. Regions keep their holes if our
+ * sink can do holes. */
+void Dilater::emit(ClipperLib::PolyTree &ptree) {
+    if (!m_aperture_set) {
+        sink_polytree(ptree, m_sink);
+        return;
+    }
 
-    for (auto &nice_poly : c_nice_polys) {
+    ClipperLib::Paths paths;
+    dehole_polytree(ptree, paths);
+    for (auto &nice_poly : paths) {
         Polygon new_poly;
+        new_poly.reserve(nice_poly.size());
         for (auto &p : nice_poly) {
             new_poly.push_back({
                     (double)p.X / clipper_scale,
                     (double)p.Y / clipper_scale });
         }
-        m_sink << new_poly;
+        m_sink << std::move(new_poly);
     }
-
-    return *this;
 }
 
 Dilater &Dilater::operator<<(const ApertureToken &ap) {
+    flush();
+    m_aperture_set = ap.m_has_aperture;
     if (ap.m_has_aperture)
         m_sink << ApertureToken(ap.m_size + 2*m_dilation);
     else
@@ -93,6 +155,7 @@ Dilater &Dilater::operator<<(const ApertureToken &ap) {
 }
 
 Dilater &Dilater::operator<<(const FlashToken &tok) {
+    flush();
     m_sink << tok;
     return *this;
 }
@@ -21,10 +21,16 @@
 #include <string>
 #include <iostream>
 #include <iomanip>
+#include <cstdint>
+#include <unordered_map>
+#include <map>
+#include <set>
 #include <gerbolyze.hpp>
+#include <clipper.hpp>
 #include <svg_import_defs.h>
 #include <svg_geom.h>
 #include "polylinecombine.hpp"
+#include "util.h"
 
 using namespace gerbolyze;
 using namespace std;
@@ -45,21 +51,234 @@ static void cavc_to_polygon (const cavc::Polyline<double> &in, Polygon &out) {
 namespace gerbolyze {
     class Flattener_D {
     public:
+        /* Grid cell size of the spatial index in mm */
+        static constexpr double grid_size = 5.0;
+        /* Polygons spanning more grid cells than this are not put into the grid, and instead are always checked. */
+        static constexpr int64_t max_cells = 1024;
+
+        /* Dark polygons are kept in slots. When a clear polygon cuts a dark polygon into pieces, the first piece takes
+         * the dark polygon's slot and the others get new slots. A dark polygon that is removed entirely leaves an empty
+         * slot behind. */
         vector<cavc::Polyline<double>> dark_polys;
         vector<cavc::Polyline<double>> clear_polys;
 
+        /* Spatial index of dark polygon slots by grid cell. Since cutting into a polygon only ever makes it smaller, an
+         * index entry stays valid when its polygon changes. It just might be too large. */
+        unordered_map<uint64_t, vector<size_t>> grid;
+        vector<size_t> oversized;
+        vector<size_t> visited;
+        size_t visit_stamp = 0;
+
         void add_dark_polygon(const Polygon &in) {
             polygon_to_cavc(in, dark_polys.emplace_back());
+            index_dark_polygon(dark_polys.size() - 1);
         }
 
         void add_clear_polygon(const Polygon &in) {
             polygon_to_cavc(in, clear_polys.emplace_back());
         }
+
+        /* Batch engine state: All dark polygons so far, and the current run of clear polygons. */
+        ClipperLib::Paths dark_paths;
+        ClipperLib::Paths clear_paths;
+
+        static void add_path(const Polygon &in, ClipperLib::Paths &out) {
+            if (in.size() < 3) {
+                return;
+            }
+
+            ClipperLib::Path &path = out.emplace_back();
+            path.reserve(in.size());
+            for (auto &p : in) {
+                path.push_back({(ClipperLib::cInt)round(p[0] * clipper_scale), (ClipperLib::cInt)round(p[1] * clipper_scale)});
+            }
+
+            /* Overlapping polygons of opposite orientations would cancel out under the nonzero rule. */
+            if (!ClipperLib::Orientation(path))
+                ClipperLib::ReversePath(path);
+        }
+
+        /* Parallel batch engine state. Each tile works like the batch engine on the parts of all polygons that fall
+         * inside of it. Tiles are kept in a map so they are processed and output in a stable order. A tile can only be
+         * output at the end of the layer, since until then, any clear polygon that comes in may still cut into it. */
+        struct Tile {
+            ClipperLib::Paths dark;
+            ClipperLib::Paths clear;
+            size_t dark_added = 0; /* Dark polygons added since the tile was last compacted */
+        };
+        /* Once this many dark polygons have been added to a tile, union them to keep the tile small. */
+        static constexpr size_t tile_compact_threshold = 256;
+
+        map<pair<int64_t, int64_t>, Tile> tiles;
+        set<pair<int64_t, int64_t>> tiles_with_clear;
+        ClipperLib::cInt tile_size = 0;
+
+        static void compact_tile(Tile &tile) {
+            ClipperLib::Clipper c;
+            c.AddPaths(tile.dark, ClipperLib::ptSubject, /* closed */ true);
+            if (!tile.clear.empty()) {
+                c.AddPaths(tile.clear, ClipperLib::ptClip, /* closed */ true);
+            }
+            c.Execute(ClipperLib::ctDifference, tile.dark, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
+            tile.clear.clear();
+            tile.dark_added = 0;
+        }
+
+        void add_tiled(const Polygon &in, bool dark) {
+            ClipperLib::Paths tmp;
+            add_path(in, tmp);
+            if (tmp.empty()) {
+                return;
+            }
+
+            ClipperLib::IntRect bb = get_paths_bounds(tmp);
+            auto tile_coord = [this](ClipperLib::cInt val) -> int64_t {
+                return (val >= 0 ? val : val - tile_size + 1) / tile_size;
+            };
+            int64_t x0 = tile_coord(bb.left), x1 = tile_coord(bb.right);
+            int64_t y0 = tile_coord(bb.top), y1 = tile_coord(bb.bottom);
+
+            for (int64_t x = x0; x <= x1; x++) {
+                for (int64_t y = y0; y <= y1; y++) {
+                    ClipperLib::Paths pieces;
+                    if (x0 == x1 && y0 == y1) {
+                        pieces = std::move(tmp);
+
+                    } else {
+                        ClipperLib::Path rect {
+                            {x*tile_size, y*tile_size}, {(x+1)*tile_size, y*tile_size},
+                            {(x+1)*tile_size, (y+1)*tile_size}, {x*tile_size, (y+1)*tile_size}};
+                        ClipperLib::Clipper c;
+                        c.AddPaths(tmp, ClipperLib::ptSubject, /* closed */ true);
+                        c.AddPath(rect, ClipperLib::ptClip, /* closed */ true);
+                        c.Execute(ClipperLib::ctIntersection, pieces, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
+                        if (pieces.empty()) {
+                            continue;
+                        }
+                    }
+
+                    Tile &tile = tiles[{x, y}];
+                    ClipperLib::Paths &target = dark ? tile.dark : tile.clear;
+                    target.insert(target.end(), make_move_iterator(pieces.begin()), make_move_iterator(pieces.end()));
+
+                    if (dark) {
+                        if (++tile.dark_added >= tile_compact_threshold) {
+                            compact_tile(tile);
+                        }
+                    } else {
+                        tiles_with_clear.insert({x, y});
+                    }
+                }
+            }
+        }
+
+        void apply_tiled_clear_runs() {
+            for (auto &key : tiles_with_clear) {
+                auto it = tiles.find(key);
+                compact_tile(it->second);
+                if (it->second.dark.empty()) {
+                    tiles.erase(it);
+                }
+            }
+            tiles_with_clear.clear();
+        }
+
+        static int64_t grid_coord(double val) {
+            return (int64_t)floor(val / grid_size);
+        }
+
+        static uint64_t grid_key(int64_t x, int64_t y) {
+            return ((uint64_t)(uint32_t)x << 32) | (uint32_t)y;
+        }
+
+        void index_dark_polygon(size_t slot) {
+            visited.push_back(0);
+            if (dark_polys[slot].size() == 0) {
+                return;
+            }
+
+            auto bb = getExtents(dark_polys[slot]);
+            int64_t x0 = grid_coord(bb.xMin), x1 = grid_coord(bb.xMax);
+            int64_t y0 = grid_coord(bb.yMin), y1 = grid_coord(bb.yMax);
+
+            if ((x1 - x0 + 1) * (y1 - y0 + 1) > max_cells) {
+                oversized.push_back(slot);
+                return;
+            }
+
+            for (int64_t x = x0; x <= x1; x++) {
+                for (int64_t y = y0; y <= y1; y++) {
+                    grid[grid_key(x, y)].push_back(slot);
+                }
+            }
+        }
+
+        /* Find slots of all dark polygons whose extents may overlap the given extents */
+        void find_candidates(const cavc::AABB<double> &bb, vector<size_t> &out) {
+            visit_stamp++;
+            out.clear();
+            auto visit = [this, &out](size_t slot) {
+                if (visited[slot] != visit_stamp) {
+                    visited[slot] = visit_stamp;
+                    out.push_back(slot);
+                }
+            };
+
+            for (size_t slot : oversized) {
+                visit(slot);
+            }
+
+            int64_t x0 = grid_coord(bb.xMin), x1 = grid_coord(bb.xMax);
+            int64_t y0 = grid_coord(bb.yMin), y1 = grid_coord(bb.yMax);
+            if ((x1 - x0 + 1) * (y1 - y0 + 1) > (int64_t)grid.size()) {
+                /* Large query: Walking the grid's cells is cheaper than walking the query's cells. */
+                for (auto &[key, slots] : grid) {
+                    int64_t x = (int32_t)(key >> 32), y = (int32_t)(key & 0xffffffff);
+                    if (x >= x0 && x <= x1 && y >= y0 && y <= y1) {
+                        for (size_t slot : slots) {
+                            visit(slot);
+                        }
+                    }
+                }
+
+            } else {
+                for (int64_t x = x0; x <= x1; x++) {
+                    for (int64_t y = y0; y <= y1; y++) {
+                        auto it = grid.find(grid_key(x, y));
+                        if (it != grid.end()) {
+                            for (size_t slot : it->second) {
+                                visit(slot);
+                            }
+                        }
+                    }
+                }
+            }
+
+            /* Visit slots in the order the polygons were added */
+            sort(out.begin(), out.end());
+        }
+
+        void clear() {
+            dark_polys.clear();
+            clear_polys.clear();
+            grid.clear();
+            oversized.clear();
+            visited.clear();
+            dark_paths.clear();
+            clear_paths.clear();
+            tiles.clear();
+            tiles_with_clear.clear();
+        }
     };
 }
 
-Flattener::Flattener(PolygonSink &sink) : m_sink(sink) {
+Flattener::Flattener(PolygonSink &sink, FlattenEngine engine, double tile_size) :
+    m_sink(sink),
+    m_engine(engine),
+    m_tile_size(tile_size)
+{
     d = new Flattener_D();
+    d->tile_size = max<ClipperLib::cInt>(1, (ClipperLib::cInt)round(m_tile_size * clipper_scale));
 }
 
 Flattener::~Flattener() {
@@ -70,64 +289,121 @@ void Flattener::header(d2p origin, d2p size) {
     m_sink.header(origin, size);
 }
 
+/* Subtract clear polygon sub from dark polygon cavc_in, and append the remaining pieces to out. */
+static void subtract_polyline(const cavc::Polyline<double> &cavc_in, const cavc::Polyline<double> &sub,
+        vector<cavc::Polyline<double>> &out) {
+    auto res = cavc::combinePolylines(cavc_in, sub, cavc::PlineCombineMode::Exclude);
+
+    if (res.subtracted.size() == 0) {
+        for (auto &rem : res.remaining) {
+            out.push_back(std::move(rem));
+        }
+
+    } else { /* custom one-hole deholing code */
+        assert (res.remaining.size() == 1);
+        assert (res.subtracted.size() == 1);
+
+        auto &rem = res.remaining[0];
+        auto &sub = res.subtracted[0];
+        auto bbox = getExtents(rem);
+
+        cavc::Polyline<double> quad;
+        quad.addVertex(bbox.xMin, bbox.yMin, 0);
+        if (sub.vertexes()[0].x() < sub.vertexes()[1].x()) {
+            quad.addVertex(sub.vertexes()[0]);
+            quad.addVertex(sub.vertexes()[1]);
+        } else {
+            quad.addVertex(sub.vertexes()[1]);
+            quad.addVertex(sub.vertexes()[0]);
+        }
+        quad.addVertex(bbox.xMax, bbox.yMin, 0);
+        quad.isClosed() = true; /* sic! */
+
+        auto res2 = cavc::combinePolylines(rem, quad, cavc::PlineCombineMode::Exclude);
+        assert (res2.subtracted.size() == 0);
+
+        for (auto &rem : res2.remaining) {
+            auto res3 = cavc::combinePolylines(rem, sub, cavc::PlineCombineMode::Exclude);
+            assert (res3.subtracted.size() == 0);
+            for (auto &p : res3.remaining) {
+                out.push_back(std::move(p));
+            }
+        }
+
+        auto res4 = cavc::combinePolylines(rem, quad, cavc::PlineCombineMode::Intersect);
+        assert (res4.subtracted.size() == 0);
+
+        for (auto &rem : res4.remaining) {
+            auto res5 = cavc::combinePolylines(rem, sub, cavc::PlineCombineMode::Exclude);
+            assert (res5.subtracted.size() == 0);
+            for (auto &p : res5.remaining) {
+                out.push_back(std::move(p));
+            }
+        }
+    }
+}
+
+static bool extents_overlap(const cavc::AABB<double> &a, const cavc::AABB<double> &b) {
+    return a.xMin <= b.xMax && b.xMin <= a.xMax && a.yMin <= b.yMax && b.yMin <= a.yMax;
+}
+
+/* Each clear polygon is only subtracted from the dark polygons whose extents it overlaps. Candidates are looked up in the
+ * spatial index. */
 void Flattener::render_out_clear_polys() {
-    for (auto &sub : d->clear_polys) {
-        vector<cavc::Polyline<double>> new_dark_polys;
-        new_dark_polys.reserve(d->dark_polys.size());
+    if (m_engine == FLATTEN_PARALLEL_BATCH) {
+        d->apply_tiled_clear_runs();
+        return;
+    }
 
-        for (cavc::Polyline<double> cavc_in : d->dark_polys) {
-            auto res = cavc::combinePolylines(cavc_in, sub, cavc::PlineCombineMode::Exclude);
+    if (m_engine == FLATTEN_BATCH) {
+        /* (dark ∪ ...) - (clear ∪ ...) in one sweep. Holes in the result have negative orientation, so they stay holes
+         * when the result is used as the subject of the next run under the nonzero rule. */
+        if (d->clear_paths.empty()) {
+            return;
+        }
 
-            if (res.subtracted.size() == 0) {
-                for (auto &rem : res.remaining) {
-                    new_dark_polys.push_back(std::move(rem));
-                }
+        ClipperLib::Clipper c;
+        c.AddPaths(d->dark_paths, ClipperLib::ptSubject, /* closed */ true);
+        c.AddPaths(d->clear_paths, ClipperLib::ptClip, /* closed */ true);
+        c.Execute(ClipperLib::ctDifference, d->dark_paths, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
+        d->clear_paths.clear();
+        return;
+    }
 
-            } else { /* custom one-hole deholing code */
-                assert (res.remaining.size() == 1);
-                assert (res.subtracted.size() == 1);
-
-                auto &rem = res.remaining[0];
-                auto &sub = res.subtracted[0];
-                auto bbox = getExtents(rem);
-
-                cavc::Polyline<double> quad;
-                quad.addVertex(bbox.xMin, bbox.yMin, 0);
-                if (sub.vertexes()[0].x() < sub.vertexes()[1].x()) {
-                    quad.addVertex(sub.vertexes()[0]);
-                    quad.addVertex(sub.vertexes()[1]);
-                } else {
-                    quad.addVertex(sub.vertexes()[1]);
-                    quad.addVertex(sub.vertexes()[0]);
-                }
-                quad.addVertex(bbox.xMax, bbox.yMin, 0);
-                quad.isClosed() = true; /* sic! */
+    vector<size_t> candidates;
+    vector<cavc::Polyline<double>> pieces;
+
+    for (auto &sub : d->clear_polys) {
+        if (sub.size() == 0) {
+            continue;
+        }
 
-                auto res2 = cavc::combinePolylines(rem, quad, cavc::PlineCombineMode::Exclude);
-                assert (res2.subtracted.size() == 0);
+        auto sub_bb = getExtents(sub);
+        d->find_candidates(sub_bb, candidates);
 
-                for (auto &rem : res2.remaining) {
-                    auto res3 = cavc::combinePolylines(rem, sub, cavc::PlineCombineMode::Exclude);
-                    assert (res3.subtracted.size() == 0);
-                    for (auto &p : res3.remaining) {
-                        new_dark_polys.push_back(std::move(p));
-                    }
-                }
+        for (size_t slot : candidates) {
+            if (d->dark_polys[slot].size() == 0) {
+                continue;
+            }
 
-                auto res4 = cavc::combinePolylines(rem, quad, cavc::PlineCombineMode::Intersect);
-                assert (res4.subtracted.size() == 0);
+            if (!extents_overlap(sub_bb, getExtents(d->dark_polys[slot]))) {
+                continue;
+            }
 
-                for (auto &rem : res4.remaining) {
-                    auto res5 = cavc::combinePolylines(rem, sub, cavc::PlineCombineMode::Exclude);
-                    assert (res5.subtracted.size() == 0);
-                    for (auto &p : res5.remaining) {
-                        new_dark_polys.push_back(std::move(p));
-                    }
-                }
+            pieces.clear();
+            subtract_polyline(d->dark_polys[slot], sub, pieces);
+
+            if (pieces.empty()) {
+                d->dark_polys[slot] = cavc::Polyline<double>();
+                continue;
             }
-        }
 
-        d->dark_polys = std::move(new_dark_polys);
+            d->dark_polys[slot] = std::move(pieces[0]);
+            for (size_t i=1; i<pieces.size(); i++) {
+                d->dark_polys.push_back(std::move(pieces[i]));
+                d->index_dark_polygon(d->dark_polys.size() - 1);
+            }
+        }
     }
     d->clear_polys.clear();
 }
@@ -163,6 +439,16 @@ Flattener &Flattener::operator<<(const ApertureToken &tok) {
 }
 
 Flattener &Flattener::operator<<(const Polygon &poly) {
+    if (m_engine == FLATTEN_PARALLEL_BATCH) {
+        d->add_tiled(poly, m_current_polarity == GRB_POL_DARK);
+        return *this;
+    }
+
+    if (m_engine == FLATTEN_BATCH) {
+        Flattener_D::add_path(poly, m_current_polarity == GRB_POL_DARK ? d->dark_paths : d->clear_paths);
+        return *this;
+    }
+
     if (m_current_polarity == GRB_POL_DARK) {
         d->add_dark_polygon(poly);
 
@@ -178,16 +464,60 @@ void Flattener::flush_polys_to_sink() {
     *this << GRB_POL_DARK; /* force render */
     m_sink << GRB_POL_DARK;
 
+    if (m_engine == FLATTEN_BATCH) {
+        ClipperLib::Clipper c;
+        c.AddPaths(d->dark_paths, ClipperLib::ptSubject, /* closed */ true);
+        ClipperLib::PolyTree ptree;
+        c.StrictlySimple(true);
+        c.Execute(ClipperLib::ctUnion, ptree, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
+
+        ClipperLib::Paths out;
+        dehole_polytree(ptree, out);
+        m_sink << out;
+    }
+
+    /* Flatten all tiles on one pool of worker threads, then output them in order. Each tile's input is freed as soon as
+     * it has been flattened. Polygons are split at tile borders. Adjacent pieces touch without overlapping, which is
+     * fine for all of our output formats. */
+    if (!d->tiles.empty()) {
+        vector<Flattener_D::Tile *> tiles;
+        tiles.reserve(d->tiles.size());
+        for (auto &[key, tile] : d->tiles) {
+            tiles.push_back(&tile);
+        }
+
+        vector<ClipperLib::Paths> results(tiles.size());
+        parallel_for(tiles.size(), [&tiles, &results](size_t i) {
+            ClipperLib::Clipper c;
+            c.AddPaths(tiles[i]->dark, ClipperLib::ptSubject, /* closed */ true);
+            ClipperLib::PolyTree ptree;
+            c.StrictlySimple(true);
+            c.Execute(ClipperLib::ctUnion, ptree, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
+            ClipperLib::Paths().swap(tiles[i]->dark);
+            dehole_polytree(ptree, results[i]);
+        });
+        d->tiles.clear();
+
+        for (auto &result : results) {
+            m_sink << result;
+            ClipperLib::Paths().swap(result);
+        }
+    }
+
     for (auto &poly : d->dark_polys) {
+        if (poly.size() == 0) {
+            continue;
+        }
+
         Polygon poly_out;
+        poly_out.reserve(poly.size());
         for (auto &p : poly.vertexes()) {
             poly_out.emplace_back(d2p{p.x(), p.y()});
         }
-        m_sink << poly_out;
+        m_sink << std::move(poly_out);
     }
 
-    d->clear_polys.clear();
-    d->dark_polys.clear();
+    d->clear();
 }
 
 void Flattener::footer() {
@@ -17,105 +17,359 @@
  */
 
 #include <cmath>
+#include <cstring>
+#include <climits>
+#include <cctype>
 #include <algorithm>
 #include <string>
 #include <iostream>
-#include <iomanip>
-#include <time.h>
+#include <ctime>
 #include <gerbolyze.hpp>
 #include <svg_import_defs.h>
 
 using namespace gerbolyze;
 using namespace std;
 
-SimpleGDSIIOutput::SimpleGDSIIOutput(ostream &out, bool only_polys=false, double scale, d2p offset, bool flip_polarity, std::string libname)
+SimpleGDSIIOutput::SimpleGDSIIOutput(ostream &out, bool only_polys, int digits_frac, double scale, string libname, string strname, int layer, int datatype)
     : StreamPolygonSink(out, only_polys),
-    m_offset(offset),
+    m_digits_frac(digits_frac),
     m_scale(scale),
-    m_flip_pol(flip_polarity),
-    m_libname(libname)
+    m_libname(libname),
+    m_strname(sanitize_strname(strname)),
+    m_layer(layer),
+    m_datatype(datatype)
 {
+    assert(0 <= digits_frac && digits_frac <= 9);
+    m_db_scale = round(pow(10, m_digits_frac));
+    m_buf.reserve(buf_size + 4096);
+
+    if (m_strname != strname) {
+        cerr << "Warning: GDSII structure name \"" << strname << "\" changed to \"" << m_strname << "\"." << endl;
+    }
+}
+
+string SimpleGDSIIOutput::sanitize_strname(string_view name) {
+    string out;
+    for (char c : name.substr(0, 32)) {
+        if (isalnum((unsigned char)c) || c == '_' || c == '?' || c == '$') {
+            out.push_back(c);
+        } else {
+            out.push_back('_');
+        }
+    }
+
+    if (out.empty()) {
+        out = "TOP";
+    }
+    return out;
+}
+
+SimpleGDSIIOutput::~SimpleGDSIIOutput() {
+    flush_buf();
+}
+
+void SimpleGDSIIOutput::flush_buf() {
+    m_out.write(m_buf.data(), m_buf.size());
+    m_buf.clear();
 }
 
-void SimpleGDSIIOutput::header_impl(d2p origin, d2p size) {
-    m_offset[0] += origin[0] * m_scale;
-    m_offset[1] += origin[1] * m_scale;
-    m_width = (size[0] - origin[0]) * m_scale;
-    m_height = (size[1] - origin[1]) * m_scale;
-    
-    gds_wr16(GDS_HEADER, {600});
+uint64_t SimpleGDSIIOutput::gds_real8(double val) {
+    if (val == 0.0 || !std::isfinite(val)) {
+        return 0;
+    }
+
+    uint64_t sign = 0;
+    if (val < 0) {
+        sign = 1ULL<<63;
+        val = -val;
+    }
 
-    time_t t = time(NULL);
-    struct tm;
-    gmtime_r(&t, &tm);
-    gds_wr16(GDS_BGNLIB, {tm.tm_year, tm.tm_month, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
-                          tm.tm_year, tm.tm_month, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec});
+    /* Normalize mantissa to [1/16, 1). Scaling by 16 is exact in binary floating point. */
+    int exp = 64;
+    while (val >= 1.0) {
+        val /= 16.0;
+        exp++;
+    }
+    while (val < 1.0/16.0) {
+        val *= 16.0;
+        exp--;
+    }
 
-    gds_wr_str(GDS_LIBNAME, m_libname);
+    uint64_t mant = (uint64_t)llround(ldexp(val, 56));
+    if (mant >= (1ULL<<56)) { /* rounded up to 1.0 */
+        mant >>= 4;
+        exp++;
+    }
+
+    exp = clamp(exp, 0, 127);
+    return sign | ((uint64_t)exp << 56) | mant;
 }
 
-void gds_wr_d(uint16_t tag, double value) {
-    uint64_t d_ul = reinterpret_cast<uint64_t>(value);
-    uint64_t sign = !!(casted & (1ULL<<63));
-    int exp = (casted >> 52) & 0x7ffULL;
-    uint64_t mant = (casted & ((1ULL<<52)-1)) | (1ULL<<52);
+/* GDSII is big-endian throughout */
+void SimpleGDSIIOutput::put_u16(uint16_t val) {
+    m_buf.push_back((char)(val >> 8));
+    m_buf.push_back((char)(val & 0xff));
+}
 
-    int new_exp = (exp - 1023) / 4 + 64;
-    int exp_mod = (exp + 1) % 4;
-    uint64_t new_mant = mant * (1<<exp_mod);
+void SimpleGDSIIOutput::put_i32(int32_t val) {
+    uint32_t u = val;
+    put_u16(u >> 16);
+    put_u16(u & 0xffff);
+}
 
-    gds_wr16
+void SimpleGDSIIOutput::put_record(RecordType type) {
+    put_u16(4);
+    put_u16(type);
 }
 
-SimpleGDSIIOutput& SimpleGDSIIOutput::operator<<(GerberPolarityToken pol) {
-    assert(pol == GRB_POL_DARK || pol == GRB_POL_CLEAR);
+void SimpleGDSIIOutput::put_record(RecordType type, initializer_list<int16_t> vals) {
+    put_u16(4 + 2*vals.size());
+    put_u16(type);
+    for (auto val : vals) {
+        put_u16(val);
+    }
+}
+
+void SimpleGDSIIOutput::put_record(RecordType type, string_view str) {
+    /* Strings are padded to an even length with a NUL byte */
+    size_t len = str.size() + (str.size() % 2);
+    put_u16(4 + len);
+    put_u16(type);
+    m_buf.append(str);
+    if (str.size() % 2) {
+        m_buf.push_back('\0');
+    }
+}
+
+void SimpleGDSIIOutput::put_timestamps(RecordType type) {
+    time_t t = time(nullptr);
+    struct tm tm;
+    memcpy(&tm, gmtime(&t), sizeof(tm));
+    int16_t year = tm.tm_year + 1900, mon = tm.tm_mon + 1;
+    /* Modification time, then access time */
+    put_record(type, {year, (int16_t)mon, (int16_t)tm.tm_mday, (int16_t)tm.tm_hour, (int16_t)tm.tm_min, (int16_t)tm.tm_sec,
+                      year, (int16_t)mon, (int16_t)tm.tm_mday, (int16_t)tm.tm_hour, (int16_t)tm.tm_min, (int16_t)tm.tm_sec});
+}
+
+void SimpleGDSIIOutput::put_element(RecordType type, const vector<array<int32_t, 2>> &pts) {
+    assert(pts.size() <= max_xy_points);
+
+    put_record(type);
+    put_record(GDS_LAYER, {(int16_t)m_layer});
+    put_record(GDS_DATATYPE, {(int16_t)m_datatype});
+    if (type == GDS_PATH) {
+        put_record(GDS_PATHTYPE, {1}); /* round ends */
+        put_u16(8);
+        put_u16(GDS_WIDTH);
+        put_i32(llround(m_aperture_size * m_scale * m_db_scale));
+    }
+
+    put_u16(4 + 8*pts.size());
+    put_u16(GDS_XY);
+    for (auto &pt : pts) {
+        put_i32(pt[0]);
+        put_i32(pt[1]);
+    }
+    put_record(GDS_ENDEL);
+
+    if (m_buf.size() >= buf_size) {
+        flush_buf();
+    }
+}
+
+/* Same coordinate transform as SimpleGerberOutput */
+array<int32_t, 2> SimpleGDSIIOutput::quantize(d2p pt) {
+    double x = round((pt[0] * m_scale + m_offset[0]) * m_db_scale);
+    double y = round((m_height - pt[1] * m_scale + m_offset[1]) * m_db_scale);
+
+    if (fabs(x) > INT32_MAX || fabs(y) > INT32_MAX) {
+        if (!m_range_warned) {
+            cerr << "Warning: Coordinates out of range for GDSII output at " << m_digits_frac << " digits of precision."
+                << " Use a lower --precision." << endl;
+            m_range_warned = true;
+        }
+        x = clamp(x, (double)-INT32_MAX, (double)INT32_MAX);
+        y = clamp(y, (double)-INT32_MAX, (double)INT32_MAX);
+    }
+
+    return {(int32_t)x, (int32_t)y};
+}
+
+void SimpleGDSIIOutput::put_boundary(const Polygon &poly) {
+    vector<array<int32_t, 2>> pts;
+    for (auto &p : poly) {
+        auto q = quantize(p);
+        if (pts.empty() || q != pts.back()) {
+            pts.push_back(q);
+        }
+    }
+    if (pts.size() > 1 && pts.back() == pts.front()) {
+        pts.pop_back();
+    }
 
-    if (m_outline_mode) {
-        assert(pol == GRB_POL_DARK);
+    /* Zero-area after quantization */
+    if (pts.size() < 3) {
+        return;
     }
 
-    if ((pol == GRB_POL_DARK) != m_flip_pol) {
-        m_out << "%LPD*%" << endl;
-    } else {
-        m_out << "%LPC*%" << endl;
+    if (pts.size() + 1 <= max_xy_points) {
+        /* Boundaries are closed explicitly */
+        pts.push_back(pts.front());
+        put_element(GDS_BOUNDARY, pts);
+        return;
     }
 
+    /* Too many vertices for one XY record. Cut the polygon in half along the longer side of its bounding box and try
+     * again with both halves. */
+    ClipperLib::Path subject;
+    for (auto &p : poly) {
+        subject.push_back({(ClipperLib::cInt)round(p[0] * clipper_scale), (ClipperLib::cInt)round(p[1] * clipper_scale)});
+    }
+
+    ClipperLib::Clipper bounds;
+    bounds.AddPath(subject, ClipperLib::ptSubject, true);
+    ClipperLib::IntRect bbox = bounds.GetBounds();
+    bool cut_x = (bbox.right - bbox.left) >= (bbox.bottom - bbox.top);
+    ClipperLib::cInt cut = cut_x ? (bbox.left + bbox.right) / 2 : (bbox.top + bbox.bottom) / 2;
+
+    for (int side=0; side<2; side++) {
+        ClipperLib::IntRect r = bbox;
+        if (cut_x) {
+            (side == 0 ? r.right : r.left) = cut;
+        } else {
+            (side == 0 ? r.bottom : r.top) = cut;
+        }
+
+        ClipperLib::Clipper c;
+        c.AddPath(subject, ClipperLib::ptSubject, true);
+        c.AddPath({{r.left, r.top}, {r.right, r.top}, {r.right, r.bottom}, {r.left, r.bottom}}, ClipperLib::ptClip, true);
+        ClipperLib::Paths out;
+        c.Execute(ClipperLib::ctIntersection, out, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
+
+        for (auto &path : out) {
+            Polygon half;
+            for (auto &p : path) {
+                half.push_back({p.X / clipper_scale, p.Y / clipper_scale});
+            }
+            put_boundary(half);
+        }
+    }
+}
+
+void SimpleGDSIIOutput::header(d2p origin, d2p size) {
+    m_offset[1] += 2*origin[1] * m_scale; /* See SimpleGerberOutput::header_impl */
+    m_height = size[1] * m_scale;
+    StreamPolygonSink::header(origin, size);
+}
+
+void SimpleGDSIIOutput::header_impl(d2p, d2p) {
+    put_record(GDS_HEADER, {600});
+    put_timestamps(GDS_BGNLIB);
+    put_record(GDS_LIBNAME, m_libname);
+
+    /* User unit is 1um, database unit is 10^-digits mm */
+    double db_unit_m = 1e-3 / m_db_scale;
+    put_u16(4 + 16);
+    put_u16(GDS_UNITS);
+    for (double val : {db_unit_m / 1e-6, db_unit_m}) {
+        uint64_t bits = gds_real8(val);
+        put_i32(bits >> 32);
+        put_i32(bits & 0xffffffff);
+    }
+
+    put_timestamps(GDS_BGNSTR);
+    put_record(GDS_STRNAME, m_strname);
+}
+
+void SimpleGDSIIOutput::footer() {
+    if (!m_only_polys) {
+        footer_impl();
+    }
+    flush_buf();
+    m_out.flush();
+}
+
+void SimpleGDSIIOutput::footer_impl() {
+    put_record(GDS_ENDSTR);
+    put_record(GDS_ENDLIB);
+}
+
+SimpleGDSIIOutput &SimpleGDSIIOutput::operator<<(GerberPolarityToken pol) {
+    assert(pol == GRB_POL_DARK || pol == GRB_POL_CLEAR);
+
+    m_dark = (pol == GRB_POL_DARK);
+    if (!m_dark && !m_clear_warned) {
+        cerr << "Warning: Some shapes in this file were interpreted by svg-flatten as gerber \"clear\" polarity (background color). GDSII does not support clear polarity. Thus, these shapes will be omitted in the GDSII output." << endl;
+        m_clear_warned = true;
+    }
+
+    return *this;
+}
+
+SimpleGDSIIOutput &SimpleGDSIIOutput::operator<<(const ApertureToken &ap) {
+    m_aperture_set = ap.m_has_aperture;
+    m_aperture_size = (ap.m_size > 0.0) ? ap.m_size : 0.05;
     return *this;
 }
-SimpleGDSIIOutput& SimpleGDSIIOutput::operator<<(const Polygon &poly) {
-    if (poly.size() < 3 && !m_outline_mode) {
-        cerr << "Warning: " << poly.size() << "-element polygon passed to SimpleGerberOutput" << endl;
+
+SimpleGDSIIOutput &SimpleGDSIIOutput::operator<<(const Polygon &poly) {
+    if (!m_dark) {
         return *this;
     }
 
-    /* NOTE: Clipper and gerber both have different fixed-point scales. We get points in double mm. */
-    double x = round((poly[0][0] * m_scale + m_offset[0]) * m_gerber_scale);
-    double y = round((m_height - poly[0][1] * m_scale + m_offset[1]) * m_gerber_scale);
-    if (!m_outline_mode) {
-        m_out << "G36*" << endl;
+    if (!m_aperture_set) {
+        if (poly.size() < 3) {
+            cerr << "Warning: " << poly.size() << "-element polygon passed to SimpleGDSIIOutput in region mode" << endl;
+            return *this;
+        }
+
+        put_boundary(poly);
+        return *this;
     }
 
-    m_out << "X" << setw(m_digits_int + m_digits_frac) << setfill('0') << std::internal /* isn't C++ a marvel of engineering? */ << (long long int)x
-          << "Y" << setw(m_digits_int + m_digits_frac) << setfill('0') << std::internal << (long long int)y
-          << "D02*" << endl;
-    m_out << "G01*" << endl;
+    if (poly.empty()) {
+        return *this;
+    }
 
-    for (size_t i=1; i<poly.size(); i++) {
-        double x = round((poly[i][0] * m_scale + m_offset[0]) * m_gerber_scale);
-        double y = round((m_height - poly[i][1] * m_scale + m_offset[1]) * m_gerber_scale);
-        m_out << "X" << setw(m_digits_int + m_digits_frac) << setfill('0') << std::internal << (long long int)x
-              << "Y" << setw(m_digits_int + m_digits_frac) << setfill('0') << std::internal << (long long int)y
-              << "D01*" << endl;
+    vector<array<int32_t, 2>> pts;
+    for (auto &p : poly) {
+        auto q = quantize(p);
+        if (pts.empty() || q != pts.back()) {
+            pts.push_back(q);
+        }
+    }
+    if (pts.size() == 1) { /* Dot */
+        pts.push_back(pts.front());
     }
 
-    if (!m_outline_mode) {
-        m_out << "G37*" << endl;
+    /* Split long paths into pieces that share their end points. Round ends make the joints invisible. */
+    for (size_t i=0; i+1 < pts.size(); i += max_xy_points - 1) {
+        size_t end = min(pts.size(), i + max_xy_points);
+        put_element(GDS_PATH, vector<array<int32_t, 2>>(pts.begin() + i, pts.begin() + end));
     }
 
     return *this;
 }
 
-void SimpleGDSIIOutput::footer_impl() {
-    
-}
+SimpleGDSIIOutput &SimpleGDSIIOutput::operator<<(const FlashToken &tok) {
+    assert(m_aperture_set);
+    if (!m_dark) {
+        return *this;
+    }
 
+    /* Approximate the circular aperture to within 1um */
+    double r = m_aperture_size / 2;
+    int n = 8;
+    if (r > 0.001) {
+        n = clamp((int)ceil(M_PI / acos(1.0 - 0.001 / r)), 8, 256);
+    }
+
+    Polygon circle;
+    for (int i=0; i<n; i++) {
+        double a = 2*M_PI * i / n;
+        circle.push_back({tok.m_offset[0] + r * cos(a), tok.m_offset[1] + r * sin(a)});
+    }
+    put_boundary(circle);
+
+    return *this;
+}
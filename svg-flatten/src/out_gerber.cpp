@@ -20,9 +20,13 @@
 #include <algorithm>
 #include <string>
 #include <iostream>
-#include <iomanip>
+#include <charconv>
+#include <array>
+#include <vector>
 #include <gerbolyze.hpp>
+#include <clipper.hpp>
 #include <svg_import_defs.h>
+#include <svg_geom.h>
 
 using namespace gerbolyze;
 using namespace std;
@@ -34,14 +38,173 @@ SimpleGerberOutput::SimpleGerberOutput(ostream &out, bool only_polys, int digits
     m_offset(offset),
     m_scale(scale),
     m_flip_pol(flip_polarity),
-    m_current_aperture(0.05),
     m_aperture_set(false),
-    m_macro_aperture(false),
-    m_aperture_num(10) /* See gerber standard */
+    m_aperture_num(10), /* See gerber standard */
+    m_current_dcode(10)
 {
     assert(1 <= digits_int && digits_int <= 9);
     assert(0 <= digits_frac && digits_frac <= 9);
     m_gerber_scale = round(pow(10, m_digits_frac));
+    /* Default aperture defined in our header */
+    m_apertures[{'C', llround(0.05 * m_gerber_scale)}] = 10;
+    m_buf.reserve(buf_size + 4096);
+}
+
+SimpleGerberOutput::~SimpleGerberOutput() {
+    flush_buf();
+    /* Queued encoder jobs must not outlive us */
+    sync();
+}
+
+void SimpleGerberOutput::footer() {
+    if (!m_only_polys) {
+        footer_impl();
+    }
+    flush_buf();
+    sync();
+    m_out.flush();
+}
+
+/* Numbers are formatted using to_chars, which is locale-independent and much faster than iostream formatting. The output
+ * is byte-for-byte what iostream formatting with default settings would produce. */
+static void append_int(string &buf, long long int val) {
+    char tmp[24];
+    auto res = to_chars(tmp, tmp + sizeof(tmp), val);
+    buf.append(tmp, res.ptr - tmp);
+}
+
+static void append_double(string &buf, double val) {
+    /* Same as iostream's default of %g with a precision of 6 */
+    char tmp[32];
+    auto res = to_chars(tmp, tmp + sizeof(tmp), val, chars_format::general, 6);
+    buf.append(tmp, res.ptr - tmp);
+}
+
+/* Append a coordinate zero-padded to the full number of digits of our coordinate format. A minus sign counts towards
+ * that width and goes in front of the padding. */
+static void append_coord(string &buf, long long int val, int width) {
+    char tmp[24];
+    auto res = to_chars(tmp, tmp + sizeof(tmp), val);
+    char *digits = tmp;
+    if (val < 0) {
+        buf.push_back('-');
+        digits++;
+        width--;
+    }
+
+    int len = res.ptr - digits;
+    if (len < width)
+        buf.append(width - len, '0');
+    buf.append(digits, res.ptr - digits);
+}
+
+static void append_xy(string &buf, long long int x, long long int y, int width, string_view dcode) {
+    buf.push_back('X');
+    append_coord(buf, x, width);
+    buf.push_back('Y');
+    append_coord(buf, y, width);
+    buf.append(dcode);
+    buf.push_back('\n');
+}
+
+/* Coordinates in gerber are modal. We only emit those coordinates that changed since the last operation, and drop
+ * vertices that end up on the same point as their predecessor after rounding to our output grid. The current point is
+ * only tracked within one polygon, so the output of this function does not depend on what was emitted before it. */
+void SimpleGerberOutput::format_polygon(string &buf, const Polygon &poly, bool region, const CoordFormat &fmt) {
+    /* NOTE: Clipper and gerber both have different fixed-point scales. We get points in double mm. */
+    auto quantize = [&fmt](const d2p &p) {
+        return array<long long int, 2> {
+            (long long int)round((p[0] * fmt.scale + fmt.offset[0]) * fmt.gerber_scale),
+            (long long int)round((fmt.height - p[1] * fmt.scale + fmt.offset[1]) * fmt.gerber_scale)
+        };
+    };
+
+    thread_local vector<array<long long int, 2>> pts;
+    pts.clear();
+    for (auto &p : poly) {
+        auto q = quantize(p);
+        if (pts.empty() || q != pts.back()) {
+            pts.push_back(q);
+        }
+    }
+
+    if (region) {
+        /* Zero-area region after rounding. An explicit closing vertex does not count. */
+        size_t distinct = pts.size() - ((pts.size() > 1 && pts.back() == pts.front()) ? 1 : 0);
+        if (distinct < 3) {
+            return;
+        }
+
+        buf.append("G36*\n");
+    }
+
+    append_xy(buf, pts[0][0], pts[0][1], fmt.width, "D02*");
+    buf.append("G01*\n");
+
+    if (pts.size() == 1) {
+        /* Stroke that collapsed into a single point. Still draw it as a dot. */
+        append_xy(buf, pts[0][0], pts[0][1], fmt.width, "D01*");
+    }
+
+    for (size_t i=1; i<pts.size(); i++) {
+        if (pts[i][0] != pts[i-1][0]) {
+            buf.push_back('X');
+            append_coord(buf, pts[i][0], fmt.width);
+        }
+        if (pts[i][1] != pts[i-1][1]) {
+            buf.push_back('Y');
+            append_coord(buf, pts[i][1], fmt.width);
+        }
+        buf.append("D01*\n");
+    }
+
+    if (region) {
+        buf.append("G37*\n");
+    }
+}
+
+/* Output is collected in a large buffer, and handed to the output stream in large blocks. With encoder threads, the
+ * buffer only collects the short bits of output between polygons, and is handed to the encoder queue in order. */
+void SimpleGerberOutput::flush_buf() {
+    if (m_buf.empty())
+        return;
+
+    if (parallel_encoding()) {
+        encode([text = std::move(m_buf)](string &out) { out.append(text); });
+        m_buf = {};
+    } else {
+        m_out.write(m_buf.data(), m_buf.size());
+        m_buf.clear();
+    }
+}
+
+void SimpleGerberOutput::put(string_view str) {
+    m_buf.append(str);
+}
+
+void SimpleGerberOutput::put_line(string_view str) {
+    m_buf.append(str);
+    end_line();
+}
+
+void SimpleGerberOutput::end_line() {
+    m_buf.push_back('\n');
+    if (m_buf.size() >= buf_size)
+        flush_buf();
+}
+
+void SimpleGerberOutput::put(long long int val) {
+    append_int(m_buf, val);
+}
+
+void SimpleGerberOutput::put(double val) {
+    append_double(m_buf, val);
+}
+
+void SimpleGerberOutput::put_xy(long long int x, long long int y, string_view dcode) {
+    append_xy(m_buf, x, y, m_digits_int + m_digits_frac, dcode);
+    if (m_buf.size() >= buf_size)
+        flush_buf();
 }
 
 void SimpleGerberOutput::header_impl(d2p origin, d2p size) {
@@ -55,30 +218,52 @@ void SimpleGerberOutput::header_impl(d2p origin, d2p size) {
         cerr << "         Bounding box in gerber units: " << m_width << " x " << m_height << endl;
     }
 
-    m_out << "%FSLAX" << m_digits_int << m_digits_frac << "Y" << m_digits_int << m_digits_frac << "*%" << endl;
-    m_out << "%MOMM*%" << endl;
-    m_out << "%LPD*%" << endl;
-    m_out << "G01*" << endl;
-    m_out << "%ADD10C,0.050000*%" << endl;
-    m_out << "D10*" << endl;
+    put("%FSLAX");
+    put((long long int)m_digits_int);
+    put((long long int)m_digits_frac);
+    put("Y");
+    put((long long int)m_digits_int);
+    put((long long int)m_digits_frac);
+    put_line("*%");
+    put_line("%MOMM*%");
+    put_line("%LPD*%");
+    put_line("G01*");
+    put_line("%ADD10C,0.050000*%");
+    put_line("D10*");
 }
 
+/* Apertures are looked up in a dictionary by their shape and their size quantized to our output resolution, so each
+ * distinct aperture is only defined once. The definition is emitted on first use. */
 SimpleGerberOutput& SimpleGerberOutput::operator<<(const ApertureToken &ap) {
     m_aperture_set = ap.m_has_aperture;
-
-    if (!m_macro_aperture && ap.m_size == m_current_aperture) {
+    if (!m_aperture_set)
         return *this;
-    }
 
-    m_macro_aperture = false;
+    double size = (ap.m_size > 0.0) ? ap.m_size : 0.05;
+    pair<char, long long int> key {'C', llround(size * m_gerber_scale)};
 
-    if (m_aperture_set) {
-        m_current_aperture = ap.m_size;
+    unsigned int dcode;
+    auto it = m_apertures.find(key);
+    if (it != m_apertures.end()) {
+        dcode = it->second;
+
+    } else {
         m_aperture_num += 1;
+        dcode = m_aperture_num;
+        m_apertures[key] = dcode;
 
-        double size = (ap.m_size > 0.0) ? ap.m_size : 0.05;
-        m_out << "%ADD" << m_aperture_num << "C," << size << "*%" << endl;
-        m_out << "D" << m_aperture_num << "*" << endl;
+        put("%ADD");
+        put((long long int)dcode);
+        put("C,");
+        put(size);
+        put_line("*%");
+    }
+
+    if (dcode != m_current_dcode) {
+        m_current_dcode = dcode;
+        put("D");
+        put((long long int)dcode);
+        put_line("*");
     }
 
     return *this;
@@ -86,11 +271,12 @@ SimpleGerberOutput& SimpleGerberOutput::operator<<(const ApertureToken &ap) {
 
 SimpleGerberOutput& SimpleGerberOutput::operator<<(GerberPolarityToken pol) {
     assert(pol == GRB_POL_DARK || pol == GRB_POL_CLEAR);
+    m_current_polarity = pol;
 
     if ((pol == GRB_POL_DARK) != m_flip_pol) {
-        m_out << "%LPD*%" << endl;
+        put_line("%LPD*%");
     } else {
-        m_out << "%LPC*%" << endl;
+        put_line("%LPC*%");
     }
 
     return *this;
@@ -101,35 +287,108 @@ SimpleGerberOutput& SimpleGerberOutput::operator<<(const Polygon &poly) {
         return *this;
     }
 
-    /* NOTE: Clipper and gerber both have different fixed-point scales. We get points in double mm. */
-    double x = round((poly[0][0] * m_scale + m_offset[0]) * m_gerber_scale);
-    double y = round((m_height - poly[0][1] * m_scale + m_offset[1]) * m_gerber_scale);
-    if (!m_aperture_set) {
-        m_out << "G36*" << endl;
+    CoordFormat fmt {m_digits_int + m_digits_frac, m_scale, m_offset, m_height, m_gerber_scale};
+    bool region = !m_aperture_set;
+    if (parallel_encoding()) {
+        flush_buf();
+        encode([poly, region, fmt](string &out) { format_polygon(out, poly, region, fmt); });
+    } else {
+        format_polygon(m_buf, poly, region, fmt);
+        if (m_buf.size() >= buf_size)
+            flush_buf();
+    }
+
+    return *this;
+}
+
+/* With encoder threads, hand the polygon to the encoder job instead of copying it */
+SimpleGerberOutput& SimpleGerberOutput::operator<<(Polygon &&poly) {
+    if (!parallel_encoding() || (poly.size() < 3 && !m_aperture_set)) {
+        return *this << static_cast<const Polygon &>(poly);
+    }
+
+    CoordFormat fmt {m_digits_int + m_digits_frac, m_scale, m_offset, m_height, m_gerber_scale};
+    bool region = !m_aperture_set;
+    flush_buf();
+    encode([poly = std::move(poly), region, fmt](string &out) { format_polygon(out, poly, region, fmt); });
+    return *this;
+}
+
+/* With encoder threads, a whole batch becomes a single encoder job */
+SimpleGerberOutput& SimpleGerberOutput::operator<<(const BatchToken &tok) {
+    if (!parallel_encoding()) {
+        return static_cast<SimpleGerberOutput &>(PolygonSink::operator<<(tok));
+    }
+
+    *this << tok.m_polarity << tok.m_aperture;
+    vector<Polygon> polys;
+    polys.reserve(tok.m_polys.size());
+    for (auto &poly : tok.m_polys) {
+        if (poly.size() < 3 && !m_aperture_set) {
+            cerr << "Warning: " << poly.size() << "-element polygon passed to SimpleGerberOutput in region mode" << endl;
+            continue;
+        }
+        polys.push_back(std::move(poly));
+    }
+
+    CoordFormat fmt {m_digits_int + m_digits_frac, m_scale, m_offset, m_height, m_gerber_scale};
+    bool region = !m_aperture_set;
+    flush_buf();
+    encode([polys = std::move(polys), region, fmt](string &out) {
+        for (const auto &poly : polys) {
+            format_polygon(out, poly, region, fmt);
+        }
+    });
+    return *this;
+}
+
+/* In hole region mode, holes are cut out of dark outline regions using clear regions. Holes in clear regions would have
+ * to be dark regions, which would add copper instead of leaving alone whatever is below. These are deholed instead. */
+SimpleGerberOutput& SimpleGerberOutput::operator<<(const PolygonWithHolesToken &tok) {
+    if (tok.m_contours.empty()) {
+        return *this;
     }
 
-    m_out << "X" << setw(m_digits_int + m_digits_frac) << setfill('0') << std::internal /* isn't C++ a marvel of engineering? */ << (long long int)x
-          << "Y" << setw(m_digits_int + m_digits_frac) << setfill('0') << std::internal << (long long int)y
-          << "D02*" << endl;
-    m_out << "G01*" << endl;
+    GerberPolarityToken pol = m_current_polarity;
+    if (tok.m_contours.size() > 1 && !m_aperture_set && (pol == GRB_POL_DARK) == m_flip_pol) {
+        ClipperLib::Clipper c;
+        for (const auto &contour : tok.m_contours) {
+            ClipperLib::Path path;
+            path.reserve(contour.size());
+            for (const auto &p : contour) {
+                path.push_back({(ClipperLib::cInt)round(p[0] * clipper_scale), (ClipperLib::cInt)round(p[1] * clipper_scale)});
+            }
+            c.AddPath(path, ClipperLib::ptSubject, /* closed */ true);
+        }
 
-    for (size_t i=1; i<poly.size(); i++) {
-        double x = round((poly[i][0] * m_scale + m_offset[0]) * m_gerber_scale);
-        double y = round((m_height - poly[i][1] * m_scale + m_offset[1]) * m_gerber_scale);
-        m_out << "X" << setw(m_digits_int + m_digits_frac) << setfill('0') << std::internal << (long long int)x
-              << "Y" << setw(m_digits_int + m_digits_frac) << setfill('0') << std::internal << (long long int)y
-              << "D01*" << endl;
+        ClipperLib::PolyTree ptree;
+        c.Execute(ClipperLib::ctUnion, ptree, ClipperLib::pftEvenOdd, ClipperLib::pftEvenOdd);
+        ClipperLib::Paths out;
+        dehole_polytree(ptree, out);
+        PolygonSink::operator<<(out);
+        return *this;
     }
 
+    *this << std::move(tok.m_contours[0]);
+    if (tok.m_contours.size() == 1) {
+        return *this;
+    }
+
+    if (!m_aperture_set) {
+        *this << (pol == GRB_POL_DARK ? GRB_POL_CLEAR : GRB_POL_DARK);
+    }
+    for (auto &hole : tok.m_contours.subspan(1)) {
+        *this << std::move(hole);
+    }
     if (!m_aperture_set) {
-        m_out << "G37*" << endl;
+        *this << pol;
     }
 
     return *this;
 }
 
 void SimpleGerberOutput::footer_impl() {
-    m_out << "M02*" << endl;
+    put_line("M02*");
 }
 
 
@@ -139,35 +398,51 @@ SimpleGerberOutput &SimpleGerberOutput::operator<<(const FlashToken &tok) {
     double x = round((tok.m_offset[0] * m_scale + m_offset[0]) * m_gerber_scale);
     double y = round((m_height - tok.m_offset[1] * m_scale + m_offset[1]) * m_gerber_scale);
 
-    m_out << "X" << setw(m_digits_int + m_digits_frac) << setfill('0') << std::internal /* isn't C++ a marvel of engineering? */ << (long long int)x
-          << "Y" << setw(m_digits_int + m_digits_frac) << setfill('0') << std::internal << (long long int)y
-          << "D03*" << endl;
+    put_xy((long long int)x, (long long int)y, "D03*");
 
     return *this;
 }
 
 SimpleGerberOutput &SimpleGerberOutput::operator<<(const PatternToken &tok) {
     m_aperture_set = true;
-    m_macro_aperture = true;
     m_aperture_num += 1;
+    m_current_dcode = m_aperture_num;
 
-    m_out << "%AMmacro" << m_aperture_num << "*" << endl;
+    put("%AMmacro");
+    put((long long int)m_aperture_num);
+    put_line("*");
 
     for (auto &pair : tok.m_polys) {
         int exposure = (pair.second == GRB_POL_DARK) ? 1 : 0;
-        m_out << 4 << "," << exposure << "," << pair.first.size();
+        put("4,");
+        put((long long int)exposure);
+        put(",");
+        put((long long int)pair.first.size());
         for (auto &pt : pair.first) {
-            m_out << "," << pt[0] << "," << pt[1];
+            put(",");
+            put(pt[0]);
+            put(",");
+            put(pt[1]);
         }
         /* We internally represent closed polys as (a - b - c - d), while Gerber aperture macros require the first and
          * last vertex to be the same as in (a - b - c - d - a).
          */
-        m_out << "," << pair.first[0][0] << "," << pair.first[0][1] << "*" << endl;
+        put(",");
+        put(pair.first[0][0]);
+        put(",");
+        put(pair.first[0][1]);
+        put_line("*");
     }
 
-    m_out << "%" << endl;
-    m_out << "%ADD" << m_aperture_num << "macro" << m_aperture_num << "*%" << endl;
-    m_out << "D" << m_aperture_num << "*" << endl;
+    put_line("%");
+    put("%ADD");
+    put((long long int)m_aperture_num);
+    put("macro");
+    put((long long int)m_aperture_num);
+    put_line("*%");
+    put("D");
+    put((long long int)m_aperture_num);
+    put_line("*");
 
     return *this;
 }
@@ -0,0 +1,177 @@
+/*
+ * This file is part of gerbolyze, a vector image preprocessing toolchain 
+ * Copyright (C) 2021 Jan Sebastian Götte <gerbolyze@jaseg.de>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cmath>
+#include <algorithm>
+#include <string>
+#include <iostream>
+#include <gerbolyze.hpp>
+#include <clipper.hpp>
+#include <svg_import_defs.h>
+#include <svg_geom.h>
+#include "util.h"
+
+using namespace gerbolyze;
+using namespace std;
+
+/* RegionMerger unions runs of consecutive regions of the same polarity before passing them on. Since dark on dark or
+ * clear on clear does not change the rendered result, this is lossless. Any other token ends the current run. The
+ * batches of a run are merged in parallel. */
+
+void RegionBatcher::add(const Polygon &poly) {
+    ClipperLib::Path path;
+    path.reserve(poly.size());
+    ClipperLib::IntRect bb {
+        (ClipperLib::cInt)round(poly[0][0] * clipper_scale), (ClipperLib::cInt)round(poly[0][1] * clipper_scale),
+        (ClipperLib::cInt)round(poly[0][0] * clipper_scale), (ClipperLib::cInt)round(poly[0][1] * clipper_scale)};
+    for (auto &p : poly) {
+        ClipperLib::IntPoint ip {(ClipperLib::cInt)round(p[0] * clipper_scale), (ClipperLib::cInt)round(p[1] * clipper_scale)};
+        bb.left = min(bb.left, ip.X);
+        bb.top = min(bb.top, ip.Y);
+        bb.right = max(bb.right, ip.X);
+        bb.bottom = max(bb.bottom, ip.Y);
+        path.push_back(ip);
+    }
+
+    if (!ClipperLib::Orientation(path))
+        ClipperLib::ReversePath(path);
+
+    bool new_batch = m_batches.empty();
+    if (!new_batch) {
+        ClipperLib::cInt max_extent = m_max_extent * clipper_scale;
+        ClipperLib::IntRect merged {
+            min(m_batch_bounds.left, bb.left), min(m_batch_bounds.top, bb.top),
+            max(m_batch_bounds.right, bb.right), max(m_batch_bounds.bottom, bb.bottom)};
+
+        if (m_batches.back().size() >= m_max_polys
+                || merged.right - merged.left > max_extent
+                || merged.bottom - merged.top > max_extent) {
+            new_batch = true;
+        } else {
+            bb = merged;
+        }
+    }
+
+    if (new_batch) {
+        m_batches.emplace_back();
+    }
+    m_batch_bounds = bb;
+    m_batches.back().push_back(std::move(path));
+    m_num_polys++;
+}
+
+vector<ClipperLib::Paths> RegionBatcher::take() {
+    vector<ClipperLib::Paths> out;
+    out.swap(m_batches);
+    m_num_polys = 0;
+    return out;
+}
+
+void RegionMerger::header(d2p origin, d2p size) {
+    m_sink.header(origin, size);
+}
+
+void RegionMerger::footer() {
+    flush();
+    cerr << "Region merger: merged " << m_polys_in << " regions into " << m_polys_out << endl;
+    m_sink.footer();
+}
+
+bool RegionMerger::can_do_apertures() {
+    return m_sink.can_do_apertures();
+}
+
+RegionMerger &RegionMerger::operator<<(const LayerNameToken &layer_name) {
+    flush();
+    m_sink << layer_name;
+    return *this;
+}
+
+RegionMerger &RegionMerger::operator<<(GerberPolarityToken pol) {
+    if (pol != m_current_polarity) {
+        flush();
+        m_current_polarity = pol;
+    }
+    /* Always pass on polarity so the downstream sink's state matches what we got. */
+    m_sink << pol;
+    return *this;
+}
+
+RegionMerger &RegionMerger::operator<<(const ApertureToken &tok) {
+    flush();
+    m_aperture_set = tok.m_has_aperture;
+    m_sink << tok;
+    return *this;
+}
+
+RegionMerger &RegionMerger::operator<<(const FlashToken &tok) {
+    flush();
+    m_sink << tok;
+    return *this;
+}
+
+RegionMerger &RegionMerger::operator<<(const PatternToken &tok) {
+    flush();
+    m_aperture_set = true;
+    m_sink << tok;
+    return *this;
+}
+
+RegionMerger &RegionMerger::operator<<(const Polygon &poly) {
+    /* Strokes cannot be merged */
+    if (m_aperture_set) {
+        m_sink << poly;
+        return *this;
+    }
+
+    if (poly.size() < 3)
+        return *this;
+
+    m_run.add(poly);
+    if (m_run.full()) {
+        flush();
+    }
+    return *this;
+}
+
+void RegionMerger::flush() {
+    if (m_run.empty())
+        return;
+
+    vector<ClipperLib::Paths> batches = m_run.take();
+    /* Constructed in place and never copied, since PolyTree owns its nodes through raw pointers */
+    vector<ClipperLib::PolyTree> results(batches.size());
+    parallel_for(batches.size(), [&batches, &results](size_t i) {
+        ClipperLib::Clipper c;
+        c.AddPaths(batches[i], ClipperLib::ptSubject, /* closed */ true);
+        c.StrictlySimple(true);
+        c.Execute(ClipperLib::ctUnion, results[i], ClipperLib::pftNonZero, ClipperLib::pftNonZero);
+    });
+
+    /* Emit in input order so output does not depend on thread scheduling */
+    for (size_t i=0; i<batches.size(); i++) {
+        ClipperLib::Paths out;
+        dehole_polytree(results[i], out);
+
+        m_polys_in += batches[i].size();
+        m_polys_out += out.size();
+        for (auto &path : out) {
+            m_sink << path;
+        }
+    }
+}
@@ -42,6 +42,10 @@ bool PolygonScaler::can_do_apertures() {
     return m_sink.can_do_apertures();
 }
 
+bool PolygonScaler::can_do_holes() {
+    return m_sink.can_do_holes();
+}
+
 PolygonScaler &PolygonScaler::operator<<(const LayerNameToken &layer_name) {
     m_sink << layer_name;
 
@@ -62,11 +66,26 @@ PolygonScaler &PolygonScaler::operator<<(const ApertureToken &tok) {
 }
 
 PolygonScaler &PolygonScaler::operator<<(const Polygon &poly) {
-    Polygon new_poly;
+    return *this << Polygon(poly);
+}
+
+/* Scale in place and pass the polygon on without another copy */
+PolygonScaler &PolygonScaler::operator<<(Polygon &&poly) {
     for (auto &p : poly) {
-        new_poly.push_back({ p[0] * m_scale, p[1] * m_scale });
+        p = { p[0] * m_scale, p[1] * m_scale };
+    }
+    m_sink << std::move(poly);
+
+    return *this;
+}
+
+PolygonScaler &PolygonScaler::operator<<(const PolygonWithHolesToken &tok) {
+    for (auto &poly : tok.m_contours) {
+        for (auto &p : poly) {
+            p = { p[0] * m_scale, p[1] * m_scale };
+        }
     }
-    m_sink << new_poly;
+    m_sink << tok;
 
     return *this;
 }
@@ -21,6 +21,7 @@
 #include <string>
 #include <iostream>
 #include <iomanip>
+#include <sstream>
 #include <gerbolyze.hpp>
 #include <svg_import_defs.h>
 #include <ctime>
@@ -131,6 +132,15 @@ KicadSexpOutput &KicadSexpOutput::operator<<(const LayerNameToken &layer_name) {
     return *this;
 }
 
+static void format_poly(ostream &out, const Polygon &poly, const string &layer) {
+    out << "  (fp_poly (pts";
+    for (auto &p : poly) {
+        out << " (xy " << p[0] << " " << p[1] << ")";
+    }
+    out << ")";
+    out << " (layer " << layer << ") (width 0))\n";
+}
+
 KicadSexpOutput &KicadSexpOutput::operator<<(const Polygon &poly) {
     if (m_auto_layer) {
         if (std::find(m_export_layers->begin(), m_export_layers->end(), m_layer) == m_export_layers->end()) {
@@ -144,12 +154,23 @@ KicadSexpOutput &KicadSexpOutput::operator<<(const Polygon &poly) {
         return *this;
     }
 
-    m_out << "  (fp_poly (pts";
-    for (auto &p : poly) {
-        m_out << " (xy " << p[0] << " " << p[1] << ")";
+    if (!parallel_encoding()) {
+        format_poly(m_out, poly, m_layer);
+        return *this;
     }
-    m_out << ")";
-    m_out << " (layer " << m_layer << ") (width 0))" << endl;
+
+    /* Format using a private stream set up like m_out, so the output does not depend on the encoder. */
+    auto flags = m_out.flags();
+    auto precision = m_out.precision();
+    auto fill = m_out.fill();
+    encode([poly, layer=m_layer, flags, precision, fill](string &out) {
+        ostringstream ss;
+        ss.flags(flags);
+        ss.precision(precision);
+        ss.fill(fill);
+        format_poly(ss, poly, layer);
+        out.append(ss.str());
+    });
 
     return *this;
 }
@@ -0,0 +1,89 @@
+/*
+ * This file is part of gerbolyze, a vector image preprocessing toolchain 
+ * Copyright (C) 2021 Jan Sebastian Götte <gerbolyze@jaseg.de>
+ * 
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include <iostream>
+#include <gerbolyze.hpp>
+#include "util.h"
+
+using namespace gerbolyze;
+using namespace std;
+
+StreamPolygonSink::StreamPolygonSink(ostream &out, bool only_polys)
+    : m_only_polys(only_polys), m_out(out)
+{
+}
+
+StreamPolygonSink::~StreamPolygonSink() {
+    sync();
+}
+
+void StreamPolygonSink::footer() {
+    sync();
+    if (!m_only_polys) {
+        footer_impl();
+    }
+    m_out.flush();
+}
+
+void StreamPolygonSink::set_encoder_threads(size_t threads) {
+    sync();
+#ifndef WASI
+    if (threads > 0 && can_encode_parallel()) {
+        m_writer = make_unique<OrderedBlockWriter>(m_out, threads);
+    } else {
+        m_writer.reset();
+    }
+#else
+    (void) threads;
+#endif
+}
+
+void StreamPolygonSink::encode(encoder_fun fun) {
+    if (!m_writer) {
+        string text;
+        fun(text);
+        m_out.write(text.data(), text.size());
+        return;
+    }
+
+    m_batch.push_back(std::move(fun));
+    if (m_batch.size() >= encoder_batch_size) {
+        submit_batch();
+    }
+}
+
+void StreamPolygonSink::submit_batch() {
+    if (m_batch.empty())
+        return;
+
+    m_writer->submit([batch = std::move(m_batch)](string &out) {
+        for (auto &fun : batch) {
+            fun(out);
+        }
+    });
+    m_batch = {};
+}
+
+void StreamPolygonSink::sync() {
+    if (!m_writer)
+        return;
+
+    submit_batch();
+    m_writer->finish();
+}
@@ -21,6 +21,7 @@
 #include <string>
 #include <iostream>
 #include <iomanip>
+#include <sstream>
 #include <gerbolyze.hpp>
 #include <svg_import_defs.h>
 
@@ -37,12 +38,99 @@ SimpleSVGOutput::SimpleSVGOutput(ostream &out, bool only_polys, int digits_frac,
 {
 }
 
+SimpleSVGOutput::~SimpleSVGOutput() {
+    flush_batch();
+    sync();
+}
+
 void SimpleSVGOutput::header_impl(d2p origin, d2p size) {
     //cerr << "svg: header" << endl;
     m_offset[0] = origin[0];
     m_offset[1] = origin[1];
     m_out << "<svg width=\"" << size[0] << "mm\" height=\"" << size[1] << "mm\" viewBox=\"0 0 "
-        << size[0] << " " << size[1] << "\" xmlns=\"http://www.w3.org/2000/svg\">" << endl;
+        << size[0] << " " << size[1] << "\" xmlns=\"http://www.w3.org/2000/svg\" xmlns:xlink=\"http://www.w3.org/1999/xlink\">" << endl;
+}
+
+void SimpleSVGOutput::footer() {
+    flush_batch();
+    StreamPolygonSink::footer();
+}
+
+/* Write a piece of output in order with any polygon batches still queued for encoding */
+void SimpleSVGOutput::emit(string text) {
+    if (parallel_encoding()) {
+        encode([text = std::move(text)](string &out) { out.append(text); });
+    } else {
+        m_out << text;
+    }
+}
+
+static void format_subpath(ostream &out, const Polygon &poly, bool closed, bool hole, d2p offset) {
+    /* Fills of a batch are rendered with the nonzero rule, so make all subpaths run the same way round. Otherwise,
+     * overlapping subpaths would cancel out. Holes run the other way round, so they cancel out the polygon they are in,
+     * but not other polygons of the batch that overlap them. */
+    bool reverse = false;
+    if (closed) {
+        double area = 0;
+        for (size_t i=0; i<poly.size(); i++) {
+            const d2p &a = poly[i], &b = poly[(i+1) % poly.size()];
+            area += a[0]*b[1] - b[0]*a[1];
+        }
+        reverse = hole ? (area > 0) : (area < 0);
+    }
+
+    for (size_t i=0; i<poly.size(); i++) {
+        const d2p &p = reverse ? poly[poly.size() - 1 - i] : poly[i];
+        out << (i == 0 ? "M " : " L ") << (p[0] + offset[0]) << " " << (p[1] + offset[1]);
+    }
+
+    if (closed) {
+        out << " Z";
+    }
+}
+
+static void format_path(ostream &out, const vector<Polygon> &polys, const vector<bool> &holes, const string &color, double stroke_width, d2p offset) {
+    bool closed = std::isnan(stroke_width);
+    if (closed) {
+        out << "<path fill=\"" << color << "\" d=\"";
+    } else {
+        out << "<path fill=\"none\" stroke=\"" << color << "\" stroke-width=\"" << stroke_width << "\" stroke-linejoin=\"round\" stroke-linecap=\"round\" d=\"";
+    }
+
+    for (size_t i=0; i<polys.size(); i++) {
+        if (i > 0) {
+            out << " ";
+        }
+        format_subpath(out, polys[i], closed, holes[i], offset);
+    }
+
+    out << "\"/>\n";
+}
+
+/* Consecutive polygons of the same style are collected and written as subpaths of one path element. */
+void SimpleSVGOutput::flush_batch() {
+    if (m_batch.empty())
+        return;
+
+    int digits = m_digits_frac;
+    auto job = [polys = std::move(m_batch), holes = std::move(m_batch_holes), color = m_batch_color,
+                width = m_batch_stroke_width, offset = m_offset, digits](string &out) {
+        ostringstream ss;
+        ss.precision(digits);
+        format_path(ss, polys, holes, color, width, offset);
+        out.append(ss.str());
+    };
+    m_batch = {};
+    m_batch_holes = {};
+    m_batch_vertices = 0;
+
+    if (parallel_encoding()) {
+        encode(std::move(job));
+    } else {
+        string text;
+        job(text);
+        m_out << text;
+    }
 }
 
 SimpleSVGOutput &SimpleSVGOutput::operator<<(GerberPolarityToken pol) {
@@ -60,40 +148,144 @@ SimpleSVGOutput &SimpleSVGOutput::operator<<(GerberPolarityToken pol) {
 
 SimpleSVGOutput &SimpleSVGOutput::operator<<(const ApertureToken &ap) {
     m_stroke_width = ap.m_has_aperture ? ap.m_size : std::nan("0");
+    m_current_pattern = -1;
     return *this;
 }
 
 SimpleSVGOutput &SimpleSVGOutput::operator<<(const Polygon &poly) {
+    return *this << Polygon(poly);
+}
+
+SimpleSVGOutput &SimpleSVGOutput::operator<<(Polygon &&poly) {
     //cerr << "svg: got poly of size " << poly.size() << endl;
     if (std::isnan(m_stroke_width) && poly.size() < 3) {
         cerr << "Warning: " << poly.size() << "-element polygon passed to SimpleSVGOutput in fill mode" << endl;
         return *this;
     }
 
-    if (std::isnan(m_stroke_width)) {
-        m_out << "<path fill=\"" << m_current_color << "\" d=\"";
-    } else {
-        m_out << "<path fill=\"none\" stroke=\"" << m_current_color << "\" stroke-width=\"" << m_stroke_width << "\" stroke-linejoin=\"round\" stroke-linecap=\"round\" d=\"";
+    if (poly.empty()) {
+        return *this;
     }
 
-    m_out << "M " << setprecision(m_digits_frac) << (poly[0][0] + m_offset[0])
-          << " " << setprecision(m_digits_frac) << (poly[0][1] + m_offset[1]);
+    start_batch(poly.size());
+    m_batch_vertices += poly.size();
+    m_batch.push_back(std::move(poly));
+    m_batch_holes.push_back(false);
+    return *this;
+}
+
+/* A polygon and its holes always go into the same path element */
+SimpleSVGOutput &SimpleSVGOutput::operator<<(const PolygonWithHolesToken &tok) {
+    /* Stroked outlines do not care about holes */
+    if (!std::isnan(m_stroke_width)) {
+        for (auto &poly : tok.m_contours) {
+            *this << std::move(poly);
+        }
+        return *this;
+    }
 
-    for (size_t i=1; i<poly.size(); i++) {
-        m_out << " L " << setprecision(m_digits_frac) << (poly[i][0] + m_offset[0])
-              << " " << setprecision(m_digits_frac) << (poly[i][1] + m_offset[1]);
+    if (tok.m_contours.empty() || tok.m_contours[0].size() < 3) {
+        return *this;
     }
 
-    if (std::isnan(m_stroke_width)) {
-        m_out << " Z";
+    size_t vertices = 0;
+    for (const auto &poly : tok.m_contours) {
+        vertices += poly.size();
     }
 
-    m_out << "\"/>" << endl;
+    start_batch(vertices);
+    for (size_t i=0; i<tok.m_contours.size(); i++) {
+        if (tok.m_contours[i].size() < 3) {
+            continue;
+        }
 
+        m_batch_vertices += tok.m_contours[i].size();
+        m_batch.push_back(std::move(tok.m_contours[i]));
+        m_batch_holes.push_back(i > 0);
+    }
     return *this;
 }
 
-SimpleSVGOutput &SimpleSVGOutput::operator<<(const FlashToken &) {
+/* Make room for a polygon of the given size in the current batch, or start a new batch if the style changed. */
+void SimpleSVGOutput::start_batch(size_t vertices) {
+    bool same_style = m_batch_color == m_current_color
+        && (std::isnan(m_batch_stroke_width) ? std::isnan(m_stroke_width) : m_batch_stroke_width == m_stroke_width);
+    if (!same_style || m_batch_vertices + vertices > max_batch_vertices) {
+        flush_batch();
+        m_batch_color = m_current_color;
+        m_batch_stroke_width = m_stroke_width;
+    }
+}
+
+/* Apertures are defined once in a defs element and then placed with use elements. Their fill is inherited from the
+ * use element. */
+SimpleSVGOutput &SimpleSVGOutput::operator<<(const FlashToken &tok) {
+    if (m_current_pattern < 0 && std::isnan(m_stroke_width)) {
+        cerr << "Warning: Flash without aperture passed to SimpleSVGOutput" << endl;
+        return *this;
+    }
+
+    flush_batch();
+
+    ostringstream ss;
+    ss.precision(m_digits_frac);
+
+    string id;
+    if (m_current_pattern >= 0) {
+        id = "p" + to_string(m_current_pattern);
+
+    } else {
+        double r = m_stroke_width / 2;
+        long long int key = llround(r * pow(10, m_digits_frac));
+        auto it = m_circle_apertures.find(key);
+        if (it == m_circle_apertures.end()) {
+            it = m_circle_apertures.emplace(key, m_circle_apertures.size()).first;
+            ss << "<defs><circle id=\"c" << it->second << "\" r=\"" << r << "\"/></defs>\n";
+        }
+        id = "c" + to_string(it->second);
+    }
+
+    ss << "<use xlink:href=\"#" << id << "\" x=\"" << (tok.m_offset[0] + m_offset[0])
+        << "\" y=\"" << (tok.m_offset[1] + m_offset[1]) << "\" fill=\"" << m_current_color << "\"/>\n";
+    emit(ss.str());
+
+    return *this;
+}
+
+/* Patterns become paths in a defs element that are flashed like apertures. Like in Gerber aperture macros, pattern
+ * coordinates are y-up relative to the flash position, and clear parts of the pattern cut holes into the dark parts
+ * that came before them. */
+SimpleSVGOutput &SimpleSVGOutput::operator<<(const PatternToken &tok) {
+    flush_batch();
+
+    ClipperLib::Paths shape;
+    for (auto &pair : tok.m_polys) {
+        ClipperLib::Path path;
+        for (auto &p : pair.first) {
+            path.push_back({(ClipperLib::cInt)round(p[0] * clipper_scale), (ClipperLib::cInt)round(-p[1] * clipper_scale)});
+        }
+
+        ClipperLib::Clipper c;
+        c.AddPaths(shape, ClipperLib::ptSubject, true);
+        c.AddPath(path, ClipperLib::ptClip, true);
+        c.Execute(pair.second == GRB_POL_DARK ? ClipperLib::ctUnion : ClipperLib::ctDifference, shape,
+                ClipperLib::pftNonZero, ClipperLib::pftNonZero);
+    }
+
+    m_current_pattern = m_num_patterns++;
+    ostringstream ss;
+    ss.precision(m_digits_frac);
+    ss << "<defs><path id=\"p" << m_current_pattern << "\" fill-rule=\"evenodd\" d=\"";
+    for (size_t i=0; i<shape.size(); i++) {
+        for (size_t j=0; j<shape[i].size(); j++) {
+            ss << ((i > 0 && j == 0) ? " " : "") << (j == 0 ? "M " : " L ")
+                << (shape[i][j].X / clipper_scale) << " " << (shape[i][j].Y / clipper_scale);
+        }
+        ss << " Z";
+    }
+    ss << "\"/></defs>\n";
+    emit(ss.str());
+
     return *this;
 }
 
@@ -101,4 +293,3 @@ void SimpleSVGOutput::footer_impl() {
     //cerr << "svg: footer" << endl;
     m_out << "</svg>" << endl;
 }
-
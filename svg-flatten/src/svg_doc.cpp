@@ -245,7 +245,8 @@ void gerbolyze::SVGDocument::export_svg_group(RenderContext &ctx, const pugi::xm
             }
 
             RenderContext elem_ctx(ctx, xform2d(node.attribute("transform").value()), clip_path, match, ctx.has_seen_id());
-            double min_feature_size_px = mm_to_doc_units(ctx.settings().m_minimum_feature_size_mm);
+            /* Translate minimum feature size given in mm into px in the image's local coordinate system. */
+            double min_feature_size_px = elem_ctx.mat().phys2doc_min(ctx.settings().m_minimum_feature_size_mm);
             vec->vectorize_image(elem_ctx, node, min_feature_size_px);
             delete vec;
 
@@ -337,7 +338,7 @@ void gerbolyze::SVGDocument::export_svg_path(RenderContext &ctx, const pugi::xml
                 //double ngon_area_relative = p.size()/(2*std::numbers::pi) * sin(2*std::numbers::pi / p.size());
                 // ^- correction not necessary, we already do a very good job.
                 double diameter = sqrt(4*fabs(area)/std::numbers::pi) / clipper_scale;
-                double tolerance = mm_to_doc_units(ctx.settings().geometric_tolerance_mm);
+                double tolerance = ctx.settings().geometric_tolerance_mm;
                 diameter = round(diameter/tolerance) * tolerance;
                 ctx.sink() << ApertureToken(diameter) << FlashToken(centroid);
             }
@@ -379,24 +380,37 @@ void gerbolyze::SVGDocument::export_svg_path(RenderContext &ctx, const pugi::xml
                 fill_color = GRB_DARK;
             }
 
-            Paths f_polys;
-            /* Important for gerber spec compliance and also for reliable rendering results irrespective of board house
-             * and gerber viewer. */
-            dehole_polytree(ptree_fill, f_polys);
-
-            /* export gerber */
-            for (const auto &poly : f_polys) {
-                vector<array<double, 2>> out;
-                for (const auto &p : poly)
-                    out.push_back(std::array<double, 2>{
-                            ((double)p.X) / clipper_scale, ((double)p.Y) / clipper_scale
-                            });
+            /* Sinks that can represent holes get them as they are, and we save ourselves the deholing. */
+            if (ctx.sink().can_do_holes() && !ctx.settings().outline_mode) {
+                if (ptree_fill.ChildCount() > 0) {
+                    ctx.sink() << (fill_color == GRB_DARK ? GRB_POL_DARK : GRB_POL_CLEAR) << ApertureToken();
+                    sink_polytree(ptree_fill, ctx.sink());
+                }
 
-                /* In outline mode, manually close polys */
-                if (ctx.settings().outline_mode && !out.empty())
-                    out.push_back(out[0]);
+            } else {
+                Paths f_polys;
+                /* Important for gerber spec compliance and also for reliable rendering results irrespective of board
+                 * house and gerber viewer. */
+                dehole_polytree(ptree_fill, f_polys);
+
+                /* export gerber */
+                vector<Polygon> out_polys(f_polys.size());
+                for (size_t i=0; i<f_polys.size(); i++) {
+                    Polygon &out = out_polys[i];
+                    out.reserve(f_polys[i].size() + 1);
+                    for (const auto &p : f_polys[i])
+                        out.push_back(std::array<double, 2>{
+                                ((double)p.X) / clipper_scale, ((double)p.Y) / clipper_scale
+                                });
+
+                    /* In outline mode, manually close polys */
+                    if (ctx.settings().outline_mode && !out.empty())
+                        out.push_back(out[0]);
+                }
 
-                ctx.sink() << (fill_color == GRB_DARK ? GRB_POL_DARK : GRB_POL_CLEAR) << ApertureToken() << out;
+                if (!out_polys.empty()) {
+                    ctx.sink() << BatchToken(out_polys, fill_color == GRB_DARK ? GRB_POL_DARK : GRB_POL_CLEAR);
+                }
             }
         }
     }
@@ -565,12 +579,21 @@ void gerbolyze::SVGDocument::export_svg_path(RenderContext &ctx, const pugi::xml
             }
 
         } else {
-            Paths s_polys;
-            dehole_polytree(ptree, s_polys);
-            ctx.mat().doc2phys_clipper(s_polys);
-            /* color has already been pushed above. */
-            //cerr << "  sinking " << s_polys.size() << " paths" << endl;
-            ctx.sink() << (stroke_color == GRB_DARK ? GRB_POL_DARK : GRB_POL_CLEAR) << ApertureToken() << s_polys;
+            if (ctx.sink().can_do_holes()) {
+                for (PolyNode *nod = ptree.GetFirst(); nod; nod = nod->GetNext()) {
+                    ctx.mat().doc2phys_clipper(nod->Contour);
+                }
+                ctx.sink() << (stroke_color == GRB_DARK ? GRB_POL_DARK : GRB_POL_CLEAR) << ApertureToken();
+                sink_polytree(ptree, ctx.sink());
+
+            } else {
+                Paths s_polys;
+                dehole_polytree(ptree, s_polys);
+                ctx.mat().doc2phys_clipper(s_polys);
+                /* color has already been pushed above. */
+                //cerr << "  sinking " << s_polys.size() << " paths" << endl;
+                ctx.sink() << (stroke_color == GRB_DARK ? GRB_POL_DARK : GRB_POL_CLEAR) << ApertureToken() << s_polys;
+            }
         }
     }
 }
@@ -582,22 +605,24 @@ void gerbolyze::SVGDocument::render(const RenderSettings &rset, PolygonSink &sin
      * those later. Exporting them on the fly saves a ton of memory and is much faster.
      */
 
-    /* Scale document pixels to mm for sinks */
-    PolygonScaler scaler(sink, doc_units_to_mm(1.0));
-    RenderContext ctx(rset, scaler, sel, vb_paths);
+    /* Scale document pixels to mm for sinks. The scale is part of the root transform, so everything we emit is already
+     * in mm and we do not need another copy of every polygon just for scaling. */
+    double scale = doc_units_to_mm(1.0);
+    xform2d root_xf(scale, 0, 0, scale);
+    Paths root_clip(vb_paths);
+    root_xf.doc2phys_clipper(root_clip);
+    RenderContext ctx(rset, sink, sel, root_clip, root_xf);
 
     /* Load clip paths from defs with given bezier flattening tolerance and unit scale */
     load_clips(rset);
 
-    scaler.header({vb_x, vb_y}, {vb_w, vb_h});
+    sink.header({vb_x * scale, vb_y * scale}, {vb_w * scale, vb_h * scale});
     export_svg_group(ctx, root_elem);
-    scaler.footer();
+    sink.footer();
 }
 
 void gerbolyze::SVGDocument::render_to_list(const RenderSettings &rset, vector<pair<Polygon, GerberPolarityToken>> &out, const ElementSelector &sel) {
-    LambdaPolygonSink sink([&out](const Polygon &poly, GerberPolarityToken pol) {
-            out.emplace_back(pair<Polygon, GerberPolarityToken>{poly, pol});
-        });
+    ListPolygonSink sink(out);
     render(rset, sink, sel);
 }
 
@@ -675,10 +700,11 @@ void gerbolyze::SVGDocument::load_clips(const RenderSettings &rset) {
 gerbolyze::RenderContext::RenderContext(const RenderSettings &settings,
         PolygonSink &sink,
         const ElementSelector &sel,
-        ClipperLib::Paths &clip) :
+        ClipperLib::Paths &clip,
+        const xform2d &mat) :
     m_sink(sink),
     m_settings(settings),
-    m_mat(),
+    m_mat(mat),
     m_level(0),
     m_seen_id(false),
     m_included(false),
@@ -19,12 +19,14 @@
 #include "svg_geom.h"
 
 #include <cmath>
+#include <numbers>
 #include <string>
 #include <iostream>
 #include <sstream>
-#include <queue>
+#include <algorithm>
 #include <assert.h>
 #include "svg_import_defs.h"
+#include <gerbolyze.hpp>
 
 using namespace ClipperLib;
 using namespace std;
@@ -149,82 +151,475 @@ static void dump_clipper2svg(Path &path, string stroke) {
     cerr << " Z\"/>" << endl;
 }
 
-static void dehole_polytree_worker(PolyNode &ptree, Paths &out, queue<PolyTree> &todo) {
+/* Exact orientation test: positive if c lies to the left of the directed line a -> b. Clipper coordinates may use up
+ * to 62 bits, so the products need 128 bits. */
+static int orient(const IntPoint &a, const IntPoint &b, const IntPoint &c) {
+    __int128 v = (__int128)(b.X - a.X) * (c.Y - a.Y) - (__int128)(b.Y - a.Y) * (c.X - a.X);
+    return (v > 0) - (v < 0);
+}
+
+static bool point_in_triangle(const IntPoint &a, const IntPoint &b, const IntPoint &c, const IntPoint &p) {
+    int d1 = orient(a, b, p), d2 = orient(b, c, p), d3 = orient(c, a, p);
+    bool has_neg = d1 < 0 || d2 < 0 || d3 < 0;
+    bool has_pos = d1 > 0 || d2 > 0 || d3 > 0;
+    return !(has_neg && has_pos);
+}
+
+/* Check whether the direction from ring[i] towards p points into the filled side of the ring at vertex i. The ring
+ * must be oriented with the filled side to the left of its edges. */
+static bool locally_inside(const Path &ring, size_t i, const IntPoint &p) {
+    const IntPoint &a = ring[i];
+    const IntPoint &prev = ring[(i + ring.size() - 1) % ring.size()];
+    const IntPoint &next = ring[(i + 1) % ring.size()];
+
+    if (orient(prev, a, next) >= 0) { /* convex corner */
+        return orient(a, next, p) >= 0 && orient(a, prev, p) <= 0;
+    } else { /* reflex corner */
+        return orient(a, next, p) >= 0 || orient(a, prev, p) <= 0;
+    }
+}
+
+/* Find the ring vertex that the leftmost point h of a hole can be connected to without crossing any edge. This is the
+ * bridge search from David Eberly's "Triangulation by Ear Clipping": Cast a ray from h towards -X and find the closest
+ * edge it hits. The edge's endpoint is visible from h unless some other vertex lies inside the triangle formed by h,
+ * the hit point and that endpoint. In that case, the vertex in there at the smallest angle to the ray is visible
+ * instead. Returns ring.size() if no bridge was found, which only happens for degenerate input. */
+static size_t find_bridge(const Path &ring, const IntPoint &h) {
+    size_t n = ring.size();
+    size_t m = n;
+    double qx = -INFINITY;
+
+    for (size_t i=0; i<n; i++) {
+        const IntPoint &p = ring[i], &q = ring[(i+1) % n];
+        if (p.Y == q.Y || h.Y < min(p.Y, q.Y) || h.Y > max(p.Y, q.Y)) {
+            continue;
+        }
+
+        double x = p.X + (double)(h.Y - p.Y) * (q.X - p.X) / (double)(q.Y - p.Y);
+        if (x <= h.X && x > qx) {
+            qx = x;
+            m = (p.X < q.X) ? i : (i+1) % n;
+            if (x == h.X) {
+                return m;
+            }
+        }
+    }
+
+    if (m == n) {
+        return n;
+    }
+
+    const IntPoint mp = ring[m];
+    IntPoint hit {(cInt)round(qx), h.Y};
+    double tan_min = INFINITY;
+
+    for (size_t i=0; i<n; i++) {
+        const IntPoint &p = ring[i];
+        if (p.X >= h.X || p.X < mp.X || i == m) {
+            continue;
+        }
+
+        if (!point_in_triangle(h, hit, mp, p) || !locally_inside(ring, i, h)) {
+            continue;
+        }
+
+        double tan = fabs((double)(h.Y - p.Y)) / (double)(h.X - p.X);
+
+        if (tan < tan_min || (tan == tan_min && p.X > ring[m].X)) {
+            m = i;
+            tan_min = tan;
+        }
+    }
+
+    return m;
+}
+
+/* Signed area of a path, positive if counter-clockwise in a y-up coordinate system. */
+static double signed_area(const Path &path) {
+    double a = 0.0;
+    for (size_t i=0, j=path.size()-1; i<path.size(); j=i++) {
+        a += ((double)path[j].X * path[i].Y) - ((double)path[i].X * path[j].Y);
+    }
+    return a / 2.0;
+}
+
+/* Merge all holes of a polygon into its outline by cutting a zero-width channel from each hole to the outline. Holes
+ * are merged in order of their leftmost point, and each one is connected to the left. This way, a bridge can only ever
+ * run into the outline or into a hole that has already been merged. Returns false without outputting anything if the
+ * polygon cannot be keyholed. */
+static bool keyhole_polygon(PolyNode &nod, Paths &out) {
+    Path ring = nod.Contour;
+    bool ccw = signed_area(ring) > 0;
+    if (!ccw) {
+        reverse(ring.begin(), ring.end());
+    }
+
+    struct Hole {
+        const Path *contour;
+        size_t leftmost;
+    };
+    vector<Hole> holes;
+    holes.reserve(nod.ChildCount());
+    for (int k=0; k<nod.ChildCount(); k++) {
+        const Path &c = nod.Childs[k]->Contour;
+        if (c.size() < 3) {
+            continue;
+        }
+
+        size_t l = 0;
+        for (size_t i=1; i<c.size(); i++) {
+            if (c[i].X < c[l].X || (c[i].X == c[l].X && c[i].Y < c[l].Y)) {
+                l = i;
+            }
+        }
+        holes.push_back({&c, l});
+    }
+
+    /* Holes touching the outline or each other would need special care when picking bridges. Clipper's strictly simple
+     * mode also gets confused by the resulting outlines when they are clipped again, so leave these to split_polygon. */
+    vector<IntPoint> vertices(ring);
+    for (const Hole &hole : holes) {
+        vertices.insert(vertices.end(), hole.contour->begin(), hole.contour->end());
+    }
+    sort(vertices.begin(), vertices.end(), [](const IntPoint &a, const IntPoint &b) {
+        return a.X < b.X || (a.X == b.X && a.Y < b.Y);
+    });
+    if (adjacent_find(vertices.begin(), vertices.end()) != vertices.end()) {
+        return false;
+    }
+
+    sort(holes.begin(), holes.end(), [](const Hole &a, const Hole &b) {
+        const IntPoint &pa = (*a.contour)[a.leftmost], &pb = (*b.contour)[b.leftmost];
+        return pa.X < pb.X || (pa.X == pb.X && pa.Y < pb.Y);
+    });
+
+    for (const Hole &hole : holes) {
+        const Path &c = *hole.contour;
+        const IntPoint h = c[hole.leftmost];
+        size_t m = find_bridge(ring, h);
+        if (m == ring.size()) {
+            return false;
+        }
+
+        /* Holes run opposite to the outline so the filled side stays on the left. Splice in h, the hole, h again and
+         * the bridge vertex after the bridge vertex. */
+        bool hole_ccw = signed_area(c) > 0;
+        Path splice;
+        splice.reserve(c.size() + 2);
+        for (size_t i=0; i<=c.size(); i++) {
+            size_t idx = hole_ccw ? (hole.leftmost + c.size() - i) % c.size() : (hole.leftmost + i) % c.size();
+            splice.push_back(c[idx]);
+        }
+        splice.push_back(ring[m]);
+        ring.insert(ring.begin() + m + 1, splice.begin(), splice.end());
+    }
+
+    if (!ccw) {
+        reverse(ring.begin(), ring.end());
+    }
+    out.push_back(std::move(ring));
+    return true;
+}
+
+static void dehole_polytree_worker(PolyNode &ptree, Paths &out);
+
+/* Fallback for polygons that keyhole_polygon cannot handle. Split the polygon into two or more pieces along a cut from
+ * the top of its bounding box through its first hole, then dehole the pieces. The pieces perfectly fit each other, so
+ * there is no visual or functional difference. */
+static void split_polygon(PolyNode &nod, Paths &out) {
+    /* Do not add children's children, those were handled by the caller */
+    Clipper c;
+    c.AddPath(nod.Contour, ptSubject, /* closed= */ true);
+    for (int k=0; k<nod.ChildCount(); k++) {
+        c.AddPath(nod.Childs[k]->Contour, ptSubject, /* closed= */ true);
+    }
+
+    /* Find a viable cut: Cut from top-left bounding box corner, through two subsequent points on the hole outline and
+     * to top-right bbox corner. */
+    IntRect bbox = c.GetBounds();
+
+    /* Clipper might return a polygon with a zero-length, or an exactly vertical outline segment. We iterate until we
+     * find a point that has a different X coordinate than our starting point. If we can't find one because the polygon
+     * only consists of points on a vertical line, we can safely discard it and do nothing since it has zero area
+     * anyway. */
+    const Path &hole = nod.Childs[0]->Contour;
+    for (size_t i=1; i<hole.size(); i++) {
+        if (hole[i].X == hole[i-1].X) {
+            continue;
+        }
+
+        /* We now have found that hole[i-1] - hole[i] has a non-zero horizontal component, and is a candidate for our
+         * cut. However, we have to make sure that the first point is left (lower X coordinate) of the second point, or
+         * the cutting polygon we create here would have a self-intersection, which with high likelihood would lead to
+         * a new hole being created when cutting. */
+        size_t a=i-1, b=i;
+        if (hole[i].X < hole[i-1].X) {
+            swap(a, b);
+        }
+        Path tri = { { bbox.left, bbox.top }, hole[a], hole[b], { bbox.right, bbox.top } };
+        c.AddPath(tri, ptClip, true);
+
+        /* Execute twice, once for intersection fragment and once for difference fragment. Note that this will yield
+         * at least two, but possibly more polygons. */
+        c.StrictlySimple(true);
+        PolyTree diff, isect;
+        c.Execute(ctDifference, diff, pftNonZero);
+        c.Execute(ctIntersection, isect, pftNonZero);
+        dehole_polytree_worker(diff, out);
+        dehole_polytree_worker(isect, out);
+        break;
+    }
+}
+
+static void dehole_polytree_worker(PolyNode &ptree, Paths &out) {
     for (int i=0; i<ptree.ChildCount(); i++) {
         PolyNode *nod = ptree.Childs[i];
         assert(nod);
         assert(!nod->IsHole());
 
-        /* First, recursively process inner polygons. */
+        /* Islands inside of holes are separate polygons, handle those first. */
         for (int j=0; j<nod->ChildCount(); j++) {
             PolyNode *child = nod->Childs[j];
             assert(child);
             assert(child->IsHole());
 
             if (child->ChildCount() > 0) {
-                dehole_polytree_worker(*child, out, todo);
+                dehole_polytree_worker(*child, out);
             }
         }
 
         if (nod->ChildCount() == 0) {
             out.push_back(nod->Contour);
+        } else if (!keyhole_polygon(*nod, out)) {
+            split_polygon(*nod, out);
+        }
+    }
+}
+
+/* Take a Clipper polytree, i.e. a description of a set of polygons, their holes and their inner polygons, and remove
+ * all holes from it. We remove holes by connecting each hole to the polygon's outline with a zero-width cut, so every
+ * polygon with holes turns into a single outline that touches itself along the cuts. Gerber calls these "cut-ins".
+ * There is no visual or functional difference to the polygon with holes. Polygons whose holes touch the outline or each
+ * other are instead split into several pieces that fit each other.
+ */
+void gerbolyze::dehole_polytree(PolyTree &ptree, Paths &out) {
+    dehole_polytree_worker(ptree, out);
+}
+
+/* Turn a polygon into what Clipper would output for it under the nonzero rule, without clipping it. Strictly convex
+ * polygons, like most polygons coming out of the vectorizers, are already simple and only need to be brought into
+ * Clipper's orientation. Anything else goes through Clipper to remove self-intersections and zero-area parts. The
+ * given path is moved from. */
+void gerbolyze::simplify_polygon(Path &path, Paths &out) {
+    size_t n = path.size();
+    int sign = 0;
+    bool convex = n >= 3;
+    for (size_t i=0; convex && i<n; i++) {
+        int o = orient(path[i], path[(i+1) % n], path[(i+2) % n]);
+        if (o == 0 || (sign != 0 && o != sign)) {
+            convex = false;
+        }
+        sign = o;
+    }
+
+    /* A star polygon turns the same way at every vertex, but winds around more than once. */
+    if (convex) {
+        double turn = 0.0;
+        for (size_t i=0; i<n; i++) {
+            const IntPoint &a = path[i], &b = path[(i+1) % n], &c = path[(i+2) % n];
+            turn += atan2((double)(b.X - a.X) * (c.Y - b.Y) - (double)(b.Y - a.Y) * (c.X - b.X),
+                    (double)(b.X - a.X) * (c.X - b.X) + (double)(b.Y - a.Y) * (c.Y - b.Y));
+        }
+        convex = fabs(turn) < 3 * std::numbers::pi;
+    }
+
+    if (!convex) {
+        SimplifyPolygon(path, out, pftNonZero);
+        return;
+    }
+
+    if (!Orientation(path))
+        ReversePath(path);
+    out.push_back(std::move(path));
+}
+
+static gerbolyze::Polygon clipper_to_polygon(const Path &path) {
+    gerbolyze::Polygon out;
+    out.reserve(path.size());
+    for (const auto &p : path) {
+        out.push_back({((double)p.X) / clipper_scale, ((double)p.Y) / clipper_scale});
+    }
+    return out;
+}
 
+static void sink_polytree_worker(PolyNode &ptree, gerbolyze::PolygonSink &sink, vector<gerbolyze::Polygon> &contours) {
+    for (int i=0; i<ptree.ChildCount(); i++) {
+        PolyNode *nod = ptree.Childs[i];
+
+        contours.clear();
+        contours.push_back(clipper_to_polygon(nod->Contour));
+        for (int j=0; j<nod->ChildCount(); j++) {
+            contours.push_back(clipper_to_polygon(nod->Childs[j]->Contour));
+        }
+
+        if (contours.size() == 1) {
+            sink << std::move(contours[0]);
         } else {
-            /* Do not add children's children, those were handled in the recursive call above */
-            Clipper c;
-            c.AddPath(nod->Contour, ptSubject, /* closed= */ true);
-            for (int k=0; k<nod->ChildCount(); k++) {
-                c.AddPath(nod->Childs[k]->Contour, ptSubject, /* closed= */ true);
+            sink << gerbolyze::PolygonWithHolesToken(contours);
+        }
+
+        /* Islands inside of holes go after the polygon they are in, since a sink may draw holes by clearing them. */
+        for (int j=0; j<nod->ChildCount(); j++) {
+            if (nod->Childs[j]->ChildCount() > 0) {
+                sink_polytree_worker(*nod->Childs[j], sink, contours);
             }
+        }
+    }
+}
 
-            /* Find a viable cut: Cut from top-left bounding box corner, through two subsequent points on the hole
-             * outline and to top-right bbox corner. */
-            IntRect bbox = c.GetBounds();
+/* Pass the polygons of a polytree with coordinates in mm on to a sink. Sinks that can do holes get each polygon along
+ * with its holes, all others get polygons with their holes removed by dehole_polytree. Polarity and aperture have to be
+ * set before. */
+void gerbolyze::sink_polytree(PolyTree &ptree, PolygonSink &sink) {
+    if (sink.can_do_holes()) {
+        vector<Polygon> contours;
+        sink_polytree_worker(ptree, sink, contours);
+        return;
+    }
 
-            /* Clipper might return a polygon with a zero-length, or an exactly vertical outline segment. We iterate
-             * until we find a point that has a different X coordinate than our starting point. If we can't find one
-             * because the polygon only consists only of points on a vertical line, we can safely discard it and do
-             * nothing since it has zero area anyway. */
-            for (size_t i=1; i<nod->Childs[0]->Contour.size(); i++) {
-                if (nod->Childs[0]->Contour[i].X == nod->Childs[0]->Contour[i-1].X) {
-                    continue;
+    Paths out;
+    dehole_polytree(ptree, out);
+    for (const auto &path : out) {
+        sink << clipper_to_polygon(path);
+    }
+}
+
+
+gerbolyze::ClipMask::ClipMask(const Paths &clip, int resolution) : m_empty(clip.empty()) {
+    m_bounds = get_paths_bounds(clip);
+    if (m_empty || m_bounds.right <= m_bounds.left || m_bounds.bottom <= m_bounds.top) {
+        m_cols = m_rows = 0;
+        m_cell_w = m_cell_h = 1.0;
+        return;
+    }
+
+    /* Keep grid cells roughly square */
+    double w = m_bounds.right - m_bounds.left, h = m_bounds.bottom - m_bounds.top;
+    double cell_size = max(w, h) / resolution;
+    m_cols = clamp((int)ceil(w / cell_size), 1, resolution);
+    m_rows = clamp((int)ceil(h / cell_size), 1, resolution);
+    m_cell_w = w / m_cols;
+    m_cell_h = h / m_rows;
+    m_cells.resize((size_t)m_cols * m_rows, OUTSIDE);
+
+    /* Mark every cell touched by a clip path edge as boundary. We walk each edge column by column and mark the span of
+     * rows it covers in that column. Ranges are padded a little bit so that edges running exactly along a cell border
+     * mark the cells on both sides. */
+    constexpr double eps = 1e-6;
+    for (const Path &path : clip) {
+        for (size_t i=0; i<path.size(); i++) {
+            const IntPoint &a = path[i], &b = path[(i+1) % path.size()];
+            double ax = (a.X - m_bounds.left) / m_cell_w, ay = (a.Y - m_bounds.top) / m_cell_h;
+            double bx = (b.X - m_bounds.left) / m_cell_w, by = (b.Y - m_bounds.top) / m_cell_h;
+            if (bx < ax) {
+                swap(ax, bx);
+                swap(ay, by);
+            }
+
+            int c0 = clamp((int)floor(ax - eps), 0, m_cols-1), c1 = clamp((int)floor(bx + eps), 0, m_cols-1);
+            for (int c=c0; c<=c1; c++) {
+                double y0 = ay, y1 = by;
+                if (bx - ax > eps) {
+                    double slope = (by - ay) / (bx - ax);
+                    y0 = ay + (clamp((double)c, ax, bx) - ax) * slope;
+                    y1 = ay + (clamp((double)c+1, ax, bx) - ax) * slope;
                 }
+                if (y1 < y0)
+                    swap(y0, y1);
 
-                /* We now have found that Contour[i-1] - Contour[i] has a non-zero horizontal component, and is a
-                 * candidate for our cut. However, we have to make sure that the first point is left (lower X
-                 * coordinate) of the second point, or the cutting polygon we create here would have a
-                 * self-intersection, which with high likelihood would lead to a new hole being created when cutting.
-                 */
-                int a=i-1, b=i;
-                if (nod->Childs[0]->Contour[i].X < nod->Childs[0]->Contour[i-1].X) {
-                    /* Swap points */
-                    a = i;
-                    b = i-1;
+                int r0 = clamp((int)floor(y0 - eps), 0, m_rows-1), r1 = clamp((int)floor(y1 + eps), 0, m_rows-1);
+                for (int r=r0; r<=r1; r++) {
+                    m_cells[cell_index(c, r)] = BOUNDARY;
                 }
-                Path tri = { { bbox.left, bbox.top }, nod->Childs[0]->Contour[a], nod->Childs[0]->Contour[b], { bbox.right, bbox.top } };
-                c.AddPath(tri, ptClip, true);
-
-                /* Execute twice, once for intersection fragment and once for difference fragment. Note that this will yield
-                 * at least two, but possibly more polygons. */
-                c.StrictlySimple(true);
-                c.Execute(ctDifference, todo.emplace(), pftNonZero);
-                c.Execute(ctIntersection, todo.emplace(), pftNonZero);
-                break;
             }
         }
     }
+
+    /* Classify remaining cells with a nonzero winding scanline through each row's cell centers. No edge passes through
+     * these cells, so their center's location is that of the whole cell. */
+    vector<pair<double, int>> crossings;
+    for (int r=0; r<m_rows; r++) {
+        double y = m_bounds.top + (r + 0.5) * m_cell_h;
+
+        crossings.clear();
+        for (const Path &path : clip) {
+            for (size_t i=0; i<path.size(); i++) {
+                const IntPoint &a = path[i], &b = path[(i+1) % path.size()];
+                if ((a.Y <= y) == (b.Y <= y))
+                    continue;
+
+                double x = a.X + (y - a.Y) / (double)(b.Y - a.Y) * (b.X - a.X);
+                crossings.push_back({x, (b.Y > a.Y) ? 1 : -1});
+            }
+        }
+        sort(crossings.begin(), crossings.end());
+
+        int winding = 0;
+        size_t k = 0;
+        for (int c=0; c<m_cols; c++) {
+            double x = m_bounds.left + (c + 0.5) * m_cell_w;
+            while (k < crossings.size() && crossings[k].first < x) {
+                winding += crossings[k].second;
+                k++;
+            }
+
+            uint8_t &cell = m_cells[cell_index(c, r)];
+            if (cell != BOUNDARY && winding != 0)
+                cell = INSIDE;
+        }
+    }
 }
 
-/* Take a Clipper polytree, i.e. a description of a set of polygons, their holes and their inner polygons, and remove
- * all holes from it. We remove holes by splitting each polygon that has a hole into two or more pieces so that the hole
- * is no more. These pieces perfectly fit each other so there is no visual or functional difference.
- */
-void gerbolyze::dehole_polytree(PolyTree &ptree, Paths &out) {
-    queue<PolyTree> todo;
-    dehole_polytree_worker(ptree, out, todo);
-    while (!todo.empty()) {
-        dehole_polytree_worker(todo.front(), out, todo);
-        todo.pop();
+gerbolyze::ClipMask::Location gerbolyze::ClipMask::classify(const Path &path) const {
+    if (path.empty())
+        return m_empty ? INSIDE : OUTSIDE;
+
+    IntRect bb = {path[0].X, path[0].Y, path[0].X, path[0].Y};
+    for (const IntPoint &p : path) {
+        bb.left = min(bb.left, p.X);
+        bb.top = min(bb.top, p.Y);
+        bb.right = max(bb.right, p.X);
+        bb.bottom = max(bb.bottom, p.Y);
     }
+    return classify(bb);
 }
 
+gerbolyze::ClipMask::Location gerbolyze::ClipMask::classify(const IntRect &bb) const {
+    if (m_empty)
+        return INSIDE;
+
+    if (m_cells.empty())
+        return OUTSIDE;
+
+    if (bb.right < m_bounds.left || bb.left > m_bounds.right || bb.bottom < m_bounds.top || bb.top > m_bounds.bottom)
+        return OUTSIDE;
+
+    if (bb.left < m_bounds.left || bb.right > m_bounds.right || bb.top < m_bounds.top || bb.bottom > m_bounds.bottom)
+        return BOUNDARY;
+
+    int c0 = clamp((int)floor((bb.left - m_bounds.left) / m_cell_w), 0, m_cols-1);
+    int c1 = clamp((int)floor((bb.right - m_bounds.left) / m_cell_w), 0, m_cols-1);
+    int r0 = clamp((int)floor((bb.top - m_bounds.top) / m_cell_h), 0, m_rows-1);
+    int r1 = clamp((int)floor((bb.bottom - m_bounds.top) / m_cell_h), 0, m_rows-1);
+
+    uint8_t first = m_cells[cell_index(c0, r0)];
+    for (int r=r0; r<=r1; r++) {
+        for (int c=c0; c<=c1; c++) {
+            uint8_t cell = m_cells[cell_index(c, r)];
+            if (cell == BOUNDARY || cell != first)
+                return BOUNDARY;
+        }
+    }
+
+    return (Location)first;
+}
@@ -18,17 +18,50 @@
 
 #pragma once
 
+#include <vector>
+#include <cstdint>
 #include <clipper.hpp>
 #include <pugixml.hpp>
 
 namespace gerbolyze {
 
+    class PolygonSink;
+
     ClipperLib::IntRect get_paths_bounds(const ClipperLib::Paths &paths);
     enum ClipperLib::PolyFillType clipper_fill_rule(const pugi::xml_node &node);
     enum ClipperLib::EndType clipper_end_type(const pugi::xml_node &node);
     enum ClipperLib::JoinType clipper_join_type(const pugi::xml_node &node);
     void dehole_polytree(ClipperLib::PolyTree &ptree, ClipperLib::Paths &out);
+    void sink_polytree(ClipperLib::PolyTree &ptree, PolygonSink &sink);
     void combine_clip_paths(ClipperLib::Paths &in_a, ClipperLib::Paths &in_b, ClipperLib::Paths &out);
+    void simplify_polygon(ClipperLib::Path &path, ClipperLib::Paths &out);
+
+    /* Coarse raster of a clip path for quickly classifying small polygons as lying entirely inside or outside of the
+     * clip path, so only those crossing its boundary need to go through Clipper. Grid cells are marked as boundary if
+     * any clip path edge touches them. The remaining cells are either fully inside or fully outside, which is decided
+     * using the nonzero fill rule. An empty clip path is treated as "no clipping", i.e. everything is inside. */
+    class ClipMask {
+    public:
+        enum Location {
+            OUTSIDE,
+            INSIDE,
+            BOUNDARY
+        };
+
+        ClipMask(const ClipperLib::Paths &clip, int resolution=256);
+        Location classify(const ClipperLib::IntRect &bbox) const;
+        Location classify(const ClipperLib::Path &path) const;
+        Location classify(const ClipperLib::Paths &paths) const { return classify(get_paths_bounds(paths)); }
+
+    private:
+        size_t cell_index(int x, int y) const { return (size_t)y * m_cols + x; }
+
+        bool m_empty;
+        ClipperLib::IntRect m_bounds;
+        int m_cols, m_rows;
+        double m_cell_w, m_cell_h;
+        std::vector<uint8_t> m_cells;
+    };
 
 } /* namespace gerbolyze */
 
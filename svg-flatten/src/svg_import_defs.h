@@ -38,7 +38,7 @@ constexpr T ipow(T num, unsigned int pow)
 constexpr int CAIRO_PRECISION = 7;
 constexpr double clipper_scale = ipow(10.0, CAIRO_PRECISION);
 
-#define JC_VORONOI_IMPLEMENTATION
+/* JC_VORONOI_IMPLEMENTATION is defined in vec_core.cpp only */
 #define JCV_REAL_TYPE double
 #define JCV_ATAN2 atan2
 #define JCV_SQRT sqrt
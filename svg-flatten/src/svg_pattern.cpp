@@ -56,10 +56,10 @@ gerbolyze::Pattern::Pattern(const pugi::xml_node &node, SVGDocument &doc) : m_no
 void gerbolyze::Pattern::tile (gerbolyze::RenderContext &ctx) {
     assert(doc);
 
-    /* Transform x, y, w, h from pattern coordinate space into parent coordinates by applying the inverse
-     * patternTransform. This is necessary so we iterate over the correct bounds when tiling below */
-    d2p pos_xf = ctx.mat().doc2phys(d2p{x, y});
-    double inst_x = pos_xf[0], inst_y = pos_xf[1];
+    /* Transform the clip bounds from physical coordinates into pattern coordinates by applying the inverse of the
+     * parent transform and the patternTransform. This is necessary so we iterate over the correct bounds when tiling
+     * below */
+    double inst_x = x, inst_y = y;
     double inst_w = w;
     double inst_h = h;
 
@@ -69,10 +69,12 @@ void gerbolyze::Pattern::tile (gerbolyze::RenderContext &ctx) {
     double bw = (clip_bounds.right - clip_bounds.left) / clipper_scale;
     double bh = (clip_bounds.bottom - clip_bounds.top) / clipper_scale;
 
-    d2p clip_p0 = patternTransform_inv.doc2phys(d2p{bx, by});
-    d2p clip_p1 = patternTransform_inv.doc2phys(d2p{bx+bw, by});
-    d2p clip_p2 = patternTransform_inv.doc2phys(d2p{bx+bw, by+bh});
-    d2p clip_p3 = patternTransform_inv.doc2phys(d2p{bx, by+bh});
+    xform2d phys2pattern(ctx.mat());
+    phys2pattern.transform(patternTransform).invert();
+    d2p clip_p0 = phys2pattern.doc2phys(d2p{bx, by});
+    d2p clip_p1 = phys2pattern.doc2phys(d2p{bx+bw, by});
+    d2p clip_p2 = phys2pattern.doc2phys(d2p{bx+bw, by+bh});
+    d2p clip_p3 = phys2pattern.doc2phys(d2p{bx, by+bh});
 
     bx = fmin(fmin(clip_p0[0], clip_p1[0]), fmin(clip_p2[0], clip_p3[0]));
     by = fmin(fmin(clip_p0[1], clip_p1[1]), fmin(clip_p2[1], clip_p3[1]));
@@ -91,9 +93,7 @@ void gerbolyze::Pattern::tile (gerbolyze::RenderContext &ctx) {
 
     if (ctx.settings().use_apertures_for_patterns) {
         vector<pair<Polygon, GerberPolarityToken>> out;
-        LambdaPolygonSink list_sink([&out](const Polygon &poly, GerberPolarityToken pol) {
-                out.emplace_back(pair<Polygon, GerberPolarityToken>{poly, pol});
-            });
+        ListPolygonSink list_sink(out);
         ClipperLib::Paths empty_clip;
         RenderContext macro_ctx(pat_ctx, list_sink, empty_clip);
         doc->export_svg_group(macro_ctx, m_node);
@@ -0,0 +1,92 @@
+#!/usr/bin/env python3
+""" Benchmark svg-flatten's flattening engines on a layer with many clear cutouts.
+
+The generated input is a dark board perforated by a grid of round clear cutouts. The cutouts are split into several
+runs with a dark strip drawn between consecutive runs, so the flattener has to alternate between dark and clear
+polarity like it does on real artwork.
+
+Run from the svg-flatten directory after building, e.g.:
+
+    python3 src/test/flatten_benchmark.py --cutouts 10000 --runs 10
+"""
+
+import argparse
+import math
+import os
+import subprocess
+import sys
+import tempfile
+import time
+from pathlib import Path
+
+from svg_tests import svg_flatten_command
+
+def generate_svg(cutouts, runs, size=200.0, vertices=32):
+    n = math.ceil(math.sqrt(cutouts))
+    pitch = size / (n + 1)
+    r = pitch / 3
+
+    def circle(cx, cy):
+        pts = ' '.join(f'{cx + r*math.cos(2*math.pi*i/vertices):.4f},{cy + r*math.sin(2*math.pi*i/vertices):.4f}'
+                       for i in range(vertices))
+        return f'<polygon fill="#ffffff" points="{pts}"/>'
+
+    out = [f'<svg width="{size}mm" height="{size}mm" viewBox="0 0 {size} {size}" xmlns="http://www.w3.org/2000/svg">',
+           f'<rect x="0" y="0" width="{size}" height="{size}" fill="#000000"/>']
+
+    per_run = math.ceil(cutouts / runs)
+    for i in range(cutouts):
+        if i > 0 and i % per_run == 0:
+            # Dark strip across the board, partially covering the cutouts drawn so far
+            y = (i // n + 0.5) * pitch
+            out.append(f'<rect x="0" y="{y:.4f}" width="{size}" height="{pitch/2:.4f}" fill="#000000"/>')
+        out.append(circle((i % n + 1) * pitch, (i // n + 1) * pitch))
+
+    out.append('</svg>')
+    return '\n'.join(out)
+
+def run_measured(args):
+    """ Run a command, and return its wall clock time in seconds and its peak RSS in bytes. """
+    start = time.perf_counter()
+    proc = subprocess.Popen(args, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    # wait4 gives us the resource usage of just this child, unlike getrusage(RUSAGE_CHILDREN).
+    _pid, status, rusage = os.wait4(proc.pid, 0)
+    elapsed = time.perf_counter() - start
+    proc.returncode = os.waitstatus_to_exitcode(status)
+    stderr = proc.stderr.read().decode(errors='replace')
+    proc.stderr.close()
+    if proc.returncode != 0:
+        print(stderr, file=sys.stderr)
+        raise subprocess.CalledProcessError(proc.returncode, args)
+    # ru_maxrss is in kilobytes on Linux, but in bytes on macOS.
+    return elapsed, rusage.ru_maxrss * (1 if sys.platform == 'darwin' else 1024)
+
+def benchmark(engines, cutouts, runs, repeat, tile_size):
+    with tempfile.NamedTemporaryFile(suffix='.svg') as tmp_in_svg:
+        tmp_in_svg.write(generate_svg(cutouts, runs).encode())
+        tmp_in_svg.flush()
+
+        print(f'{cutouts} cutouts in {runs} runs, best of {repeat}:')
+        for engine in engines:
+            times, peaks = [], []
+            for _ in range(repeat):
+                with tempfile.NamedTemporaryFile(suffix='.gbr') as tmp_out:
+                    elapsed, peak = run_measured(svg_flatten_command(tmp_in_svg.name, tmp_out.name, format='gerber',
+                            no_usvg=True, flatten=True, flatten_engine=engine, flatten_tile_size=str(tile_size)))
+                    times.append(elapsed)
+                    peaks.append(peak)
+                    out_size = Path(tmp_out.name).stat().st_size
+
+            print(f'  {engine:>14}: {min(times):8.3f} s, {min(peaks)/1e6:8.1f} MB peak RSS, {out_size/1e6:8.2f} MB output')
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--engines', default='polygon,batch,parallel-batch', help='Comma-separated list of engines to compare')
+    parser.add_argument('--cutouts', type=int, nargs='+', default=[1000, 5000, 20000], help='Number of clear cutouts')
+    parser.add_argument('--runs', type=int, default=10, help='Number of clear runs the cutouts are split into')
+    parser.add_argument('--repeat', type=int, default=3, help='Number of times each engine is run')
+    parser.add_argument('--tile-size', type=float, default=10.0, help='Tile size for the parallel-batch engine in mm')
+    args = parser.parse_args()
+
+    for cutouts in args.cutouts:
+        benchmark(args.engines.split(','), cutouts, args.runs, args.repeat, args.tile_size)
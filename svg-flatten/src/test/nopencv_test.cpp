@@ -1,13 +1,20 @@
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <iomanip>
 #include <cmath>
 #include <filesystem>
+#include <algorithm>
+#include <random>
+#include <set>
 
 #include "util.h"
 #include "nopencv.hpp"
 #include "geom2d.hpp"
+#include "vec_grid.h"
+#include "svg_geom.h"
+#include <gerbolyze.hpp>
 
 #include <subprocess.h>
 #include <minunit.h>
@@ -358,6 +365,931 @@ MU_TEST(test_transform_decomposition) {
     }
 }
 
+/* Check phys2doc_clipper against a path transformed through a freshly inverted copy of the given transform */
+static void check_phys2doc(xform2d xf, const ClipperLib::Path &path) {
+    xform2d inv(xf);
+    bool inverted = false;
+    inv.invert(&inverted);
+    mu_assert(inverted, "test transform is not invertible");
+
+    ClipperLib::Path expected(path), actual(path);
+    inv.doc2phys_clipper(expected);
+    xf.phys2doc_clipper(actual);
+    mu_assert(actual == expected, "phys2doc_clipper does not match inverted transform");
+}
+
+MU_TEST(test_xform_inverse_cache) {
+    ClipperLib::Path path;
+    for (int i=0; i<37; i++) {
+        path.push_back({(ClipperLib::cInt)(i * 12345678 - 200000000), (ClipperLib::cInt)(i * i * 987654 + 3)});
+    }
+
+    xform2d xf;
+    xf.rotate(0.3).scale(2.0, -0.5).translate(1.5, -7.0);
+    check_phys2doc(xf, path);
+
+    /* Prime the cache, then modify the transform through each mutator */
+    ClipperLib::Path tmp(path);
+    xf.phys2doc_clipper(tmp);
+    xf.translate(3.0, 4.0);
+    check_phys2doc(xf, path);
+
+    xf.phys2doc_clipper(tmp);
+    xf.transform(xform2d(0.5, 1.0, -2.0, 3.0, 10.0, 20.0));
+    check_phys2doc(xf, path);
+
+    xf.phys2doc_clipper(tmp);
+    xform2d copy(xf);
+    xf.invert();
+    check_phys2doc(xf, path);
+    /* A copy made with the cache primed keeps a valid inverse */
+    check_phys2doc(copy, path);
+
+    /* Round trip through a cached transform */
+    tmp = path;
+    xf.doc2phys_clipper(tmp);
+    xf.phys2doc_clipper(tmp);
+    for (size_t i=0; i<path.size(); i++) {
+        mu_assert(std::abs(tmp[i].X - path[i].X) <= 1 && std::abs(tmp[i].Y - path[i].Y) <= 1, "round trip mismatch");
+    }
+
+    /* Becoming singular after caching must clear paths */
+    xf.phys2doc_clipper(tmp);
+    xf.scale(0.0, 1.0);
+    tmp = path;
+    xf.phys2doc_clipper(tmp);
+    mu_assert(tmp.empty(), "singular transform did not clear path");
+}
+
+MU_TEST(test_poisson_disc_reproducible) {
+    vector<jcv_point> a, b, c;
+    sample_poisson_disc(a, 100.0, 70.0, 2.5, 23);
+    sample_poisson_disc(b, 100.0, 70.0, 2.5, 23);
+    sample_poisson_disc(c, 100.0, 70.0, 2.5, 42);
+
+    mu_assert(a.size() > 1000, "Too few points sampled");
+    mu_assert(a.size() == b.size(), "Sampling with the same seed returned different numbers of points");
+    for (size_t i=0; i<a.size(); i++) {
+        mu_assert(a[i].x == b[i].x && a[i].y == b[i].y, "Sampling with the same seed returned different points");
+    }
+
+    bool differs = a.size() != c.size();
+    for (size_t i=0; !differs && i<a.size(); i++) {
+        differs = a[i].x != c[i].x || a[i].y != c[i].y;
+    }
+    mu_assert(differs, "Sampling with different seeds returned identical points");
+}
+
+MU_TEST(test_poisson_disc_min_distance) {
+    vector<jcv_point> pts;
+    double w = 60.0, h = 50.0, center_distance = 2.5;
+    sample_poisson_disc(pts, w, h, center_distance, 0);
+    double min_dist = center_distance / 2.5;
+
+    for (size_t i=0; i<pts.size(); i++) {
+        mu_assert(pts[i].x >= 0 && pts[i].x < w && pts[i].y >= 0 && pts[i].y < h, "Point outside of sampling area");
+        for (size_t j=i+1; j<pts.size(); j++) {
+            double dx = pts[i].x - pts[j].x, dy = pts[i].y - pts[j].y;
+            if (dx*dx + dy*dy < min_dist*min_dist) {
+                snprintf(msg, sizeof(msg), "Points %zu and %zu are too close: %f < %f", i, j, sqrt(dx*dx + dy*dy), min_dist);
+                mu_fail(msg);
+            }
+        }
+    }
+}
+
+static void check_min_distance(const vector<jcv_point> &pts, double w, double h, double min_dist) {
+    for (size_t i=0; i<pts.size(); i++) {
+        mu_assert(pts[i].x >= 0 && pts[i].x < w && pts[i].y >= 0 && pts[i].y < h, "Point outside of sampling area");
+        for (size_t j=i+1; j<pts.size(); j++) {
+            double dx = pts[i].x - pts[j].x, dy = pts[i].y - pts[j].y;
+            if (dx*dx + dy*dy < min_dist*min_dist) {
+                snprintf(msg, sizeof(msg), "Points %zu and %zu are too close: %f < %f", i, j, sqrt(dx*dx + dy*dy), min_dist);
+                mu_fail(msg);
+            }
+        }
+    }
+}
+
+MU_TEST(test_poisson_disc_mask) {
+    double w = 60.0, h = 50.0, center_distance = 2.5;
+    SamplingMask mask;
+    mask.cell_size = 10.0;
+    mask.cols = 6;
+    mask.rows = 5;
+    mask.cells.resize(mask.cols * mask.rows, 0);
+    /* Left half, and a single cell on the right */
+    for (int y=0; y<mask.rows; y++)
+        for (int x=0; x<3; x++)
+            mask.cells[y*mask.cols + x] = 1;
+    mask.cells[2*mask.cols + 4] = 1;
+
+    vector<jcv_point> full, masked;
+    sample_poisson_disc(full, w, h, center_distance, 0);
+    sample_poisson_disc(masked, w, h, center_distance, 0, &mask);
+
+    for (auto &p : masked) {
+        mu_assert(mask.contains(p.x, p.y), "Point outside of mask");
+    }
+    check_min_distance(masked, w, h, center_distance / 2.5);
+
+    /* 16 of 30 cells are set */
+    double expected = full.size() * 16.0 / 30.0;
+    mu_assert(masked.size() > 0.9 * expected && masked.size() < 1.1 * expected, "Masked sampler returned unexpected number of points");
+}
+
+MU_TEST(test_adaptive_sampling) {
+    /* Size is no multiple of the quadtree's leaf size, so there are leaves cut off by the image border. */
+    double w = 37.3, h = 29.1, center_distance = 1.0;
+    Image32f img(373, 291);
+    mt19937 rng(0);
+    uniform_real_distribution<float> noise(0.0f, 255.0f);
+    for (int y=0; y<img.rows(); y++) {
+        for (int x=0; x<img.cols(); x++) {
+            /* Noisy band in the middle, flat black left of it and flat white right of it */
+            if (x > 120 && x < 180) {
+                img.at(x, y) = noise(rng);
+            } else {
+                img.at(x, y) = x < 150 ? 0.0f : 255.0f;
+            }
+        }
+    }
+
+    for (auto type : {POISSON_DISC, HEXGRID, SQUAREGRID}) {
+        vector<jcv_point> dense, pts;
+        vector<double> cell_sizes;
+        get_sampler(type)(dense, w, h, center_distance, 0, nullptr);
+        sample_adaptive(img, w, h, center_distance, get_sampler(type), 0, pts, cell_sizes);
+
+        mu_assert_int_eq((int)pts.size(), (int)cell_sizes.size());
+        mu_assert(pts.size() < dense.size() / 2, "Adaptive sampling did not reduce the number of points");
+        for (double size : cell_sizes) {
+            mu_assert(size >= center_distance, "Adaptive cell is smaller than a regular cell");
+        }
+
+        if (type == POISSON_DISC) {
+            check_min_distance(pts, w, h, center_distance / 2.5);
+        }
+    }
+}
+
+static double xor_area(const ClipperLib::Paths &a, const ClipperLib::Paths &b) {
+    ClipperLib::Clipper c;
+    c.AddPaths(a, ClipperLib::ptSubject, /* closed */ true);
+    c.AddPaths(b, ClipperLib::ptClip, /* closed */ true);
+    ClipperLib::Paths out;
+    c.Execute(ClipperLib::ctXor, out, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
+
+    double area = 0.0;
+    for (auto &p : out) {
+        area += ClipperLib::Area(p);
+    }
+    return fabs(area);
+}
+
+MU_TEST(test_simplify_polygon_matches_clipping) {
+    using ClipperLib::Path;
+    using ClipperLib::Paths;
+    vector<Path> cases {
+        /* Convex, in both orientations */
+        {{0, 0}, {1000, 0}, {1000, 1000}, {0, 1000}},
+        {{0, 0}, {0, 1000}, {1000, 1000}, {1000, 0}},
+        /* Bow tie */
+        {{0, 0}, {1000, 1000}, {1000, 0}, {0, 1000}},
+        /* Pentagram, convex at every vertex but winding around twice */
+        {{500, 0}, {794, 905}, {24, 345}, {976, 345}, {206, 905}},
+        /* Zero area, and collinear points */
+        {{0, 0}, {1000, 0}, {500, 0}},
+        {{0, 0}, {500, 0}, {1000, 0}, {1000, 1000}, {0, 1000}},
+        /* Duplicate point */
+        {{0, 0}, {1000, 0}, {1000, 0}, {1000, 1000}},
+    };
+
+    mt19937 rng(0);
+    uniform_real_distribution<double> angle(0, 2*M_PI);
+    uniform_real_distribution<double> radius(100, 1000);
+    uniform_int_distribution<int> coord(-1000, 1000);
+    for (int i=0; i<200; i++) {
+        /* Star shaped around the origin, and random junk */
+        vector<double> angles(3 + i%10);
+        for (auto &a : angles) {
+            a = angle(rng);
+        }
+        sort(angles.begin(), angles.end());
+        Path star, junk;
+        for (double a : angles) {
+            double r = (i%3 == 0) ? 1000 : radius(rng);
+            star.push_back({(ClipperLib::cInt)round(r * cos(a)), (ClipperLib::cInt)round(r * sin(a))});
+            junk.push_back({coord(rng), coord(rng)});
+        }
+        cases.push_back(star);
+        cases.push_back(junk);
+    }
+
+    /* A clip path that everything lies inside of, so clipping only cleans up the polygon */
+    Path clip {{-10000, -10000}, {10000, -10000}, {10000, 10000}, {-10000, 10000}};
+
+    for (size_t i=0; i<cases.size(); i++) {
+        Paths clipped;
+        ClipperLib::Clipper c;
+        c.AddPath(cases[i], ClipperLib::ptSubject, /* closed */ true);
+        c.AddPath(clip, ClipperLib::ptClip, /* closed */ true);
+        c.StrictlySimple(true);
+        c.Execute(ClipperLib::ctIntersection, clipped, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
+
+        Path path = cases[i];
+        Paths simplified;
+        simplify_polygon(path, simplified);
+
+        snprintf(msg, sizeof(msg), "Case %zu: Simplified polygon differs from clipped polygon", i);
+        mu_assert(xor_area(clipped, simplified) == 0.0, msg);
+
+        /* Output is exported polygon by polygon, so the individual polygons must match as well */
+        vector<double> areas_clipped, areas_simplified;
+        for (auto &p : clipped) {
+            areas_clipped.push_back(ClipperLib::Area(p));
+        }
+        for (auto &p : simplified) {
+            areas_simplified.push_back(ClipperLib::Area(p));
+        }
+        sort(areas_clipped.begin(), areas_clipped.end());
+        sort(areas_simplified.begin(), areas_simplified.end());
+        snprintf(msg, sizeof(msg), "Case %zu: Simplified polygons differ from clipped polygons", i);
+        mu_assert(areas_clipped == areas_simplified, msg);
+    }
+}
+
+/* Dehole Clipper's union of the given paths and check the result against the polytree it came from. If keyholed is
+ * set, every outline must come out as a single polygon. */
+static void check_dehole(const ClipperLib::Paths &in, ClipperLib::PolyFillType fill, bool strictly_simple, bool keyholed,
+        const char *name) {
+    ClipperLib::Clipper c;
+    c.AddPaths(in, ClipperLib::ptSubject, /* closed */ true);
+    c.StrictlySimple(strictly_simple);
+    ClipperLib::PolyTree ptree;
+    c.Execute(ClipperLib::ctUnion, ptree, fill, fill);
+
+    ClipperLib::Paths ref;
+    ClipperLib::PolyTreeToPaths(ptree, ref);
+    double ref_area = 0.0;
+    for (auto &p : ref) {
+        ref_area += ClipperLib::Area(p);
+    }
+
+    size_t outlines = 0;
+    for (ClipperLib::PolyNode *nod = ptree.GetFirst(); nod; nod = nod->GetNext()) {
+        if (!nod->IsHole()) {
+            outlines++;
+        }
+    }
+
+    ClipperLib::Paths out;
+    dehole_polytree(ptree, out);
+
+    snprintf(msg, sizeof(msg), "%s: Expected %zu deholed polygons, got %zu", name, outlines, out.size());
+    mu_assert(keyholed ? out.size() == outlines : out.size() >= outlines, msg);
+
+    double out_area = 0.0;
+    for (auto &p : out) {
+        double area = ClipperLib::Area(p);
+        out_area += area;
+
+        /* Each polygon is output as its own region, so on its own it must fill exactly its signed area */
+        ClipperLib::Paths single;
+        ClipperLib::SimplifyPolygon(p, single, ClipperLib::pftNonZero);
+        double single_area = 0.0;
+        for (auto &q : single) {
+            single_area += ClipperLib::Area(q);
+        }
+        snprintf(msg, sizeof(msg), "%s: Deholed polygon has area %g, but fills %g", name, area, single_area);
+        mu_assert(area > 0 && fabs(single_area - area) <= 1e-9 * ref_area, msg);
+    }
+
+    snprintf(msg, sizeof(msg), "%s: Deholed polygons have area %g, input has %g", name, out_area, ref_area);
+    mu_assert(fabs(out_area - ref_area) <= 1e-9 * ref_area, msg);
+
+    double delta = xor_area(ref, out);
+    snprintf(msg, sizeof(msg), "%s: Deholed polygons differ from input by %g", name, delta);
+    mu_assert(delta <= 1e-9 * ref_area, msg);
+
+    /* The flattener unions deholed polygons again using Clipper's strictly simple mode, which must not lose any area */
+    ClipperLib::Clipper u;
+    u.AddPaths(out, ClipperLib::ptSubject, /* closed */ true);
+    u.StrictlySimple(true);
+    ClipperLib::Paths reunion;
+    u.Execute(ClipperLib::ctUnion, reunion, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
+    double reunion_area = 0.0;
+    for (auto &p : reunion) {
+        reunion_area += ClipperLib::Area(p);
+    }
+    snprintf(msg, sizeof(msg), "%s: Union of deholed polygons has area %g, input has %g", name, reunion_area, ref_area);
+    mu_assert(fabs(reunion_area - ref_area) <= 1e-9 * ref_area, msg);
+}
+
+static ClipperLib::Path rect_path(ClipperLib::cInt x0, ClipperLib::cInt y0, ClipperLib::cInt x1, ClipperLib::cInt y1) {
+    return {{x0, y0}, {x1, y0}, {x1, y1}, {x0, y1}};
+}
+
+MU_TEST(test_dehole_polytree) {
+    using ClipperLib::Path;
+    using ClipperLib::Paths;
+
+    for (bool strictly_simple : {false, true}) {
+        /* Holes stacked above each other all bridge to the same outline vertex, and holes in a grid bridge into holes
+         * that have already been merged. */
+        Paths shared {rect_path(0, 0, 1000, 1000)};
+        for (int k=0; k<6; k++) {
+            shared.push_back(rect_path(100, 100 + k*150, 150, 200 + k*150));
+        }
+        for (int i=0; i<4; i++) {
+            for (int j=0; j<4; j++) {
+                shared.push_back(rect_path(300 + i*170, 100 + j*220 + i*10, 400 + i*170, 200 + j*220 + i*10));
+            }
+        }
+        check_dehole(shared, ClipperLib::pftEvenOdd, strictly_simple, true, "Shared bridge vertices");
+
+        /* Holes touching the outline at one of its vertices and in the middle of one of its edges. These polygons get
+         * split instead. */
+        Paths touching;
+        ClipperLib::Clipper c;
+        c.AddPath(rect_path(0, 0, 1000, 1000), ClipperLib::ptSubject, /* closed */ true);
+        c.AddPath({{0, 0}, {300, 100}, {100, 300}}, ClipperLib::ptClip, /* closed */ true);
+        c.AddPath({{0, 500}, {200, 400}, {400, 500}, {200, 600}}, ClipperLib::ptClip, /* closed */ true);
+        c.AddPath({{600, 1000}, {700, 800}, {800, 1000}, {700, 900}}, ClipperLib::ptClip, /* closed */ true);
+        c.StrictlySimple(strictly_simple);
+        c.Execute(ClipperLib::ctDifference, touching, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
+        check_dehole(touching, ClipperLib::pftNonZero, strictly_simple, false, "Hole touching outline");
+
+        /* Islands inside of holes, two levels deep, next to a plain hole */
+        Paths islands {
+            rect_path(0, 0, 1000, 1000),
+            rect_path(100, 100, 900, 900),
+            rect_path(200, 200, 800, 800),
+            rect_path(300, 300, 700, 700),
+            rect_path(400, 400, 500, 500),
+            rect_path(550, 550, 650, 650),
+            rect_path(920, 920, 980, 980),
+        };
+        check_dehole(islands, ClipperLib::pftEvenOdd, strictly_simple, true, "Islands in holes");
+    }
+
+    /* Random overlapping polygons */
+    mt19937 rng(3);
+    uniform_int_distribution<int> coord(0, 1000), vertices(3, 8);
+    uniform_real_distribution<double> radius(0.4, 1.0);
+    for (int i=0; i<500; i++) {
+        Paths in;
+        int n = 1 + i%40;
+        for (int k=0; k<n; k++) {
+            int cx = coord(rng), cy = coord(rng), r = 20 + coord(rng) % 150, np = vertices(rng);
+            Path p;
+            for (int j=0; j<np; j++) {
+                double a = j * 2 * std::numbers::pi / np, rr = r * radius(rng);
+                p.push_back({(ClipperLib::cInt)((cx + rr*cos(a)) * 1e7), (ClipperLib::cInt)((cy + rr*sin(a)) * 1e7)});
+            }
+            in.push_back(p);
+        }
+
+        char name[64];
+        snprintf(name, sizeof(name), "Random case %d", i);
+        check_dehole(in, ClipperLib::pftEvenOdd, i%2, false, name);
+    }
+}
+
+static void check_no_diagonal_cells(vector<uint8_t> &cells, int cols, int rows) {
+    auto cell = [&](int i, int j) { return cells[(size_t)j*cols + i]; };
+    for (int j=0; j+1<rows; j++) {
+        for (int i=0; i+1<cols; i++) {
+            snprintf(msg, sizeof(msg), "Cells at (%d, %d) touch only at their corners", i, j);
+            mu_assert(cell(i, j) != cell(i+1, j+1) || cell(i+1, j) != cell(i, j+1) || cell(i, j) == cell(i+1, j), msg);
+        }
+    }
+}
+
+MU_TEST(test_fix_diagonal_cells) {
+    /* Checkerboard, which a single pass cannot fix */
+    int cols = 17, rows = 13;
+    vector<uint8_t> cells((size_t)cols * rows);
+    for (int j=0; j<rows; j++)
+        for (int i=0; i<cols; i++)
+            cells[(size_t)j*cols + i] = (i + j) % 2;
+    fix_diagonal_cells(cells, cols, rows);
+    check_no_diagonal_cells(cells, cols, rows);
+
+    /* Random grids of different densities */
+    mt19937 rng(0);
+    for (double density : {0.1, 0.3, 0.5, 0.7, 0.9}) {
+        bernoulli_distribution set(density);
+        for (auto &c : cells) {
+            c = set(rng);
+        }
+        vector<uint8_t> orig(cells);
+        fix_diagonal_cells(cells, cols, rows);
+        check_no_diagonal_cells(cells, cols, rows);
+
+        for (size_t i=0; i<cells.size(); i++) {
+            mu_assert(cells[i] || !orig[i], "Set cell got cleared");
+        }
+    }
+}
+
+/* Reference for the Gerber output's number formatting, using iostreams like the Gerber output used to. */
+static string iostream_xy(long long int x, long long int y, int width, const char *dcode) {
+    ostringstream os;
+    os << "X" << setw(width) << setfill('0') << std::internal << x
+       << "Y" << setw(width) << setfill('0') << std::internal << y
+       << dcode << endl;
+    return os.str();
+}
+
+static string read_file(const char *fn) {
+    ifstream in(fn, ios::binary);
+    ostringstream os;
+    os << in.rdbuf();
+    return os.str();
+}
+
+MU_TEST(test_gerber_number_formatting) {
+    for (auto [digits_int, digits_frac] : {pair{4, 6}, pair{3, 3}, pair{6, 9}}) {
+        double height = 100.0;
+        double gerber_scale = round(pow(10, digits_frac));
+
+        /* Negative, rounding edges, and large values */
+        vector<double> coords {0.0, 1.0, -1.0, 1e-9, -1e-9, 0.5e-6, -0.5e-6, 1.5e-3, -1.5e-3, 0.0005, 2.675,
+            -2.675, 99.9999995, 123.456789, -123.456789, 999.999, 9999.999999, -9999.999999};
+        vector<double> sizes {0.05, 0.1, 0.3 * 3, 1e-5, 2.5e-7, 0.1234565, 123456.7, 1234567.0, 1e21};
+
+        ostringstream out;
+        SimpleGerberOutput sink(out, false, digits_int, digits_frac);
+        sink.header({0, 0}, {height, height});
+
+        ostringstream expected;
+        expected << "%FSLAX" << digits_int << digits_frac << "Y" << digits_int << digits_frac << "*%" << endl;
+        expected << "%MOMM*%" << endl << "%LPD*%" << endl << "G01*" << endl << "%ADD10C,0.050000*%" << endl
+                 << "D10*" << endl;
+
+        int dcode = 10;
+        set<long long int> defined {llround(0.05 * gerber_scale)};
+        for (double size : sizes) {
+            sink << ApertureToken(size);
+            if (!defined.contains(llround(size * gerber_scale))) {
+                defined.insert(llround(size * gerber_scale));
+                dcode++;
+                expected << "%ADD" << dcode << "C," << size << "*%" << endl << "D" << dcode << "*" << endl;
+            }
+
+            for (double x : coords) {
+                for (double y : coords) {
+                    sink << FlashToken({x, y});
+                    expected << iostream_xy((long long int)round(x * gerber_scale),
+                            (long long int)round((height - y) * gerber_scale), digits_int + digits_frac, "D03*");
+                }
+            }
+        }
+        sink.footer();
+        expected << "M02*" << endl;
+
+        snprintf(msg, sizeof(msg), "Gerber output in %d.%d format differs from iostream formatting", digits_int, digits_frac);
+        mu_assert(out.str() == expected.str(), msg);
+    }
+}
+
+/* Golden file for modal coordinates, vertex deduplication and aperture deduplication. Output must be the same with and
+ * without encoder threads. */
+static void write_gerber_golden_test(PolygonSink &sink) {
+    sink.header({0, 0}, {10, 10});
+    sink << GRB_POL_DARK << ApertureToken();
+    /* Axis-aligned edges, where one coordinate stays the same */
+    sink << Polygon {{1, 1}, {5, 1}, {5, 4}, {1, 4}};
+    /* Vertices within one output grid step, and a vertex repeating the first one */
+    sink << Polygon {{2, 2}, {2.0000001, 2.0000004}, {3, 2}, {3, 3}, {2.0000002, 3}, {2, 2}};
+    /* Collapses into a line after rounding, and is dropped */
+    sink << Polygon {{1, 1}, {1.0000001, 1.0000001}, {1.0000002, 1}};
+
+    sink << GRB_POL_CLEAR;
+    sink << Polygon {{-1, -1}, {-0.5, -1}, {-0.5, 11}};
+
+    /* Sizes that round to the same value at 6 decimals get the same aperture */
+    sink << GRB_POL_DARK << ApertureToken(0.1);
+    sink << Polygon {{1, 1}, {2, 1}, {2, 1.0000001}};
+    sink << ApertureToken(0.1000004);
+    sink << Polygon {{3, 3}, {3, 3}};
+    sink << ApertureToken(0.1000006);
+    sink << FlashToken({4, 4});
+    sink << ApertureToken(0.05);
+    sink << FlashToken({5, 5});
+    sink << ApertureToken(0.1);
+    sink << FlashToken({6, 6});
+    sink << ApertureToken();
+    sink.footer();
+}
+
+MU_TEST(test_gerber_golden_output) {
+    string expected = read_file("testdata/gerber-golden.gbr");
+    mu_assert(!expected.empty(), "Golden file failed to load");
+
+    for (size_t threads : {0, 3}) {
+        ostringstream out;
+        SimpleGerberOutput sink(out);
+        sink.set_encoder_threads(threads);
+        write_gerber_golden_test(sink);
+
+        snprintf(msg, sizeof(msg), "Gerber output with %zu encoder threads differs from golden file", threads);
+        mu_assert(out.str() == expected, msg);
+    }
+}
+
+static double polygon_area(const Polygon &poly) {
+    double area = 0.0;
+    for (size_t i=0; i<poly.size(); i++) {
+        const auto &a = poly[i], &b = poly[(i+1) % poly.size()];
+        area += a[0] * b[1] - b[0] * a[1];
+    }
+    return fabs(area / 2);
+}
+
+/* Summarize Gerber output as a string with one character per polarity change (D or C) and region (R), and collect the
+ * regions' areas in mm². Only handles the subset of Gerber that is needed for this. */
+static void parse_gerber_regions(const string &gbr, string &events, vector<double> &areas) {
+    istringstream in(gbr);
+    string line;
+    Polygon region;
+    bool in_region = false;
+    double x = 0, y = 0;
+    while (getline(in, line)) {
+        if (line == "%LPD*%" || line == "%LPC*%") {
+            events += line[3];
+        } else if (line == "G36*") {
+            in_region = true;
+            region.clear();
+        } else if (line == "G37*") {
+            in_region = false;
+            events += 'R';
+            areas.push_back(polygon_area(region));
+        } else if (in_region && (line[0] == 'X' || line[0] == 'Y')) {
+            size_t pos = 0;
+            if (line[pos] == 'X') {
+                x = stoll(line.substr(1), &pos) / 1e6;
+                pos += 1;
+            }
+            if (line[pos] == 'Y') {
+                y = stoll(line.substr(pos + 1)) / 1e6;
+            }
+            region.push_back({x, y});
+        }
+    }
+}
+
+MU_TEST(test_gerber_hole_regions) {
+    for (bool flip : {false, true}) {
+        for (GerberPolarityToken pol : {GRB_POL_DARK, GRB_POL_CLEAR}) {
+            ostringstream out;
+            SimpleGerberOutput sink(out, false, 4, 6, 1.0, {0, 0}, flip);
+            sink.set_hole_regions(true);
+            mu_assert(sink.can_do_holes(), "Gerber output does not take holes in hole region mode");
+
+            /* Outline and holes running either way round */
+            vector<Polygon> contours {
+                {{1, 1}, {9, 1}, {9, 9}, {1, 9}},
+                {{2, 2}, {2, 4}, {4, 4}, {4, 2}},
+                {{5, 5}, {8, 5}, {8, 8}, {5, 8}},
+            };
+            sink.header({0, 0}, {10, 10});
+            sink << pol << ApertureToken();
+            sink << PolygonWithHolesToken(contours);
+            sink.footer();
+
+            string events;
+            vector<double> areas;
+            parse_gerber_regions(out.str(), events, areas);
+
+            /* The header always starts out dark */
+            bool out_dark = (pol == GRB_POL_DARK) != flip;
+            char p = out_dark ? 'D' : 'C';
+            if (out_dark) {
+                /* Holes are cut out of dark regions using clear regions */
+                string expected {'D', p, 'R', 'C', 'R', 'R', p};
+                snprintf(msg, sizeof(msg), "Dark hole region (flip=%d) output as \"%s\"", flip, events.c_str());
+                mu_assert(events == expected, msg);
+                mu_assert(fabs(areas[0] - 64) < 1e-6 && fabs(areas[1] - 4) < 1e-6 && fabs(areas[2] - 9) < 1e-6,
+                        "Dark hole region has wrong areas");
+
+            } else {
+                /* Clear regions must never be followed by dark ones, since those would add copper where the holes
+                 * should leave alone whatever is below. */
+                snprintf(msg, sizeof(msg), "Clear hole region (flip=%d) output as \"%s\"", flip, events.c_str());
+                mu_assert(events.size() >= 3 && events[0] == 'D' && events[1] == p && events.find_first_not_of('R', 2) == string::npos,
+                        msg);
+
+                double total = 0.0;
+                for (double a : areas) {
+                    total += a;
+                }
+                snprintf(msg, sizeof(msg), "Deholed clear region has area %g instead of 51", total);
+                mu_assert(fabs(total - 51) < 1e-6, msg);
+            }
+        }
+    }
+}
+
+/* Minimal GDSII reader for checking the GDSII output */
+struct GDSRecord {
+    uint16_t type;
+    string data;
+
+    int32_t i32(size_t i) const {
+        const uint8_t *p = (const uint8_t *)data.data() + 4*i;
+        return (int32_t)((uint32_t)p[0]<<24 | (uint32_t)p[1]<<16 | (uint32_t)p[2]<<8 | p[3]);
+    }
+
+    int16_t i16(size_t i) const {
+        const uint8_t *p = (const uint8_t *)data.data() + 2*i;
+        return (int16_t)(p[0]<<8 | p[1]);
+    }
+
+    double real8(size_t i) const {
+        uint64_t bits = (uint64_t)(uint32_t)i32(2*i) << 32 | (uint32_t)i32(2*i + 1);
+        double mant = ldexp((double)(bits & ((1ULL<<56) - 1)), -56);
+        int exp = (bits >> 56) & 0x7f;
+        return ((bits >> 63) ? -1 : 1) * mant * pow(16.0, exp - 64);
+    }
+
+    vector<array<int32_t, 2>> xy() const {
+        vector<array<int32_t, 2>> out;
+        for (size_t i=0; i<data.size()/8; i++) {
+            out.push_back({i32(2*i), i32(2*i + 1)});
+        }
+        return out;
+    }
+};
+
+static void parse_gdsii(const string &data, vector<GDSRecord> &out) {
+    size_t pos = 0;
+    while (pos + 4 <= data.size()) {
+        size_t len = (uint8_t)data[pos] << 8 | (uint8_t)data[pos+1];
+        uint16_t type = (uint8_t)data[pos+2] << 8 | (uint8_t)data[pos+3];
+        mu_assert(len >= 4 && len % 2 == 0 && pos + len <= data.size(), "Invalid GDSII record length");
+        out.push_back({type, data.substr(pos + 4, len - 4)});
+        pos += len;
+    }
+    mu_assert(pos == data.size(), "Trailing data after last GDSII record");
+}
+
+MU_TEST(test_gdsii_output) {
+    constexpr uint16_t GDS_HEADER = 0x0002, GDS_UNITS = 0x0305, GDS_ENDLIB = 0x0400, GDS_STRNAME = 0x0606,
+              GDS_BOUNDARY = 0x0800, GDS_PATH = 0x0900, GDS_WIDTH = 0x0F03, GDS_XY = 0x1003;
+
+    ostringstream out;
+    SimpleGDSIIOutput sink(out, false, 6, 1.0, "gerbolyze", "my board-v1.2 (final), with a much too long name");
+    sink.header({0, 0}, {10, 10});
+    sink << GRB_POL_DARK << ApertureToken();
+    sink << Polygon {{1, 1}, {5, 1}, {5, 4}, {1, 4}};
+    /* Omitted, GDSII has no clear polarity */
+    sink << GRB_POL_CLEAR << Polygon {{2, 2}, {3, 2}, {3, 3}};
+    sink << GRB_POL_DARK << ApertureToken(0.2);
+    sink << Polygon {{1, 1}, {2, 1}, {2, 1.0000001}, {-2.5, 3}};
+    sink.footer();
+
+    vector<GDSRecord> recs;
+    parse_gdsii(out.str(), recs);
+    mu_assert(recs.size() > 2, "GDSII output is empty");
+    mu_assert_int_eq(GDS_HEADER, recs.front().type);
+    mu_assert_int_eq(GDS_ENDLIB, recs.back().type);
+
+    vector<uint16_t> elements;
+    vector<vector<array<int32_t, 2>>> xys;
+    vector<int32_t> widths;
+    bool have_units = false;
+    for (auto &rec : recs) {
+        switch (rec.type) {
+            case GDS_UNITS:
+                /* User unit of 1um in database units, and database unit of 1nm in meters */
+                mu_assert_int_eq(16, (int)rec.data.size());
+                mu_assert(fabs(rec.real8(0) - 1e-3) < 1e-15, "Wrong GDSII user unit");
+                mu_assert(fabs(rec.real8(1) - 1e-9) < 1e-21, "Wrong GDSII database unit");
+                have_units = true;
+                break;
+            case GDS_STRNAME:
+                mu_assert(rec.data == "my_board_v1_2__final___with_a_mu", "Structure name was not sanitized");
+                break;
+            case GDS_BOUNDARY:
+            case GDS_PATH:
+                elements.push_back(rec.type);
+                break;
+            case GDS_WIDTH:
+                widths.push_back(rec.i32(0));
+                break;
+            case GDS_XY:
+                xys.push_back(rec.xy());
+                break;
+        }
+    }
+    mu_assert(have_units, "No UNITS record");
+
+    mu_assert(elements == (vector<uint16_t>{GDS_BOUNDARY, GDS_PATH}), "Unexpected GDSII elements");
+    mu_assert_int_eq(2, (int)xys.size());
+    /* Boundaries are closed explicitly, and Y is flipped */
+    mu_assert(xys[0] == (vector<array<int32_t, 2>>{
+                {1000000, 9000000}, {5000000, 9000000}, {5000000, 6000000}, {1000000, 6000000}, {1000000, 9000000}}),
+            "Unexpected boundary coordinates");
+    /* Vertices that round to the same point are dropped */
+    mu_assert(xys[1] == (vector<array<int32_t, 2>>{{1000000, 9000000}, {2000000, 9000000}, {-2500000, 7000000}}),
+            "Unexpected path coordinates");
+    mu_assert(widths == vector<int32_t>{200000}, "Unexpected path width");
+
+    mu_assert(SimpleGDSIIOutput::sanitize_strname("") == "TOP", "Empty structure name was not replaced");
+    mu_assert(SimpleGDSIIOutput::sanitize_strname("A_z?$09") == "A_z?$09", "Valid structure name was changed");
+}
+
+/* Records the polygons it gets along with their polarity */
+/* Read the coordinates of all POLYGON records from a binary polygon stream */
+static void parse_binary_polygons(const string &data, bool has_header, vector<vector<array<int32_t, 2>>> &out) {
+    auto u32 = [&data](size_t pos) {
+        const uint8_t *p = (const uint8_t *)data.data() + pos;
+        return (uint32_t)p[0] | (uint32_t)p[1]<<8 | (uint32_t)p[2]<<16 | (uint32_t)p[3]<<24;
+    };
+
+    size_t pos = 0;
+    if (has_header) {
+        mu_assert(data.substr(0, 8) == "GBRLZPLY", "Binary polygon stream has wrong magic");
+        pos = 8 + 4 + 4 + 16;
+    }
+
+    while (pos + 8 <= data.size()) {
+        uint32_t type = u32(pos), len = u32(pos + 4);
+        pos += 8;
+        mu_assert(pos + len <= data.size(), "Invalid binary polygon stream record length");
+        if (type == BinaryPolygonOutput::REC_POLYGON) {
+            auto &poly = out.emplace_back();
+            for (size_t i=0; i<len; i+=8) {
+                poly.push_back({(int32_t)u32(pos + i), (int32_t)u32(pos + i + 4)});
+            }
+        }
+        pos += (len + 3) / 4 * 4;
+    }
+}
+
+MU_TEST(test_binary_output) {
+    for (bool only_polys : {false, true}) {
+        ostringstream out;
+        BinaryPolygonOutput sink(out, only_polys, 6);
+        sink.header({0, 5}, {10, 10});
+        sink << GRB_POL_DARK << ApertureToken();
+        sink << Polygon {{1, 1}, {2, 1}, {2, 2}};
+        /* Out of int32 range at 6 digits */
+        sink << Polygon {{3000, 1}, {-3000, 1}, {0, -3000}};
+        sink.footer();
+
+        vector<vector<array<int32_t, 2>>> polys;
+        parse_binary_polygons(out.str(), !only_polys, polys);
+        mu_assert(polys.size() == 2, "Expected two polygons in binary polygon stream");
+
+        /* Like Gerber output, the header's origin and size only apply when it is written */
+        int32_t y0 = only_polys ? 0 : 20000000;
+        snprintf(msg, sizeof(msg), "Wrong binary coordinates with only_polys=%d", only_polys);
+        mu_assert((polys[0] == vector<array<int32_t, 2>> {{1000000, y0 - 1000000}, {2000000, y0 - 1000000},
+                    {2000000, y0 - 2000000}}), msg);
+
+        snprintf(msg, sizeof(msg), "Out of range coordinates not clamped with only_polys=%d", only_polys);
+        mu_assert(polys[1][0][0] == INT32_MAX && polys[1][1][0] == -INT32_MAX && polys[1][2][1] == INT32_MAX, msg);
+    }
+}
+
+class PolygonRecorder : public PolygonSink {
+public:
+    using PolygonSink::operator<<;
+    virtual PolygonRecorder &operator<<(const Polygon &poly) { polys.push_back({polarity, poly}); return *this; }
+    virtual PolygonRecorder &operator<<(GerberPolarityToken pol) { polarity = pol; return *this; }
+
+    GerberPolarityToken polarity = GRB_POL_DARK;
+    vector<pair<GerberPolarityToken, Polygon>> polys;
+};
+
+static Polygon square(double x, double y, double size) {
+    return {{x, y}, {x+size, y}, {x+size, y+size}, {x, y+size}};
+}
+
+MU_TEST(test_dilater_merges_runs) {
+    double d = 0.1;
+    /* The dilated outline's rounded corners are approximated by polygons that lie inside the arcs, and at worst cut
+     * each corner off straight. */
+    double max_area = 2.2 * 1.2 - (4 - M_PI) * d*d;
+    double min_area = 2.2 * 1.2 - 2 * d*d;
+
+    {
+        /* Touching dark regions come out as one dilated region */
+        PolygonRecorder rec;
+        Dilater dil(rec, d);
+        dil << GRB_POL_DARK << square(0, 0, 1) << square(1, 0, 1);
+        dil.footer();
+        mu_assert_int_eq(1, (int)rec.polys.size());
+        double area = polygon_area(rec.polys[0].second);
+        mu_assert(area > min_area && area < max_area, "Wrong dilated area");
+    }
+
+    {
+        /* Touching clear regions are eroded as a union, which does not leave a gap between them. Eroding them one by
+         * one would leave two squares of 0.8mm. */
+        PolygonRecorder rec;
+        Dilater dil(rec, d);
+        dil << GRB_POL_CLEAR << square(0, 0, 1) << square(1, 0, 1);
+        dil.footer();
+        mu_assert_int_eq(1, (int)rec.polys.size());
+        mu_assert(rec.polys[0].first == GRB_POL_CLEAR, "Wrong polarity");
+        mu_assert(fabs(polygon_area(rec.polys[0].second) - 1.8 * 0.8) < 1e-6, "Wrong eroded area");
+    }
+
+    {
+        /* Runs spread over many batches come out in input order, and polarity changes end a run */
+        PolygonRecorder rec;
+        Dilater dil(rec, d);
+        dil << GRB_POL_DARK;
+        for (int i=0; i<100; i++) {
+            dil << square(i * 3.0, (i % 7) * 11.0, 1);
+        }
+        dil << GRB_POL_CLEAR << square(0.5, 0.5, 1) << GRB_POL_DARK << square(0.2, 0.2, 0.1);
+        dil.footer();
+
+        mu_assert_int_eq(102, (int)rec.polys.size());
+        for (int i=0; i<100; i++) {
+            auto &[pol, poly] = rec.polys[i];
+            double min_x = poly[0][0];
+            for (auto &p : poly) {
+                min_x = min(min_x, p[0]);
+            }
+            mu_assert(pol == GRB_POL_DARK, "Wrong polarity");
+            mu_assert(fabs(min_x - (i * 3.0 - d)) < 1e-6, "Dilated regions out of order");
+        }
+        mu_assert(rec.polys[100].first == GRB_POL_CLEAR, "Wrong polarity");
+        mu_assert(rec.polys[101].first == GRB_POL_DARK, "Wrong polarity");
+    }
+
+    {
+        /* The region merger batches the same way */
+        PolygonRecorder rec;
+        RegionMerger merger(rec);
+        merger << GRB_POL_DARK << square(0, 0, 1) << square(1, 0, 1) << square(100, 0, 1);
+        merger.footer();
+        mu_assert_int_eq(2, (int)rec.polys.size());
+        mu_assert(fabs(polygon_area(rec.polys[0].second) - 2.0) < 1e-9, "Wrong merged area");
+        mu_assert(fabs(polygon_area(rec.polys[1].second) - 1.0) < 1e-9, "Wrong merged area");
+    }
+}
+
+MU_TEST(test_image_histogram) {
+    Image32f blank, white;
+    mu_assert(blank.load("testdata/blank.png"), "Input image failed to load");
+    mu_assert(white.load("testdata/white.png"), "Input image failed to load");
+
+    mu_assert_int_eq(blank.size(), (int)blank.histogram()[0]);
+    mu_assert_int_eq(white.size(), (int)white.histogram()[255]);
+}
+
+MU_TEST(test_blue_noise_mask) {
+    const vector<double> &mask = blue_noise_mask();
+    mu_assert_int_eq(blue_noise_mask_size * blue_noise_mask_size, (int)mask.size());
+
+    /* Every threshold must occur exactly once */
+    vector<double> sorted(mask);
+    sort(sorted.begin(), sorted.end());
+    for (size_t i=0; i<sorted.size(); i++) {
+        mu_assert_double_eq((i + 0.5) / sorted.size(), sorted[i]);
+    }
+
+    /* Any threshold level must come out evenly spread: At 50%, no 8x8 tile of the mask may be far off. */
+    for (int ty=0; ty<blue_noise_mask_size; ty+=8) {
+        for (int tx=0; tx<blue_noise_mask_size; tx+=8) {
+            int count = 0;
+            for (int y=ty; y<ty+8; y++)
+                for (int x=tx; x<tx+8; x++)
+                    count += mask[y*blue_noise_mask_size + x] < 0.5;
+            mu_assert(count >= 24 && count <= 40, "Blue noise mask is unevenly distributed");
+        }
+    }
+}
+
+MU_TEST(test_parallel_for_exception) {
+    std::atomic<size_t> calls {0};
+    bool caught = false;
+    try {
+        parallel_for(1000, [&calls](size_t i) {
+            calls++;
+            if (i == 10)
+                throw ClipperLib::clipperException("test");
+        });
+    } catch (const ClipperLib::clipperException &) {
+        caught = true;
+    }
+    mu_assert(caught, "Exception from a worker was not rethrown on the calling thread");
+    mu_assert(calls < 1000, "parallel_for kept going after a call threw");
+
+    /* The pool still works afterwards */
+    vector<int> out(100, 0);
+    parallel_for(out.size(), [&out](size_t i) { out[i] = i; });
+    for (size_t i=0; i<out.size(); i++) {
+        mu_assert_int_eq((int)i, out[i]);
+    }
+}
 
 MU_TEST_SUITE(nopencv_contours_suite) {
     MU_RUN_TEST(test_complex_example_from_paper);
@@ -415,6 +1347,24 @@ MU_TEST_SUITE(nopencv_contours_suite) {
     MU_RUN_TEST(chain_approx_test_contour_tracing_demo_input);
 
     MU_RUN_TEST(test_transform_decomposition);
+    MU_RUN_TEST(test_xform_inverse_cache);
+
+    MU_RUN_TEST(test_poisson_disc_reproducible);
+    MU_RUN_TEST(test_poisson_disc_min_distance);
+    MU_RUN_TEST(test_poisson_disc_mask);
+    MU_RUN_TEST(test_adaptive_sampling);
+    MU_RUN_TEST(test_blue_noise_mask);
+    MU_RUN_TEST(test_fix_diagonal_cells);
+    MU_RUN_TEST(test_gerber_number_formatting);
+    MU_RUN_TEST(test_gerber_golden_output);
+    MU_RUN_TEST(test_gerber_hole_regions);
+    MU_RUN_TEST(test_gdsii_output);
+    MU_RUN_TEST(test_binary_output);
+    MU_RUN_TEST(test_dilater_merges_runs);
+    MU_RUN_TEST(test_simplify_polygon_matches_clipping);
+    MU_RUN_TEST(test_dehole_polytree);
+    MU_RUN_TEST(test_parallel_for_exception);
+    MU_RUN_TEST(test_image_histogram);
 };
 
 int main(int argc, char **argv) {
@@ -13,7 +13,7 @@ import sys
 from PIL import Image
 import numpy as np
 
-def run_svg_flatten(input_file, output_file, *args, timeout=None, **kwargs):
+def svg_flatten_command(input_file, output_file, **kwargs):
     if 'SVG_FLATTEN' in os.environ:
         svg_flatten = os.environ.get('SVG_FLATTEN')
         if not hasattr(run_svg_flatten, 'custom_svg_flatten_warned'):
@@ -35,6 +35,10 @@ def run_svg_flatten(input_file, output_file, *args, timeout=None, **kwargs):
             args.append(value)
     args.append(str(input_file))
     args.append(str(output_file))
+    return args
+
+def run_svg_flatten(input_file, output_file, *args, timeout=None, **kwargs):
+    args = svg_flatten_command(input_file, output_file, **kwargs)
 
     try:
         proc = subprocess.run(args, capture_output=True, check=True, text=True, timeout=timeout)
@@ -223,7 +227,8 @@ class StrokeMappingTests(unittest.TestCase):
             run_svg_flatten(test_in_svg, tmp_out_svg.name, format='svg')
 
             with open(tmp_out_svg.name, 'r') as f:
-                num_strokes = sum(1 for l in f.readlines() if 'stroke=' in l)
+                # Strokes of the same width are batched into one path element, count their subpaths.
+                num_strokes = sum(l.count('M ') for l in f.readlines() if 'stroke=' in l)
                 try:
                     self.assertEqual(num_strokes, 60)
                 except AssertionError as e:
@@ -249,6 +254,152 @@ class RegressionTests(unittest.TestCase):
             # This will raise subprocess.TimeoutExpired if the test fails.
             run_svg_flatten(tmp_svg.name, tmp_gbr.name, format='svg', timeout=15)
 
+class RegionMergerTests(unittest.TestCase):
+    def test_merge_overlapping_regions(self):
+        test_svg = textwrap.dedent('''<svg width="100" height="100" xmlns="http://www.w3.org/2000/svg">
+                <rect x="10" y="10" width="30" height="30" fill="#000000"/>
+                <rect x="30" y="30" width="30" height="30" fill="#000000"/>
+                <rect x="50" y="10" width="20" height="30" fill="#000000"/>
+                <rect x="80" y="80" width="10" height="10" fill="#000000"/>
+            </svg>''')
+
+        def count_paths(**kwargs):
+            with tempfile.NamedTemporaryFile(suffix='.svg') as tmp_in_svg,\
+                    tempfile.NamedTemporaryFile(suffix='.svg') as tmp_out_svg:
+                tmp_in_svg.write(test_svg.encode())
+                tmp_in_svg.flush()
+                run_svg_flatten(tmp_in_svg.name, tmp_out_svg.name, format='svg', **kwargs)
+
+                with open(tmp_out_svg.name, 'r') as f:
+                    return sum(l.count('M ') for l in f.readlines() if '<path' in l)
+
+        # The first three rects touch and merge into one region
+        self.assertEqual(count_paths(merge_regions=True), count_paths() - 2)
+
+class SVGOutputTests(unittest.TestCase):
+    def test_path_batching(self):
+        test_svg = textwrap.dedent('''<svg width="100" height="100" xmlns="http://www.w3.org/2000/svg">
+                <rect x="10" y="10" width="10" height="10" fill="#000000"/>
+                <rect x="30" y="10" width="10" height="10" fill="#000000"/>
+                <rect x="50" y="10" width="10" height="10" fill="#000000"/>
+                <rect x="10" y="50" width="10" height="10" fill="#000000"/>
+            </svg>''')
+
+        with tempfile.NamedTemporaryFile(suffix='.svg') as tmp_in_svg,\
+                tempfile.NamedTemporaryFile(suffix='.svg') as tmp_out_svg:
+            tmp_in_svg.write(test_svg.encode())
+            tmp_in_svg.flush()
+            run_svg_flatten(tmp_in_svg.name, tmp_out_svg.name, format='svg')
+
+            with open(tmp_out_svg.name, 'r') as f:
+                paths = [l for l in f.readlines() if '<path' in l]
+
+            # All four rects are consecutive and share a style, so they end up in one path element.
+            self.assertEqual(len(paths), 1)
+            self.assertEqual(paths[0].count('M '), 4)
+
+class FlattenerTests(unittest.TestCase):
+    def test_batch_engine(self):
+        test_svg = textwrap.dedent('''<svg width="100" height="100" xmlns="http://www.w3.org/2000/svg">
+                <rect x="10" y="10" width="80" height="80" fill="#000000"/>
+                <rect x="20" y="20" width="20" height="20" fill="#ffffff"/>
+                <rect x="30" y="30" width="20" height="20" fill="#ffffff"/>
+                <circle cx="70" cy="70" r="10" fill="#ffffff"/>
+                <rect x="25" y="25" width="5" height="5" fill="#000000"/>
+                <rect x="60" y="20" width="10" height="10" fill="#ffffff"/>
+            </svg>''')
+
+        with tempfile.NamedTemporaryFile(suffix='.svg') as tmp_in_svg:
+            tmp_in_svg.write(test_svg.encode())
+            tmp_in_svg.flush()
+
+            renderings = []
+            for engine in ['polygon', 'batch', 'parallel-batch']:
+                with tempfile.NamedTemporaryFile(suffix='.svg') as tmp_out_svg,\
+                        tempfile.NamedTemporaryFile(suffix='.png') as tmp_out_png:
+                    run_svg_flatten(tmp_in_svg.name, tmp_out_svg.name, format='svg', flatten=True, flatten_engine=engine,
+                            flatten_tile_size='7')
+
+                    with open(tmp_out_svg.name, 'r') as f:
+                        # Flattened output only contains dark polygons
+                        self.assertNotIn('#ffffff', f.read())
+
+                    run_cargo_cmd('resvg', [tmp_out_svg.name, tmp_out_png.name], check=True, stdout=subprocess.DEVNULL)
+                    renderings.append(np.array(Image.open(tmp_out_png.name)).astype(float).mean(axis=2))
+
+            for other in renderings[1:]:
+                delta = np.abs(renderings[0] - other) / 255
+                self.assertTrue(delta.mean() < 0.001,
+                        f'Expected mean pixel difference between flattening engines to be <0.001, was {delta.mean():.5g}')
+
+class HoleTests(unittest.TestCase):
+    def test_svg_output_keeps_holes(self):
+        test_svg = textwrap.dedent('''<svg width="100" height="100" xmlns="http://www.w3.org/2000/svg">
+                <rect x="5" y="5" width="90" height="90" fill="#000000"/>
+                <path fill="#ffffff" fill-rule="evenodd" d="M 10 10 L 90 10 L 90 90 L 10 90 Z M 30 30 L 30 70 L 70 70 L 70 30 Z M 40 40 L 60 40 L 60 60 L 40 60 Z"/>
+            </svg>''')
+
+        with tempfile.NamedTemporaryFile(suffix='.svg') as tmp_in_svg:
+            tmp_in_svg.write(test_svg.encode())
+            tmp_in_svg.flush()
+
+            renderings = []
+            for flatten in [False, True]:
+                with tempfile.NamedTemporaryFile(suffix='.svg') as tmp_out_svg,\
+                        tempfile.NamedTemporaryFile(suffix='.png') as tmp_out_png:
+                    # The flattener removes holes, so this compares native holes against deholed output.
+                    run_svg_flatten(tmp_in_svg.name, tmp_out_svg.name, format='svg', flatten=flatten)
+
+                    if not flatten:
+                        with open(tmp_out_svg.name, 'r') as f:
+                            # The clear region and its hole end up in one path element
+                            self.assertIn(3, [l.count('M ') for l in f.readlines() if '#ffffff' in l])
+
+                    run_cargo_cmd('resvg', [tmp_out_svg.name, tmp_out_png.name], check=True, stdout=subprocess.DEVNULL)
+                    # Flattened output leaves clear areas transparent instead of painting them white
+                    img = Image.open(tmp_out_png.name).convert('RGBA')
+                    img = Image.alpha_composite(Image.new('RGBA', img.size, 'white'), img)
+                    renderings.append(np.array(img.convert('L')).astype(float))
+
+            delta = np.abs(renderings[0] - renderings[1]) / 255
+            self.assertTrue(delta.mean() < 0.001,
+                    f'Expected mean pixel difference between native and deholed holes to be <0.001, was {delta.mean():.5g}')
+
+    def test_flatten_engines_keyholed_input(self):
+        # Holes stacked above each other share their bridge vertex on the outline, and the last hole has an island.
+        dark_holes = ' '.join(f'M 15 {y} L 15 {y+5} L 20 {y+5} L 20 {y} Z' for y in range(15, 75, 8))
+        test_svg = textwrap.dedent(f'''<svg width="100" height="100" xmlns="http://www.w3.org/2000/svg">
+                <path fill="#000000" fill-rule="evenodd" d="M 5 5 L 95 5 L 95 95 L 5 95 Z {dark_holes} M 30 75 L 30 90 L 60 90 L 60 75 Z M 40 80 L 50 80 L 50 85 L 40 85 Z"/>
+                <path fill="#ffffff" fill-rule="evenodd" d="M 30 10 L 90 10 L 90 70 L 30 70 Z M 40 20 L 40 60 L 80 60 L 80 20 Z M 50 30 L 70 30 L 70 50 L 50 50 Z"/>
+                <rect x="55" y="35" width="10" height="10" fill="#ffffff"/>
+            </svg>''')
+
+        with tempfile.NamedTemporaryFile(suffix='.svg') as tmp_in_svg:
+            tmp_in_svg.write(test_svg.encode())
+            tmp_in_svg.flush()
+
+            renderings = []
+            for engine in [None, 'polygon', 'batch', 'parallel-batch']:
+                with tempfile.NamedTemporaryFile(suffix='.svg') as tmp_out_svg,\
+                        tempfile.NamedTemporaryFile(suffix='.png') as tmp_out_png:
+                    # The flattener cannot do holes, so it gets keyholed polygons as input.
+                    if engine:
+                        run_svg_flatten(tmp_in_svg.name, tmp_out_svg.name, format='svg', flatten=True,
+                                flatten_engine=engine, flatten_tile_size='7')
+                    else:
+                        run_svg_flatten(tmp_in_svg.name, tmp_out_svg.name, format='svg')
+
+                    run_cargo_cmd('resvg', [tmp_out_svg.name, tmp_out_png.name], check=True, stdout=subprocess.DEVNULL)
+                    img = Image.open(tmp_out_png.name).convert('RGBA')
+                    img = Image.alpha_composite(Image.new('RGBA', img.size, 'white'), img)
+                    renderings.append(np.array(img.convert('L')).astype(float))
+
+            for engine, other in zip(['polygon', 'batch', 'parallel-batch'], renderings[1:]):
+                delta = np.abs(renderings[0] - other) / 255
+                self.assertTrue(delta.mean() < 0.001,
+                        f'Expected mean pixel difference between {engine} engine and unflattened output to be <0.001, was {delta.mean():.5g}')
+
+
 
 for test_in_svg in Path('testdata/svg').glob('*.svg'):
     # We need to make sure we capture the loop variable's current value here.
@@ -3,6 +3,14 @@
 #include <string>
 #include <iostream>
 #include <vector>
+#include <algorithm>
+#include <exception>
+
+#ifndef WASI
+#include <atomic>
+#include <mutex>
+#include <thread>
+#endif
 
 #ifndef NOFORK
 #include <pwd.h>
@@ -122,3 +130,137 @@ int gerbolyze::run_cargo_command(const char *cmd_name, std::vector<std::string>
 }
 #endif
 
+void gerbolyze::parallel_for(size_t n, std::function<void (size_t)> fun) {
+#ifndef WASI
+    size_t num_threads = std::min<size_t>(n, std::max(1U, std::thread::hardware_concurrency()));
+    if (num_threads > 1) {
+        std::atomic<size_t> next {0};
+        std::exception_ptr error;
+        std::mutex error_mutex;
+        std::vector<std::thread> threads;
+        threads.reserve(num_threads);
+        for (size_t i=0; i<num_threads; i++) {
+            threads.emplace_back([&next, &fun, &error, &error_mutex, n]() {
+                for (size_t j = next++; j < n; j = next++) {
+                    try {
+                        fun(j);
+                    } catch (...) {
+                        std::lock_guard<std::mutex> lk(error_mutex);
+                        if (!error)
+                            error = std::current_exception();
+                        next = n; /* Do not start any more calls */
+                    }
+                }
+            });
+        }
+
+        for (auto &t : threads) {
+            t.join();
+        }
+
+        /* An exception escaping a thread would terminate the program, so pass it on to the caller instead */
+        if (error)
+            std::rethrow_exception(error);
+        return;
+    }
+#endif
+
+    for (size_t i=0; i<n; i++) {
+        fun(i);
+    }
+}
+
+gerbolyze::OrderedBlockWriter::OrderedBlockWriter(std::ostream &out, size_t threads) : m_out(out) {
+#ifndef WASI
+    threads = std::max<size_t>(1, threads);
+    m_max_in_flight = 4 * threads;
+    for (size_t i=0; i<threads; i++) {
+        m_workers.emplace_back(&OrderedBlockWriter::worker, this);
+    }
+    m_writer = std::thread(&OrderedBlockWriter::writer, this);
+#else
+    (void) threads;
+#endif
+}
+
+gerbolyze::OrderedBlockWriter::~OrderedBlockWriter() {
+#ifndef WASI
+    finish();
+    {
+        std::lock_guard<std::mutex> lk(m_mutex);
+        m_stop = true;
+    }
+    m_cv_todo.notify_all();
+    m_cv_done.notify_all();
+
+    for (auto &t : m_workers) {
+        t.join();
+    }
+    m_writer.join();
+#endif
+}
+
+void gerbolyze::OrderedBlockWriter::submit(job_fun job) {
+#ifndef WASI
+    auto block = std::make_shared<Block>();
+    block->job = std::move(job);
+
+    std::unique_lock<std::mutex> lk(m_mutex);
+    m_cv_written.wait(lk, [this]{ return m_in_flight.size() < m_max_in_flight; });
+    m_in_flight.push_back(block);
+    m_todo.push_back(block);
+    lk.unlock();
+    m_cv_todo.notify_one();
+#else
+    std::string text;
+    job(text);
+    m_out.write(text.data(), text.size());
+#endif
+}
+
+void gerbolyze::OrderedBlockWriter::finish() {
+#ifndef WASI
+    std::unique_lock<std::mutex> lk(m_mutex);
+    m_cv_written.wait(lk, [this]{ return m_in_flight.empty(); });
+#endif
+}
+
+#ifndef WASI
+void gerbolyze::OrderedBlockWriter::worker() {
+    std::unique_lock<std::mutex> lk(m_mutex);
+    while (true) {
+        m_cv_todo.wait(lk, [this]{ return m_stop || !m_todo.empty(); });
+        if (m_todo.empty())
+            return;
+
+        auto block = m_todo.front();
+        m_todo.pop_front();
+        lk.unlock();
+
+        block->job(block->text);
+        block->job = nullptr;
+
+        lk.lock();
+        block->done = true;
+        m_cv_done.notify_all();
+    }
+}
+
+void gerbolyze::OrderedBlockWriter::writer() {
+    std::unique_lock<std::mutex> lk(m_mutex);
+    while (true) {
+        m_cv_done.wait(lk, [this]{ return m_stop || (!m_in_flight.empty() && m_in_flight.front()->done); });
+        if (m_in_flight.empty() || !m_in_flight.front()->done)
+            return;
+
+        auto block = m_in_flight.front();
+        lk.unlock();
+
+        m_out.write(block->text.data(), block->text.size());
+
+        lk.lock();
+        m_in_flight.pop_front();
+        m_cv_written.notify_all();
+    }
+}
+#endif
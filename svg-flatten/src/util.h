@@ -20,8 +20,60 @@
 
 #include <vector>
 #include <string>
+#include <functional>
+#include <deque>
+#include <memory>
+#include <ostream>
+#ifndef WASI
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#endif
 
 namespace gerbolyze {
 int run_cargo_command(const char *cmd_name, std::vector<std::string> &cmdline, const char *envvar);
+
+/* Call fun(0) ... fun(n-1) from a pool of worker threads, and return once all calls have finished. Calls may happen in
+ * any order. If a call throws, no further calls are started, and the first exception is rethrown on the calling thread
+ * once the calls still running have finished. In builds without thread support (WASI), this simply runs everything on
+ * the calling thread. */
+void parallel_for(size_t n, std::function<void (size_t)> fun);
+
+/* Runs text formatting jobs on a pool of worker threads, and writes the resulting blocks of text to the output stream
+ * in the order the jobs were submitted. This way, output is identical to running all jobs in sequence. The number of
+ * blocks in flight is bounded, so submit() blocks when the writer falls behind. In builds without thread support
+ * (WASI), jobs simply run inside submit(). */
+class OrderedBlockWriter {
+public:
+    typedef std::function<void (std::string &)> job_fun;
+
+    OrderedBlockWriter(std::ostream &out, size_t threads);
+    ~OrderedBlockWriter();
+    void submit(job_fun job);
+    /* Wait until all blocks submitted so far have been written */
+    void finish();
+
+private:
+    struct Block {
+        job_fun job;
+        std::string text;
+        bool done = false;
+    };
+
+    std::ostream &m_out;
+#ifndef WASI
+    void worker();
+    void writer();
+
+    size_t m_max_in_flight;
+    bool m_stop = false;
+    std::mutex m_mutex;
+    std::condition_variable m_cv_todo, m_cv_done, m_cv_written;
+    std::deque<std::shared_ptr<Block>> m_in_flight; /* in submission order, written from the front */
+    std::deque<std::shared_ptr<Block>> m_todo;
+    std::vector<std::thread> m_workers;
+    std::thread m_writer;
+#endif
+};
 }
 
@@ -22,10 +22,13 @@
 #include <algorithm>
 #include <vector>
 #include <regex>
+#include <map>
 #include "nopencv.hpp"
 #include "svg_import_util.h"
 #include "vec_core.h"
 #include "svg_import_defs.h"
+#include "svg_geom.h"
+#define JC_VORONOI_IMPLEMENTATION
 #include "jc_voronoi.h"
 
 using namespace gerbolyze;
@@ -38,6 +41,14 @@ ImageVectorizer *gerbolyze::makeVectorizer(const std::string &name) {
         return new VoronoiVectorizer(HEXGRID, /* relax */ false);
     else if (name == "square-grid")
         return new VoronoiVectorizer(SQUAREGRID, /* relax */ false);
+    else if (name == "adaptive-poisson-disc")
+        return new VoronoiVectorizer(POISSON_DISC, /* relax */ true, /* adaptive */ true);
+    else if (name == "adaptive-hex-grid")
+        return new VoronoiVectorizer(HEXGRID, /* relax */ false, /* adaptive */ true);
+    else if (name == "auto")
+        return new AutoVectorizer();
+    else if (name == "blue-noise")
+        return new BlueNoiseVectorizer();
     else if (name == "binary-contours")
         return new OpenCVContoursVectorizer();
     else if (name == "dev-null")
@@ -68,6 +79,40 @@ static void voronoi_relax_points(const jcv_diagram* diagram, jcv_point* points)
     }
 } 
 
+/* Clip a polygon against the render context's clip path and export it. Most polygons of a vectorized image lie
+ * entirely inside the clip path, so we first look them up in a coarse clip mask and only run Clipper on those that
+ * cross the clip path's boundary. This is *much* faster than running Clipper on each polygon. Running Clipper once on
+ * all polygons is worse still. */
+static void clip_and_export(RenderContext &ctx, const ClipMask &mask, ClipperLib::Path &path) {
+    ClipperLib::Paths polys;
+    switch (mask.classify(path)) {
+        case ClipMask::OUTSIDE:
+            return;
+
+        case ClipMask::INSIDE:
+            /* Still clean up the polygon like clipping it would */
+            simplify_polygon(path, polys);
+            break;
+
+        case ClipMask::BOUNDARY:
+            ClipperLib::Clipper c;
+            c.AddPath(path, ClipperLib::ptSubject, /* closed */ true);
+            c.AddPaths(ctx.clip(), ClipperLib::ptClip, /* closed */ true);
+            c.StrictlySimple(true);
+            c.Execute(ClipperLib::ctIntersection, polys, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
+            break;
+    }
+
+    for (const auto &poly : polys) {
+        vector<array<double, 2>> out;
+        for (const auto &p : poly)
+            out.push_back(std::array<double, 2>{
+                    ((double)p.X) / clipper_scale, ((double)p.Y) / clipper_scale
+                    });
+        ctx.sink() << std::move(out);
+    }
+}
+
 void gerbolyze::parse_img_meta(const pugi::xml_node &node, double &x, double &y, double &width, double &height) {
     /* Read XML node attributes */
     x = usvg_double_attr(node, "x", 0.0);
@@ -132,7 +177,7 @@ void gerbolyze::draw_bg_rect(RenderContext &ctx, double width, double height) {
             out.push_back(std::array<double, 2>{
                     ((double)p.X) / clipper_scale, ((double)p.Y) / clipper_scale
                     });
-        ctx.sink() << GRB_POL_CLEAR << out;
+        ctx.sink() << GRB_POL_CLEAR << std::move(out);
     }
 }
 
@@ -157,12 +202,17 @@ void gerbolyze::draw_bg_rect(RenderContext &ctx, double width, double height) {
  *    cell.
  */
 void gerbolyze::VoronoiVectorizer::vectorize_image(RenderContext &ctx, const pugi::xml_node &node, double min_feature_size_px) {
-    double x, y, width, height;
-    parse_img_meta(node, x, y, width, height);
     nopencv::Image32f *img = img_from_node<float>(node);
     if (img == nullptr)
         return;
 
+    vectorize_image(ctx, node, img, min_feature_size_px);
+}
+
+void gerbolyze::VoronoiVectorizer::vectorize_image(RenderContext &ctx, const pugi::xml_node &node, nopencv::Image32f *img, double min_feature_size_px) {
+    double x, y, width, height;
+    parse_img_meta(node, x, y, width, height);
+
     /* Set up target transform using SVG transform and x/y attributes */
     RenderContext img_ctx(ctx, xform2d(1, 0, 0, 1, x, y));
     cerr << "voronoi vectorizer: local_xf = " << ctx.mat().dbg_str() << endl;
@@ -177,8 +227,6 @@ void gerbolyze::VoronoiVectorizer::vectorize_image(RenderContext &ctx, const pug
             scale_x, scale_y, off_x, off_y, orig_cols, orig_rows);
     //cerr << "aspect " << scale_x << ", " << scale_y << " / " << off_x << ", " << off_y << endl;
 
-    /* Adjust minimum feature size given in mm and translate into px document units in our local coordinate system. */
-    min_feature_size_px = img_ctx.mat().doc2phys_dist(min_feature_size_px);
     cerr << "  min_feature_size_px = " << min_feature_size_px << endl;
 
     draw_bg_rect(img_ctx, width, height);
@@ -189,10 +237,6 @@ void gerbolyze::VoronoiVectorizer::vectorize_image(RenderContext &ctx, const pug
                                         grayscale interpolation. Larger values -> better grayscale resolution,
                                         larger cells. */
     double center_distance = min_feature_size_px * 2.0 * (1.0 / (1.0-grayscale_overhead));
-    vector<d2p> *grid_centers = get_sampler(m_grid_type)(scale_x * orig_cols, scale_y*orig_rows, center_distance);
-    //vector<d2p> *grid_centers = sample_poisson_disc(width, height, min_feature_size_px * 2.0 * 2.0);
-    //vector<d2p> *grid_centers = sample_hexgrid(width, height, center_distance);
-    //vector<d2p> *grid_centers = sample_squaregrid(width, height, center_distance);
 
     /* Target factor between given min_feature_size and intermediate image pixels,
      * i.e. <scale_featuresize_factor> px ^= min_feature_size */
@@ -212,6 +256,19 @@ void gerbolyze::VoronoiVectorizer::vectorize_image(RenderContext &ctx, const pug
         blur_size += 1;
     cerr << "blur size " << blur_size << endl;
     img->blur(blur_size);
+
+    vector<jcv_point> grid_centers;
+    /* Nominal center distance of each grid point's cell, used for dropping blobs that would come out too small below. */
+    vector<double> cell_sizes;
+    if (m_adaptive) {
+        sample_adaptive(*img, scale_x * orig_cols, scale_y * orig_rows, center_distance, get_sampler(m_grid_type),
+                ctx.settings().vectorizer_seed, grid_centers, cell_sizes);
+        cerr << "adaptive sampling: " << grid_centers.size() << " cells" << endl;
+    } else {
+        get_sampler(m_grid_type)(grid_centers, scale_x * orig_cols, scale_y*orig_rows, center_distance,
+                ctx.settings().vectorizer_seed, nullptr);
+        cell_sizes.resize(grid_centers.size(), center_distance);
+    }
     
     /* Calculate voronoi diagram for the grid generated above. */
     jcv_diagram diagram;
@@ -219,13 +276,12 @@ void gerbolyze::VoronoiVectorizer::vectorize_image(RenderContext &ctx, const pug
     cerr << "adjusted scale " << scale_x << " " << scale_y << endl;
     cerr << "voronoi clip rect " << (scale_x * orig_cols) << " " << (scale_y * orig_rows) << endl;
     jcv_rect rect {{0.0, 0.0}, {scale_x * orig_cols, scale_y * orig_rows}};
-    jcv_point *pts = reinterpret_cast<jcv_point *>(grid_centers->data()); /* hackety hack */
-    jcv_diagram_generate(grid_centers->size(), pts, &rect, 0, &diagram);
+    jcv_diagram_generate(grid_centers.size(), grid_centers.data(), &rect, 0, &diagram);
     /* Relax points, i.e. wiggle them around a little bit to equalize differences between cell sizes a little bit. */
     if (m_relax)
-        voronoi_relax_points(&diagram, pts);
+        voronoi_relax_points(&diagram, grid_centers.data());
     memset(&diagram, 0, sizeof(jcv_diagram));
-    jcv_diagram_generate(grid_centers->size(), pts, &rect, 0, &diagram);
+    jcv_diagram_generate(grid_centers.size(), grid_centers.data(), &rect, 0, &diagram);
     
     /* For each voronoi cell calculated above, find the brightness of the blurred image pixel below its center. We do
      * not have to average over the entire cell's area here: The blur is doing a good approximation of that while being
@@ -250,6 +306,15 @@ void gerbolyze::VoronoiVectorizer::vectorize_image(RenderContext &ctx, const pug
             fill_factors[sites[i].index] = sqrt(pxd);
     }
 
+    /* Cells whose halftone blob covers the entire cell after gap filling. In dark areas of the image these tile the
+     * area. Instead of exporting them one by one, we collect them here and merge all connected ones into a single
+     * polygon below. */
+    vector<ClipperLib::Path> solid_cells(diagram.numsites);
+    vector<const jcv_site *> solid_sites;
+
+    ClipMask clip_mask(img_ctx.clip());
+    img_ctx.sink() << GRB_POL_DARK;
+
     /* Minimum gap between adjacent scaled site polygons. */
     double min_gap_px = min_feature_size_px;
     vector<double> adjusted_fill_factors;
@@ -262,7 +327,7 @@ void gerbolyze::VoronoiVectorizer::vectorize_image(RenderContext &ctx, const pug
         double fill_factor_ours = fill_factors[sites[i].index];
         
         /* Do not render halftone blobs that are too small */
-        if (fill_factor_ours * 0.5 * center_distance < min_gap_px)
+        if (fill_factor_ours * 0.5 * cell_sizes[sites[i].index] < min_gap_px)
             continue;
 
         /* Iterate over this cell's edges. For each edge, check the gap that would result between this cell's halftone
@@ -297,6 +362,9 @@ void gerbolyze::VoronoiVectorizer::vectorize_image(RenderContext &ctx, const pug
             e = e->next;
         }
 
+        bool solid = all_of(adjusted_fill_factors.begin(), adjusted_fill_factors.end(),
+                [](double f) { return f >= 1.0; });
+
         //cerr << "  blob: ";
         /* Now, generate the actual halftone blob polygon */
         ClipperLib::Path cell_path;
@@ -336,30 +404,79 @@ void gerbolyze::VoronoiVectorizer::vectorize_image(RenderContext &ctx, const pug
         }
         //cerr << endl;
 
-        /* Now, clip the halftone blob generated above against the given clip path. We do this individually for each
-         * blob since this way is *much* faster than throwing a million blobs at once at poor clipper. */
-        ClipperLib::Paths polys;
+        if (solid) {
+            solid_cells[sites[i].index] = std::move(cell_path);
+            solid_sites.push_back(&sites[i]);
+            continue;
+        }
+
+        /* Now, clip the halftone blob generated above against the given clip path and export it. */
+        clip_and_export(img_ctx, clip_mask, cell_path);
+    }
+
+    /* Merge solid cells into one polygon per connected region. Adjacent voronoi cells share their edge vertices
+     * exactly, so the union comes out clean. Since the merged region may have holes, we have to dehole it before
+     * export.
+     *
+     * A large dark area would otherwise become a single union over all of its cells, so like the region merger, we
+     * bound the size of each union. Regions are grown breadth-first so they stay compact, and they stop growing at
+     * max_region_cells. The rest of a connected area is picked up by the following regions. Adjacent regions touch
+     * without overlapping. */
+    constexpr size_t max_region_cells = 1024;
+    size_t num_regions = 0;
+    vector<const jcv_site *> todo;
+    ClipperLib::Paths region;
+    for (const jcv_site *start : solid_sites) {
+        if (solid_cells[start->index].empty()) /* already merged into an earlier region */
+            continue;
+
+        region.clear();
+        todo.clear();
+        todo.push_back(start);
+        region.push_back(std::move(solid_cells[start->index]));
+        solid_cells[start->index].clear();
+        for (size_t next = 0; next < todo.size() && region.size() < max_region_cells; next++) {
+            for (const jcv_graphedge *e = todo[next]->edges; e && region.size() < max_region_cells; e = e->next) {
+                if (e->neighbor == nullptr || solid_cells[e->neighbor->index].empty())
+                    continue;
+
+                region.push_back(std::move(solid_cells[e->neighbor->index]));
+                solid_cells[e->neighbor->index].clear();
+                todo.push_back(e->neighbor);
+            }
+        }
+        num_regions++;
+
+        auto loc = clip_mask.classify(region);
+        if (loc == ClipMask::OUTSIDE)
+            continue;
+
         ClipperLib::Clipper c;
-        c.AddPath(cell_path, ClipperLib::ptSubject, /* closed */ true);
-        if (!img_ctx.clip().empty()) {
+        c.AddPaths(region, ClipperLib::ptSubject, /* closed */ true);
+        ClipperLib::PolyTree ptree;
+        if (loc == ClipMask::BOUNDARY) {
             c.AddPaths(img_ctx.clip(), ClipperLib::ptClip, /* closed */ true);
+            c.StrictlySimple(true);
+            c.Execute(ClipperLib::ctIntersection, ptree, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
+        } else {
+            c.StrictlySimple(true);
+            c.Execute(ClipperLib::ctUnion, ptree, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
         }
-        c.StrictlySimple(true);
-        c.Execute(ClipperLib::ctIntersection, polys, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
 
-        /* Export halftone blob to gerber. */
+        ClipperLib::Paths polys;
+        dehole_polytree(ptree, polys);
         for (const auto &poly : polys) {
             vector<array<double, 2>> out;
             for (const auto &p : poly)
                 out.push_back(std::array<double, 2>{
                         ((double)p.X) / clipper_scale, ((double)p.Y) / clipper_scale
                         });
-            img_ctx.sink() << GRB_POL_DARK << out;
+            img_ctx.sink() << std::move(out);
         }
     }
+    cerr << "merged " << solid_sites.size() << " solid cells into " << num_regions << " regions" << endl;
 
     jcv_diagram_free( &diagram );
-    delete grid_centers;
     delete img;
 }
 
@@ -416,13 +533,24 @@ void gerbolyze::handle_aspect_ratio(string spec, double &scale_x, double &scale_
 
 
 void gerbolyze::OpenCVContoursVectorizer::vectorize_image(RenderContext &ctx, const pugi::xml_node &node, double min_feature_size_px) {
-    (void) min_feature_size_px; /* unused by this vectorizer */
-    double x, y, width, height;
-    parse_img_meta(node, x, y, width, height);
     nopencv::Image32 *img = img_from_node<int32_t>(node);
     if (img == nullptr)
         return;
 
+    vectorize_image(ctx, node, img, min_feature_size_px);
+}
+
+void gerbolyze::OpenCVContoursVectorizer::vectorize_image(RenderContext &ctx, const pugi::xml_node &node, nopencv::Image32f *img, double min_feature_size_px) {
+    nopencv::Image32 *img_i = new nopencv::Image32(*img);
+    delete img;
+    vectorize_image(ctx, node, img_i, min_feature_size_px);
+}
+
+void gerbolyze::OpenCVContoursVectorizer::vectorize_image(RenderContext &ctx, const pugi::xml_node &node, nopencv::Image32 *img, double min_feature_size_px) {
+    (void) min_feature_size_px; /* unused by this vectorizer */
+    double x, y, width, height;
+    parse_img_meta(node, x, y, width, height);
+
     /* Set up target transform using SVG transform and x/y attributes */
     RenderContext img_ctx(ctx, xform2d(1, 0, 0, 1, x, y));
 
@@ -435,10 +563,12 @@ void gerbolyze::OpenCVContoursVectorizer::vectorize_image(RenderContext &ctx, co
 
     draw_bg_rect(img_ctx, width, height);
 
+    ClipMask clip_mask(img_ctx.clip());
+
     img->binarize(128);
     nopencv::find_contours(*img,
             nopencv::simplify_contours_douglas_peucker(
-                [&img_ctx, off_x, off_y, scale_x, scale_y](Polygon_i& poly, nopencv::ContourPolarity pol) {
+                [&img_ctx, &clip_mask, off_x, off_y, scale_x, scale_y](Polygon_i& poly, nopencv::ContourPolarity pol) {
 
         if (pol == nopencv::CP_HOLE) {
             std::reverse(poly.begin(), poly.end());
@@ -460,25 +590,241 @@ void gerbolyze::OpenCVContoursVectorizer::vectorize_image(RenderContext &ctx, co
             });
         }
 
-        ClipperLib::Clipper c;
-        c.AddPath(out, ClipperLib::ptSubject, /* closed */ true);
-        if (!img_ctx.clip().empty()) {
-            c.AddPaths(img_ctx.clip(), ClipperLib::ptClip, /* closed */ true);
+        clip_and_export(img_ctx, clip_mask, out);
+    }));
+
+    delete img;
+}
+
+/* Render image into gerber file using ordered dithering against a blue noise threshold mask.
+ *
+ * This is a much faster alternative to the voronoi vectorizer, that runs in time linear in the number of pixels. The
+ * image is resampled to a grid with a pitch of one minimum feature size, and each grid cell is set if the image's
+ * brightness there exceeds the corresponding threshold from a tiled blue noise mask.
+ *
+ * Since every set cell and every gap between set cells is at least one grid pitch wide, the result respects the
+ * minimum feature size with one exception: Two cells touching only at a corner. We fix those up by filling in one
+ * of the two empty cells at that corner.
+ *
+ * Horizontal runs of set cells are exported as rectangles. Runs that are identical across adjacent rows are merged into
+ * one rectangle. Isolated cells are exported as flashes of a round aperture if the sink supports that.
+ */
+void gerbolyze::BlueNoiseVectorizer::vectorize_image(RenderContext &ctx, const pugi::xml_node &node, double min_feature_size_px) {
+    nopencv::Image32f *img = img_from_node<float>(node);
+    if (img == nullptr)
+        return;
+
+    vectorize_image(ctx, node, img, min_feature_size_px);
+}
+
+void gerbolyze::BlueNoiseVectorizer::vectorize_image(RenderContext &ctx, const pugi::xml_node &node, nopencv::Image32f *img, double min_feature_size_px) {
+    double x, y, width, height;
+    parse_img_meta(node, x, y, width, height);
+
+    /* Set up target transform using SVG transform and x/y attributes */
+    RenderContext img_ctx(ctx, xform2d(1, 0, 0, 1, x, y));
+
+    double orig_rows = img->rows();
+    double orig_cols = img->cols();
+    double scale_x = (double)width / orig_cols;
+    double scale_y = (double)height / orig_rows;
+    double off_x = 0;
+    double off_y = 0;
+    handle_aspect_ratio(node.attribute("preserveAspectRatio").value(),
+            scale_x, scale_y, off_x, off_y, orig_cols, orig_rows);
+
+    cerr << "blue noise vectorizer: min_feature_size_px = " << min_feature_size_px << endl;
+
+    draw_bg_rect(img_ctx, width, height);
+
+    /* Resample image to one pixel per grid cell. Round the cell count down so cells never get smaller than the minimum
+     * feature size. */
+    double img_w = scale_x * orig_cols, img_h = scale_y * orig_rows;
+    int cols = max(1, (int)floor(img_w / min_feature_size_px));
+    int rows = max(1, (int)floor(img_h / min_feature_size_px));
+    double pitch_x = img_w / cols, pitch_y = img_h / rows;
+    img->resize(cols, rows);
+    cerr << "  grid " << cols << "x" << rows << ", pitch " << pitch_x << ", " << pitch_y << endl;
+
+    const vector<double> &mask = blue_noise_mask();
+    vector<uint8_t> cells((size_t)cols * rows);
+    for (int j=0; j<rows; j++) {
+        for (int i=0; i<cols; i++) {
+            double threshold = mask[(j % blue_noise_mask_size) * blue_noise_mask_size + (i % blue_noise_mask_size)];
+            cells[(size_t)j*cols + i] = img->at(i, j) / 255.0 > threshold;
         }
-        c.StrictlySimple(true);
-        ClipperLib::Paths polys;
-        c.Execute(ClipperLib::ctIntersection, polys, ClipperLib::pftNonZero, ClipperLib::pftNonZero);
+    }
 
-        /* Draw into gerber. */
-        for (const auto &poly : polys) {
-            vector<array<double, 2>> out;
-            for (const auto &p : poly)
-                out.push_back(std::array<double, 2>{
-                        ((double)p.X) / clipper_scale, ((double)p.Y) / clipper_scale
-                        });
-            img_ctx.sink() << out;
+    fix_diagonal_cells(cells, cols, rows);
+    auto cell = [&](int i, int j) -> uint8_t & { return cells[(size_t)j*cols + i]; };
+
+    ClipMask clip_mask(img_ctx.clip());
+    img_ctx.sink() << GRB_POL_DARK;
+
+    auto cell_rect = [&](int i0, int j0, int i1, int j1) {
+        ClipperLib::Path out;
+        for (auto [px, py] : {pair{i0, j0}, pair{i1, j0}, pair{i1, j1}, pair{i0, j1}}) {
+            d2p p = img_ctx.mat().doc2phys(d2p{off_x + px * pitch_x, off_y + py * pitch_y});
+            out.push_back({
+                    (ClipperLib::cInt)round(p[0] * clipper_scale),
+                    (ClipperLib::cInt)round(p[1] * clipper_scale)
+            });
         }
-    }));
+        return out;
+    };
+
+    /* Flashes only work when cells stay round after transformation */
+    double flash_dia = min(pitch_x, pitch_y);
+    bool use_flashes = img_ctx.sink().can_do_apertures()
+        && ctx.settings().do_gerber_interpolation
+        && img_ctx.mat().doc2phys_skew_ok(flash_dia, 0.05, ctx.settings().geometric_tolerance_mm);
+    double flash_aperture = img_ctx.mat().doc2phys_dist(flash_dia);
+    /* Polygons are exported as regions, and not stroked, only while no aperture is set. */
+    bool aperture_set = false;
+    img_ctx.sink() << ApertureToken();
+
+    /* Open rectangles, keyed by their run's first and last column, with their start row as value. */
+    map<pair<int, int>, int> open_runs, next_runs;
+    size_t num_rects = 0, num_flashes = 0;
+    auto close_run = [&](int i0, int i1, int j0, int j1) {
+        ClipperLib::Path rect = cell_rect(i0, j0, i1+1, j1);
+        bool isolated = i0 == i1 && j1 == j0+1
+            && (j0 == 0 || !cell(i0, j0-1)) && (j1 == rows || !cell(i0, j1));
+
+        if (use_flashes && isolated && clip_mask.classify(rect) == ClipMask::INSIDE) {
+            if (!aperture_set) {
+                img_ctx.sink() << ApertureToken(flash_aperture);
+                aperture_set = true;
+            }
+            img_ctx.sink() << FlashToken(img_ctx.mat().doc2phys(d2p{
+                        off_x + (i0 + 0.5) * pitch_x,
+                        off_y + (j0 + 0.5) * pitch_y}));
+            num_flashes++;
+            return;
+        }
+
+        if (aperture_set) {
+            img_ctx.sink() << ApertureToken();
+            aperture_set = false;
+        }
+        clip_and_export(img_ctx, clip_mask, rect);
+        num_rects++;
+    };
+
+    for (int j=0; j<=rows; j++) {
+        next_runs.clear();
+        for (int i=0; j<rows && i<cols;) {
+            if (!cell(i, j)) {
+                i++;
+                continue;
+            }
+
+            int i0 = i;
+            while (i<cols && cell(i, j))
+                i++;
+            pair<int, int> key{i0, i-1};
+
+            auto it = open_runs.find(key);
+            if (it != open_runs.end()) {
+                next_runs[key] = it->second;
+                open_runs.erase(it);
+            } else {
+                next_runs[key] = j;
+            }
+        }
+
+        for (const auto &[key, start] : open_runs) {
+            close_run(key.first, key.second, start, j);
+        }
+        open_runs.swap(next_runs);
+    }
+
+    if (aperture_set) {
+        img_ctx.sink() << ApertureToken();
+    }
+    cerr << "  exported " << num_rects << " rectangles and " << num_flashes << " flashes" << endl;
+
+    delete img;
+}
+
+/* Pick a vectorizer for an image based on its brightness histogram.
+ *
+ * Images that consist of (almost) only two brightness levels such as logos go to the contour vectorizer, which is
+ * orders of magnitude faster than halftoning and gives a much cleaner result on these. Continuous-tone images get
+ * halftoned. Images of a single black or white level are drawn as a plain rectangle without any vectorization.
+ */
+void gerbolyze::AutoVectorizer::vectorize_image(RenderContext &ctx, const pugi::xml_node &node, double min_feature_size_px) {
+    nopencv::Image32f *img = img_from_node<float>(node);
+    if (img == nullptr)
+        return;
+
+    /* Fraction of pixels that must be near black or white for an image to be considered bilevel. This leaves room for
+     * antialiased edges. */
+    constexpr double bilevel_fraction = 0.97;
+    /* Fraction of pixels that must be near either black or white for an image to be considered uniform. */
+    constexpr double uniform_fraction = 0.999;
+    constexpr int dark_max = 32, bright_min = 224;
+
+    const auto &hist = img->histogram();
+    double total = img->size();
+    double dark = 0, bright = 0;
+    for (int i=0; i<=dark_max; i++)
+        dark += hist[i];
+    for (int i=bright_min; i<256; i++)
+        bright += hist[i];
+
+    if (total == 0) {
+        delete img;
+        return;
+    }
+
+    if (dark / total >= uniform_fraction || bright / total >= uniform_fraction) {
+        cerr << "auto vectorizer: uniform " << (dark > bright ? "dark" : "bright") << " image" << endl;
+        draw_uniform_image(ctx, node, img, bright > dark);
+        delete img;
+
+    } else if ((dark + bright) / total >= bilevel_fraction) {
+        cerr << "auto vectorizer: bilevel image, using binary-contours" << endl;
+        OpenCVContoursVectorizer().vectorize_image(ctx, node, img, min_feature_size_px);
+
+    } else {
+        cerr << "auto vectorizer: continuous-tone image, using poisson-disc" << endl;
+        VoronoiVectorizer(POISSON_DISC, /* relax */ true).vectorize_image(ctx, node, img, min_feature_size_px);
+    }
+}
+
+/* Render an image of a single black or white level. Like the other vectorizers, we first clear the image's bounding
+ * box. For a white image, we then fill the area covered by the image's pixels. */
+void gerbolyze::AutoVectorizer::draw_uniform_image(RenderContext &ctx, const pugi::xml_node &node, nopencv::Image32f *img, bool bright) {
+    double x, y, width, height;
+    parse_img_meta(node, x, y, width, height);
+    RenderContext img_ctx(ctx, xform2d(1, 0, 0, 1, x, y));
+    draw_bg_rect(img_ctx, width, height);
+
+    if (!bright)
+        return;
+
+    double scale_x = (double)width / (double)img->cols();
+    double scale_y = (double)height / (double)img->rows();
+    double off_x = 0;
+    double off_y = 0;
+    handle_aspect_ratio(node.attribute("preserveAspectRatio").value(),
+            scale_x, scale_y, off_x, off_y, img->cols(), img->rows());
+
+    ClipperLib::Path rect;
+    for (auto [px, py] : {pair{0, 0}, pair{1, 0}, pair{1, 1}, pair{0, 1}}) {
+        d2p p = img_ctx.mat().doc2phys(d2p{
+                off_x + px * scale_x * img->cols(),
+                off_y + py * scale_y * img->rows()});
+        rect.push_back({
+                (ClipperLib::cInt)round(p[0] * clipper_scale),
+                (ClipperLib::cInt)round(p[1] * clipper_scale)
+        });
+    }
+
+    ClipMask clip_mask(img_ctx.clip());
+    img_ctx.sink() << GRB_POL_DARK;
+    clip_and_export(img_ctx, clip_mask, rect);
 }
 
 gerbolyze::VectorizerSelectorizer::VectorizerSelectorizer(const string default_vectorizer, const string defs)
@@ -22,16 +22,21 @@
 #include <clipper.hpp>
 #include <gerbolyze.hpp>
 #include "vec_grid.h"
+#include "nopencv.hpp"
 
 namespace gerbolyze {
 
     class VoronoiVectorizer : public ImageVectorizer {
     public:
-        VoronoiVectorizer(grid_type grid, bool relax=true) : m_relax(relax), m_grid_type(grid) {}
+        VoronoiVectorizer(grid_type grid, bool relax=true, bool adaptive=false)
+            : m_relax(relax), m_adaptive(adaptive), m_grid_type(grid) {}
 
         virtual void vectorize_image(RenderContext &ctx, const pugi::xml_node &node, double min_feature_size_px);
+        /* Vectorize an already decoded image. Takes ownership of img. */
+        void vectorize_image(RenderContext &ctx, const pugi::xml_node &node, nopencv::Image32f *img, double min_feature_size_px);
     private:
         double m_relax;
+        bool m_adaptive;
         grid_type m_grid_type;
     };
 
@@ -40,6 +45,27 @@ namespace gerbolyze {
         OpenCVContoursVectorizer() {}
 
         virtual void vectorize_image(RenderContext &ctx, const pugi::xml_node &node, double min_feature_size_px);
+        /* Vectorize an already decoded image. Takes ownership of img. */
+        void vectorize_image(RenderContext &ctx, const pugi::xml_node &node, nopencv::Image32f *img, double min_feature_size_px);
+        void vectorize_image(RenderContext &ctx, const pugi::xml_node &node, nopencv::Image32 *img, double min_feature_size_px);
+    };
+
+    class BlueNoiseVectorizer : public ImageVectorizer {
+    public:
+        BlueNoiseVectorizer() {}
+
+        virtual void vectorize_image(RenderContext &ctx, const pugi::xml_node &node, double min_feature_size_px);
+        /* Vectorize an already decoded image. Takes ownership of img. */
+        void vectorize_image(RenderContext &ctx, const pugi::xml_node &node, nopencv::Image32f *img, double min_feature_size_px);
+    };
+
+    class AutoVectorizer : public ImageVectorizer {
+    public:
+        AutoVectorizer() {}
+
+        virtual void vectorize_image(RenderContext &ctx, const pugi::xml_node &node, double min_feature_size_px);
+    private:
+        void draw_uniform_image(RenderContext &ctx, const pugi::xml_node &node, nopencv::Image32f *img, bool bright);
     };
 
     class DevNullVectorizer : public ImageVectorizer {
@@ -16,9 +16,13 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include "poisson_disk_sampling.h"
+#include <cmath>
+#include <random>
+#include <numbers>
+#include <algorithm>
 
 #include "vec_grid.h"
+#include "util.h"
 
 using namespace std;
 using namespace gerbolyze;
@@ -36,13 +40,170 @@ sampling_fun gerbolyze::get_sampler(enum grid_type type) {
     }
 }
 
-vector<d2p> *gerbolyze::sample_poisson_disc(double w, double h, double center_distance) {
-    d2p top_left {0, 0};
-    d2p bottom_right {w, h};
-    return new auto(thinks::PoissonDiskSampling(center_distance/2.5, top_left, bottom_right));
+/* Grid-partitioned parallel poisson-disc sampling.
+ *
+ * This is Bridson's algorithm ("Fast Poisson Disk Sampling in Arbitrary Dimensions", SIGGRAPH 2007) run independently
+ * on square tiles of the output area. The tiles are processed in four phases like the four colors of a 2x2
+ * checkerboard. Tiles of the same phase are always separated by at least one whole tile of another phase. Since a tile
+ * is at least as wide as the minimum point distance, tiles of the same phase can never see each other's points and can
+ * be sampled in parallel. Tiles of later phases see and respect the points of all neighboring tiles of earlier phases.
+ *
+ * Every tile gets its own random generator seeded from the given seed and the tile's index. This makes the output only
+ * depend on the seed, and not on the number of threads or on their scheduling.
+ *
+ * With a mask, tiles that do not touch any set mask cell are skipped entirely, and darts are only thrown into the set
+ * parts of a tile. This way, the cost of sampling scales with the masked area instead of the whole area.
+ */
+void gerbolyze::sample_poisson_disc(vector<jcv_point> &out, double w, double h, double center_distance, unsigned int seed,
+        const SamplingMask *mask) {
+    /* minimum distance between two points */
+    double radius = center_distance / 2.5;
+    /* Number of candidate points that are tried around each active point before it is retired. */
+    constexpr int max_attempts = 30;
+    /* Background grid cell size. At this size, each grid cell can contain at most one point. */
+    double cell = radius / sqrt(2.0);
+    /* Tile size in grid cells. Must be at least ceil(radius / cell) == 2. */
+    constexpr long long int tile_cells = 32;
+
+    if (!(w > 0 && h > 0 && radius > 0)) {
+        return;
+    }
+
+    long long int grid_w = (long long int)ceil(w / cell);
+    long long int grid_h = (long long int)ceil(h / cell);
+    long long int tiles_x = (grid_w + tile_cells - 1) / tile_cells;
+    long long int tiles_y = (grid_h + tile_cells - 1) / tile_cells;
+
+    /* The background grid is shared between all tiles. During a phase, each tile only writes to the grid cells inside
+     * it, and only reads grid cells of itself and of its direct neighbors, none of which belong to the same phase. */
+    vector<jcv_point> grid(grid_w * grid_h);
+    vector<uint8_t> occupied(grid_w * grid_h, 0);
+    vector<vector<jcv_point>> tile_points(tiles_x * tiles_y);
+
+    auto fits = [&](double x, double y) {
+        long long int gx = (long long int)(x / cell), gy = (long long int)(y / cell);
+        for (long long int j = max(0LL, gy-2); j <= min(grid_h-1, gy+2); j++) {
+            for (long long int i = max(0LL, gx-2); i <= min(grid_w-1, gx+2); i++) {
+                /* Points in the four corner cells are always at least radius away. */
+                if (abs(i - gx) == 2 && abs(j - gy) == 2)
+                    continue;
+
+                if (!occupied[j*grid_w + i])
+                    continue;
+
+                const jcv_point &q = grid[j*grid_w + i];
+                if ((q.x - x)*(q.x - x) + (q.y - y)*(q.y - y) < radius*radius)
+                    return false;
+            }
+        }
+        return true;
+    };
+
+    auto sample_tile = [&](long long int tile_x, long long int tile_y) {
+        size_t tile_idx = tile_y * tiles_x + tile_x;
+        seed_seq seq {seed, (unsigned int)tile_x, (unsigned int)tile_y};
+        mt19937_64 rng(seq);
+        uniform_real_distribution<double> uni(0.0, 1.0);
+
+        double x0 = tile_x * tile_cells * cell, y0 = tile_y * tile_cells * cell;
+        double x1 = min(w, (tile_x + 1) * tile_cells * cell), y1 = min(h, (tile_y + 1) * tile_cells * cell);
+
+        vector<array<double, 4>> dart_rects;
+        if (mask) {
+            mask->rects(x0, y0, x1, y1, dart_rects);
+            if (dart_rects.empty()) {
+                return;
+            }
+        }
+
+        vector<jcv_point> &pts = tile_points[tile_idx];
+        vector<jcv_point> active;
+
+        auto insert = [&](double x, double y) {
+            long long int gx = (long long int)(x / cell), gy = (long long int)(y / cell);
+            grid[gy*grid_w + gx] = {x, y};
+            occupied[gy*grid_w + gx] = 1;
+            pts.push_back({x, y});
+            active.push_back({x, y});
+        };
+
+        /* Since tiles can start out partially covered by their neighbors' points, we cannot use a single seed point. Keep
+         * throwing darts until we miss max_attempts times in a row, and grow each dart that hits. */
+        for (int misses = 0; misses < max_attempts;) {
+            double x, y;
+            if (mask) {
+                const auto &r = dart_rects[uniform_int_distribution<size_t>(0, dart_rects.size()-1)(rng)];
+                x = r[0] + uni(rng) * (r[2] - r[0]);
+                y = r[1] + uni(rng) * (r[3] - r[1]);
+            } else {
+                x = x0 + uni(rng) * (x1 - x0);
+                y = y0 + uni(rng) * (y1 - y0);
+            }
+
+            if (!fits(x, y)) {
+                misses++;
+                continue;
+            }
+
+            misses = 0;
+            insert(x, y);
+
+            while (!active.empty()) {
+                size_t i = uniform_int_distribution<size_t>(0, active.size()-1)(rng);
+                jcv_point p = active[i];
+
+                bool found = false;
+                for (int k=0; k<max_attempts; k++) {
+                    /* Pick a candidate from the annulus between radius and 2*radius around p. */
+                    double theta = uni(rng) * 2 * std::numbers::pi;
+                    double r = radius * (1.0 + uni(rng));
+                    double cx = p.x + r * cos(theta), cy = p.y + r * sin(theta);
+
+                    if (cx < x0 || cx >= x1 || cy < y0 || cy >= y1)
+                        continue;
+
+                    if (mask && !mask->contains(cx, cy))
+                        continue;
+
+                    if (fits(cx, cy)) {
+                        insert(cx, cy);
+                        found = true;
+                        break;
+                    }
+                }
+
+                if (!found) {
+                    active[i] = active.back();
+                    active.pop_back();
+                }
+            }
+        }
+    };
+
+    for (int phase=0; phase<4; phase++) {
+        long long int phase_x = phase % 2, phase_y = phase / 2;
+        long long int n_x = (tiles_x - phase_x + 1) / 2;
+        long long int n_y = (tiles_y - phase_y + 1) / 2;
+
+        parallel_for(n_x * n_y, [&](size_t i) {
+            sample_tile(phase_x + 2 * (i % n_x), phase_y + 2 * (i / n_x));
+        });
+    }
+
+    size_t total = 0;
+    for (auto &pts : tile_points) {
+        total += pts.size();
+    }
+
+    out.reserve(out.size() + total);
+    for (auto &pts : tile_points) {
+        out.insert(out.end(), pts.begin(), pts.end());
+    }
 }
 
-vector<d2p> *gerbolyze::sample_hexgrid(double w, double h, double center_distance) {
+/* Grid samplers are cheap, so with a mask we simply drop the points outside of it. */
+void gerbolyze::sample_hexgrid(vector<jcv_point> &out, double w, double h, double center_distance, unsigned int,
+        const SamplingMask *mask) {
     double radius = center_distance / 2.0 / (sqrt(3) / 2.0); /* radius of hexagon */
     double pitch_v = 1.5 * radius;
     double pitch_h = center_distance;
@@ -57,25 +218,27 @@ vector<d2p> *gerbolyze::sample_hexgrid(double w, double h, double center_distanc
     long long int points_x = floor(w / pitch_h);
     long long int points_y = floor(h / pitch_v);
 
-    vector<d2p> *out = new vector<d2p>();
-    out->reserve((points_x+1) * points_y);
+    out.reserve(out.size() + (points_x+1) * points_y);
 
     /* This may generate up to one extra row of points. We don't care since these points will simply be clipped during
      * voronoi map generation. */
     for (long long int y_i=0; y_i<points_y; y_i+=2) {
         for (long long int x_i=0; x_i<points_x; x_i++) { /* allow one extra point to compensate for row shift */
-            out->push_back(d2p{off_x + x_i * pitch_h, off_y + y_i * pitch_v});
+            jcv_point p {off_x + x_i * pitch_h, off_y + y_i * pitch_v};
+            if (!mask || mask->contains(p.x, p.y))
+                out.push_back(p);
         }
 
         for (long long int x_i=0; x_i<points_x+1; x_i++) { /* allow one extra point to compensate for row shift */
-            out->push_back(d2p{off_x + (x_i - 0.5) * pitch_h, off_y + (y_i + 1) * pitch_v});
+            jcv_point p {off_x + (x_i - 0.5) * pitch_h, off_y + (y_i + 1) * pitch_v};
+            if (!mask || mask->contains(p.x, p.y))
+                out.push_back(p);
         }
     }
-
-    return out;
 }
 
-vector<d2p> *gerbolyze::sample_squaregrid(double w, double h, double center_distance) {
+void gerbolyze::sample_squaregrid(vector<jcv_point> &out, double w, double h, double center_distance, unsigned int,
+        const SamplingMask *mask) {
     /* offset of first square to make sure the entire area is covered. We use slightly larger values here to avoid
      * corner cases during clipping in the voronoi map generator.  The inaccuracies this causes at the edges are
      * negligible. */
@@ -85,15 +248,273 @@ vector<d2p> *gerbolyze::sample_squaregrid(double w, double h, double center_dist
     long long int points_x = ceil(w / center_distance);
     long long int points_y = ceil(h / center_distance);
 
-    vector<d2p> *out = new vector<d2p>();
-    out->reserve(points_x * points_y);
+    out.reserve(out.size() + points_x * points_y);
 
     for (long long int y_i=0; y_i<points_y; y_i++) {
         for (long long int x_i=0; x_i<points_x; x_i++) {
-            out->push_back({off_x + x_i*center_distance, off_y + y_i*center_distance});
+            jcv_point p {off_x + x_i*center_distance, off_y + y_i*center_distance};
+            if (!mask || mask->contains(p.x, p.y))
+                out.push_back(p);
+        }
+    }
+}
+
+
+bool SamplingMask::contains(double x, double y) const {
+    if (cols <= 0 || rows <= 0)
+        return false;
+
+    long long int cx = clamp((long long int)floor(x / cell_size), 0LL, cols-1);
+    long long int cy = clamp((long long int)floor(y / cell_size), 0LL, rows-1);
+    return cells[cy * cols + cx];
+}
+
+void SamplingMask::rects(double x0, double y0, double x1, double y1, vector<array<double, 4>> &out) const {
+    long long int cx0 = max(0LL, (long long int)floor(x0 / cell_size)), cy0 = max(0LL, (long long int)floor(y0 / cell_size));
+    long long int cx1 = min(cols, (long long int)ceil(x1 / cell_size)), cy1 = min(rows, (long long int)ceil(y1 / cell_size));
+    for (long long int cy = cy0; cy < cy1; cy++) {
+        for (long long int cx = cx0; cx < cx1; cx++) {
+            if (!cells[cy * cols + cx])
+                continue;
+
+            array<double, 4> r {
+                max(x0, cx * cell_size), max(y0, cy * cell_size),
+                min(x1, (cx+1) * cell_size), min(y1, (cy+1) * cell_size)};
+            if (r[2] > r[0] && r[3] > r[1])
+                out.push_back(r);
+        }
+    }
+}
+
+/* This builds a quadtree over the (already blurred) image. A quadtree node is split as long as the image varies inside
+ * it, until the node size comes within a factor of four of center_distance. Nodes that still vary at that size are
+ * detail leaves, and get dense sample points from the regular sampler, which only samples inside of them. Nodes that
+ * are flat become a single large voronoi cell, with their sample point at the center of the part of the node that lies
+ * inside the image.
+ *
+ * A flat node only gets its own point if that part is at least twice center_distance wide in both directions.
+ * Otherwise, it is treated as detail. This way, a flat node's point is at least center_distance away from any point
+ * outside of it, which is more than the minimum distance of the regular samplers, and every cell is at least as large
+ * as a regular cell. The minimum feature size logic in vectorize_image relies on both.
+ */
+void gerbolyze::sample_adaptive(const nopencv::Image32f &img, double w, double h, double center_distance,
+        sampling_fun sampler, unsigned int seed, vector<jcv_point> &out, vector<double> &cell_sizes) {
+    /* Standard deviation of pixel values (0-255) below which we consider a quadtree node flat */
+    constexpr double flat_stddev = 3.0;
+    /* Mid-tone flat nodes are kept small so halftone texture does not get too coarse. Near-black and near-white nodes
+     * render to either nothing or a solid fill, so they can be as large as they like. */
+    constexpr double midtone_max_cells = 4.0;
+    constexpr double extreme_lo = 0.03 * 255.0, extreme_hi = 0.97 * 255.0;
+
+    int cols = img.cols(), rows = img.rows();
+    if (cols <= 0 || rows <= 0 || !(w > 0 && h > 0 && center_distance > 0)) {
+        return;
+    }
+    double px_x = cols / w, px_y = rows / h;
+
+    /* Summed-area tables of pixel values and squared pixel values for O(1) mean/variance lookups. */
+    vector<double> sat((cols+1) * (rows+1), 0.0), sat_sq((cols+1) * (rows+1), 0.0);
+    for (int y=0; y<rows; y++) {
+        double acc = 0.0, acc_sq = 0.0;
+        for (int x=0; x<cols; x++) {
+            double v = img.at(x, y);
+            acc += v;
+            acc_sq += v*v;
+            sat[(y+1)*(cols+1) + x+1] = sat[y*(cols+1) + x+1] + acc;
+            sat_sq[(y+1)*(cols+1) + x+1] = sat_sq[y*(cols+1) + x+1] + acc_sq;
+        }
+    }
+
+    auto rect_sum = [cols](const vector<double> &t, int x0, int y0, int x1, int y1) {
+        return t[y1*(cols+1) + x1] - t[y0*(cols+1) + x1] - t[y1*(cols+1) + x0] + t[y0*(cols+1) + x0];
+    };
+
+    /* Find the smallest leaf size, and set up a mask of detail leaves at that resolution. */
+    double root_size = fmax(w, h);
+    double leaf_size = root_size;
+    while (leaf_size >= 4.0 * center_distance) {
+        leaf_size /= 2.0;
+    }
+
+    SamplingMask detail;
+    detail.cell_size = leaf_size;
+    detail.cols = (long long int)ceil(w / leaf_size);
+    detail.rows = (long long int)ceil(h / leaf_size);
+    detail.cells.resize(detail.cols * detail.rows, 0);
+
+    vector<jcv_point> flat_pts;
+    vector<double> flat_sizes;
+
+    std::function<void(double, double, double)> visit = [&](double x0, double y0, double size) {
+        if (x0 >= w || y0 >= h)
+            return;
+        double x1 = fmin(x0 + size, w), y1 = fmin(y0 + size, h);
+
+        int px0 = clamp((int)floor(x0 * px_x), 0, cols-1), py0 = clamp((int)floor(y0 * px_y), 0, rows-1);
+        int px1 = clamp((int)ceil(x1 * px_x), px0+1, cols), py1 = clamp((int)ceil(y1 * px_y), py0+1, rows);
+        double n = (px1 - px0) * (py1 - py0);
+        double mean = rect_sum(sat, px0, py0, px1, py1) / n;
+        double var = rect_sum(sat_sq, px0, py0, px1, py1) / n - mean*mean;
+        bool flat = sqrt(fmax(var, 0.0)) < flat_stddev
+            && (size <= midtone_max_cells * center_distance || mean < extreme_lo || mean > extreme_hi);
+        double extent = fmin(x1 - x0, y1 - y0);
+
+        if (flat && extent >= 2.0 * center_distance) {
+            flat_pts.push_back({(x0 + x1) / 2.0, (y0 + y1) / 2.0});
+            flat_sizes.push_back(extent);
+            return;
+        }
+
+        if (size >= 4.0 * center_distance) {
+            double half = size / 2.0;
+            visit(x0,        y0,        half);
+            visit(x0 + half, y0,        half);
+            visit(x0,        y0 + half, half);
+            visit(x0 + half, y0 + half, half);
+            return;
+        }
+
+        /* Detail leaf, or a flat node that is cut too narrow by the image border */
+        long long int mx0 = (long long int)round(x0 / leaf_size), my0 = (long long int)round(y0 / leaf_size);
+        long long int cells = (long long int)round(size / leaf_size);
+        for (long long int my = my0; my < min(my0 + cells, detail.rows); my++) {
+            for (long long int mx = mx0; mx < min(mx0 + cells, detail.cols); mx++) {
+                detail.cells[my * detail.cols + mx] = 1;
+            }
+        }
+    };
+    visit(0.0, 0.0, root_size);
+
+    size_t first = out.size();
+    sampler(out, w, h, center_distance, seed, &detail);
+    cell_sizes.resize(cell_sizes.size() + (out.size() - first), center_distance);
+
+    out.insert(out.end(), flat_pts.begin(), flat_pts.end());
+    cell_sizes.insert(cell_sizes.end(), flat_sizes.begin(), flat_sizes.end());
+}
+
+/* Generate a blue noise threshold mask using Ulichney's void-and-cluster method ("The void-and-cluster method for
+ * dither array generation", 1993). Energies are computed using a gaussian filter on the torus, so the resulting mask
+ * tiles seamlessly. Since kernel sums are constant, the "tightest cluster of zeros" of the original paper's third phase
+ * is simply the largest void of ones, which lets us treat phases two and three the same.
+ */
+static vector<double> generate_blue_noise_mask() {
+    constexpr int n = blue_noise_mask_size;
+    constexpr int num = n*n;
+    constexpr double sigma = 1.5;
+
+    /* Filter kernel indexed by wrapped coordinate differences */
+    vector<double> kernel(num);
+    for (int y=0; y<n; y++) {
+        for (int x=0; x<n; x++) {
+            int dx = min(x, n-x), dy = min(y, n-y);
+            kernel[y*n + x] = exp(-(dx*dx + dy*dy) / (2.0 * sigma * sigma));
+        }
+    }
+
+    vector<uint8_t> pattern(num, 0);
+    vector<double> energy(num, 0.0);
+    auto toggle = [&](int idx, bool set) {
+        pattern[idx] = set;
+        int px = idx % n, py = idx / n;
+        double sign = set ? 1.0 : -1.0;
+        for (int y=0; y<n; y++) {
+            const double *krow = &kernel[((y - py + n) % n) * n];
+            double *erow = &energy[y*n];
+            for (int x=0; x<n; x++) {
+                erow[x] += sign * krow[(x - px + n) % n];
+            }
         }
+    };
+
+    auto tightest_cluster = [&]() {
+        int best = -1;
+        for (int i=0; i<num; i++)
+            if (pattern[i] && (best < 0 || energy[i] > energy[best]))
+                best = i;
+        return best;
+    };
+
+    auto largest_void = [&]() {
+        int best = -1;
+        for (int i=0; i<num; i++)
+            if (!pattern[i] && (best < 0 || energy[i] < energy[best]))
+                best = i;
+        return best;
+    };
+
+    /* Initial binary pattern: Randomly place 10% minority pixels, then move them from clusters into voids until this
+     * converges. A fixed seed keeps the mask identical between runs. */
+    mt19937 rng(0);
+    uniform_int_distribution<int> dist(0, num-1);
+    int ones = num / 10;
+    for (int placed = 0; placed < ones;) {
+        int idx = dist(rng);
+        if (!pattern[idx]) {
+            toggle(idx, true);
+            placed++;
+        }
+    }
+
+    for (int i=0; i<num; i++) {
+        int cluster = tightest_cluster();
+        toggle(cluster, false);
+        int vd = largest_void();
+        toggle(vd, true);
+        if (vd == cluster)
+            break;
     }
 
+    vector<uint8_t> prototype(pattern);
+    vector<double> prototype_energy(energy);
+    vector<int> rank(num);
+
+    /* Phase 1: Rank the initial pattern's pixels by removing them from the tightest cluster on. */
+    for (int r=ones-1; r>=0; r--) {
+        int cluster = tightest_cluster();
+        toggle(cluster, false);
+        rank[cluster] = r;
+    }
+
+    /* Phases 2 and 3: Rank all remaining pixels by filling up the largest void. */
+    pattern.swap(prototype);
+    energy.swap(prototype_energy);
+    for (int r=ones; r<num; r++) {
+        int vd = largest_void();
+        toggle(vd, true);
+        rank[vd] = r;
+    }
+
+    vector<double> out(num);
+    for (int i=0; i<num; i++) {
+        out[i] = (rank[i] + 0.5) / num;
+    }
     return out;
 }
 
+const vector<double> &gerbolyze::blue_noise_mask() {
+    static const vector<double> mask = generate_blue_noise_mask();
+    return mask;
+}
+
+/* Filling in a cell can create a new diagonal with cells in the row above, or to the left of it, which a single pass
+ * has already checked. Since cells only ever get set, repeating the pass until nothing changes terminates. In practice,
+ * this takes two or three passes. */
+void gerbolyze::fix_diagonal_cells(vector<uint8_t> &cells, int cols, int rows) {
+    auto cell = [&](int i, int j) -> uint8_t & { return cells[(size_t)j*cols + i]; };
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int j=0; j+1<rows; j++) {
+            for (int i=0; i+1<cols; i++) {
+                if (cell(i, j) && cell(i+1, j+1) && !cell(i+1, j) && !cell(i, j+1)) {
+                    cell(i+1, j) = 1;
+                    changed = true;
+                } else if (!cell(i, j) && !cell(i+1, j+1) && cell(i+1, j) && cell(i, j+1)) {
+                    cell(i, j) = 1;
+                    changed = true;
+                }
+            }
+        }
+    }
+}
@@ -20,8 +20,10 @@
 
 #include <array>
 #include <vector>
+#include <cstdint>
 #include <functional>
-#include <gerbolyze.hpp>
+#include "jc_voronoi.h"
+#include "nopencv.hpp"
 
 namespace gerbolyze {
 
@@ -31,11 +33,44 @@ enum grid_type {
     SQUAREGRID
 };
 
+/* Raster of square cells starting at the origin that restricts where a sampler places points. Points are only placed
+ * in cells that are set. Coordinates outside of the raster are looked up in the nearest cell. */
+struct SamplingMask {
+    double cell_size = 1.0;
+    long long int cols = 0, rows = 0;
+    std::vector<uint8_t> cells;
+
+    bool contains(double x, double y) const;
+    /* Append the set parts of the given rectangle to out as x0, y0, x1, y1 */
+    void rects(double x0, double y0, double x1, double y1, std::vector<std::array<double, 4>> &out) const;
+};
+
+/* Samplers append their points to a caller-owned buffer of jcv_points so that the buffer can be handed to the voronoi
+ * generator as-is. Arguments are: output buffer, width, height, center distance, random seed, and an optional mask. */
+typedef std::function<void (std::vector<jcv_point> &, double, double, double, unsigned int, const SamplingMask *)> sampling_fun;
+
 sampling_fun get_sampler(enum grid_type type);
 
-std::vector<d2p> *sample_poisson_disc(double w, double h, double center_distance);
-std::vector<d2p> *sample_hexgrid(double w, double h, double center_distance);
-std::vector<d2p> *sample_squaregrid(double w, double h, double center_distance);
+void sample_poisson_disc(std::vector<jcv_point> &out, double w, double h, double center_distance, unsigned int seed,
+        const SamplingMask *mask=nullptr);
+void sample_hexgrid(std::vector<jcv_point> &out, double w, double h, double center_distance, unsigned int seed=0,
+        const SamplingMask *mask=nullptr);
+void sample_squaregrid(std::vector<jcv_point> &out, double w, double h, double center_distance, unsigned int seed=0,
+        const SamplingMask *mask=nullptr);
+
+/* Adaptive cell placement for the voronoi vectorizer. Places dense points from the given sampler only where the image
+ * has detail, and one point per large flat area. cell_sizes gets the nominal center distance of each output point. */
+void sample_adaptive(const nopencv::Image32f &img, double w, double h, double center_distance, sampling_fun sampler,
+        unsigned int seed, std::vector<jcv_point> &out, std::vector<double> &cell_sizes);
+
+/* Tileable blue noise threshold mask of blue_noise_mask_size x blue_noise_mask_size entries in row-major order. Each
+ * threshold in (0, 1) occurs exactly once. The mask is generated on first use. */
+constexpr int blue_noise_mask_size = 64;
+const std::vector<double> &blue_noise_mask();
+
+/* Fill in cells of a row-major grid of set/unset cells so that no two set cells and no two unset cells touch only at
+ * their corners. */
+void fix_diagonal_cells(std::vector<uint8_t> &cells, int cols, int rows);
 
 } /* namespace gerbolyze */
 
@@ -25,6 +25,8 @@ from pathlib import Path
 import gerbonara
 import pytest
 
+import gerbolyze
+
 
 REFERENCE_GERBERS = ['test_gerber_8seg.zip']
 REFERENCE_SVGS = ['svg_feature_test.svg']
@@ -33,6 +35,10 @@ reference_path = lambda reference: Path(__file__).with_name('resources') / str(r
 svg_flatten_path = Path(__file__).parent.parent  / 'svg-flatten' / 'build' / 'svg-flatten'
 
 
+def run_svg_flatten(*args):
+    svg_flatten = os.environ.get('SVG_FLATTEN', str(svg_flatten_path.absolute()))
+    subprocess.run([svg_flatten, *args], check=True, capture_output=True)
+
 def run_gerbolyze(*args):
     try:
         env = dict(os.environ)
@@ -121,3 +127,67 @@ def test_convert_layers():
         assert stack.drill_pth.drill_sizes() == [0.7]
         assert stack.drill_npth.drill_sizes() == [0.5]
 
+def normalized_layers(grb):
+    """ Objects of a gerbonara GerberFile grouped into runs of the same polarity, ignoring order within each run.
+
+    Gerber output drops duplicate vertices and zero-area regions, which the binary polygon stream keeps. """
+    layers = []
+    for obj in grb.objects:
+        if isinstance(obj, gerbonara.graphic_objects.Region):
+            pts = []
+            for x, y in obj.outline:
+                pt = (round(x, 5), round(y, 5))
+                if not pts or pts[-1] != pt:
+                    pts.append(pt)
+            if len(pts) > 1 and pts[0] == pts[-1]:
+                pts.pop()
+            if len(pts) < 3:
+                continue
+            i = pts.index(min(pts))
+            key = ('region', tuple(pts[i:] + pts[:i]))
+
+        elif isinstance(obj, gerbonara.graphic_objects.Line):
+            if (obj.x1, obj.y1) == (obj.x2, obj.y2):
+                continue
+            key = ('line', round(obj.aperture.diameter, 5),
+                   round(obj.x1, 5), round(obj.y1, 5), round(obj.x2, 5), round(obj.y2, 5))
+
+        elif isinstance(obj, gerbonara.graphic_objects.Flash):
+            key = ('flash', round(obj.aperture.diameter, 5), round(obj.x, 5), round(obj.y, 5))
+
+        else:
+            raise TypeError(f'Unexpected object {obj}')
+
+        if not layers or layers[-1][0] != obj.polarity_dark:
+            layers.append((obj.polarity_dark, set()))
+        layers[-1][1].add(key)
+    return layers
+
+@pytest.mark.parametrize('reference', [*REFERENCE_SVGS, 'layers.svg'])
+def test_polygon_stream_matches_gerber(reference):
+    infile = reference_path(reference)
+    with tempfile.NamedTemporaryFile(suffix='.gbr') as out_gbr,\
+            tempfile.NamedTemporaryFile(suffix='.bin') as out_bin:
+        run_svg_flatten('--format', 'gerber', '--precision', '6', infile, out_gbr.name)
+        run_svg_flatten('--format', 'binary', '--precision', '6', infile, out_bin.name)
+
+        from_gerber = normalized_layers(gerbonara.rs274x.GerberFile.open(out_gbr.name))
+        from_stream = normalized_layers(gerbolyze.load_polygon_stream(out_bin.name))
+        assert sum(len(objs) for _pol, objs in from_gerber) > 0
+        assert from_stream == from_gerber
+
+def test_svg_to_gerber_falls_back_to_gerber_text(monkeypatch, tmp_path):
+    # Stand-in for an svg-flatten from before 3.4.0, which rejects the binary format
+    svg_flatten = os.environ.get('SVG_FLATTEN', str(svg_flatten_path.absolute()))
+    wrapper = tmp_path / 'svg-flatten'
+    wrapper.write_text(f'#!/bin/sh\ncase "$*" in *"--format binary"*) echo "Unknown output format" >&2; exit 1;; esac\n'
+                       f'exec "{svg_flatten}" "$@"\n')
+    wrapper.chmod(0o755)
+    monkeypatch.setenv('SVG_FLATTEN', str(wrapper))
+
+    infile = reference_path(REFERENCE_SVGS[0])
+    with tempfile.NamedTemporaryFile(suffix='.gbr') as out_gbr:
+        run_svg_flatten('--format', 'gerber', '--precision', '6', infile, out_gbr.name)
+        expected = normalized_layers(gerbonara.rs274x.GerberFile.open(out_gbr.name))
+
+    assert normalized_layers(gerbolyze.svg_to_gerber(infile)) == expected